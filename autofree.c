@@ -21,9 +21,12 @@ AutoFree *af_new(void) {
 }
 
 void af_free(AutoFree *af) {
-  BlockList *l;
-  for (l = af->l; l; l = l->next)
-    free(l->next);
+  BlockList *l, *next;
+  for (l = af->l; l; l = next) {
+    next = l->next;
+    free(l->block);
+    free(l);
+  }
   free(af);
 }
 
@@ -36,7 +39,11 @@ void *af_add(AutoFree *af, void *block) {
   return block;
 }
 
-void *af_alloc(AutoFree *af, unsigned size) {
+void *af_alloc(AutoFree *af, size_t size) {
   void *block = calloc(1, size);
   return af_add(af, block);
 }
+
+void *af_dict_alloc(void *af, size_t size) {
+  return af_alloc(af, size);
+}
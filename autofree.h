@@ -3,12 +3,23 @@
 #ifndef __autofree_h
 #define __autofree_h
 
+#include <stddef.h>
+
 typedef struct AutoFree AutoFree;
 
 AutoFree *af_new(void);
 void af_free(AutoFree*);
 void *af_add(AutoFree *, void *);
-void *af_alloc(AutoFree *, unsigned size);
+void *af_alloc(AutoFree *, size_t size);
+
+/* Allocation hook for dict_new_with_allocator(). Everything is
+ * released by af_free(), so no deallocation hook is needed:
+ *   Dict *d = dict_new_with_allocator (&staticstrkeyfuncs, af,
+ *                                      af_dict_alloc, NULL);
+ *   ...
+ *   af_free (af);   // instead of dict_free (d)
+ */
+void *af_dict_alloc(void *af, size_t size);
 
 #define AUTOFREE AutoFree *__af = af_new()
 #define AF_END af_free(__af)
@@ -8,13 +8,21 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "dict.h"
 
 /* Key functions for regular strings as keys. Strings are copied and
    owned by the dictionary */
 static unsigned
-strhash (const char *c)
+strhash_len (const char *c, size_t *len_p)
 {
+  const char *start = c;
   unsigned int hash = 0;
   const int bits = sizeof (unsigned) * CHAR_BIT;
   while (*c)
@@ -22,6 +30,30 @@ strhash (const char *c)
       hash += (*c) + (hash << 3) + (hash >> (bits - 3));
       c++;
     }
+  *len_p = c - start;
+  return hash;
+}
+
+static unsigned
+strhash (const char *c)
+{
+  size_t len;
+  return strhash_len (c, &len);
+}
+
+/* FNV-1a from a seeded basis, finished with MurmurHash3's 64-bit
+   mix so that every bit of the result depends on every byte. */
+unsigned long long
+dict_strhash_seeded (const char *s, unsigned long long seed)
+{
+  uint64_t hash = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+  while (*s)
+    hash = (hash ^ (unsigned char)*s++) * 0x100000001b3ull;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
   return hash;
 }
 
@@ -76,12 +108,114 @@ DictKeyFuncs ptrkeyfuncs = {
   NULL
 };
 
+/* Fixed-size binary keys. The order is only required to be
+   consistent, so 8-byte keys compare as integers. */
+DictKeyFuncs fixed8keyfuncs = { NULL, NULL, NULL, NULL, 8 };
+DictKeyFuncs fixed16keyfuncs = { NULL, NULL, NULL, NULL, 16 };
+DictKeyFuncs fixed32keyfuncs = { NULL, NULL, NULL, NULL, 32 };
+
+static inline int
+fixed_cmp8 (const void *a, const void *b)
+{
+  uint64_t x, y;
+  memcpy (&x, a, 8);
+  memcpy (&y, b, 8);
+  return (x > y) - (x < y);
+}
+
+static inline int
+fixed_cmp16 (const void *a, const void *b)
+{
+#ifdef __SSE2__
+  __m128i x = _mm_loadu_si128 ((const __m128i *)a);
+  __m128i y = _mm_loadu_si128 ((const __m128i *)b);
+  unsigned differ = ~_mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y)) & 0xffff;
+  int i;
+  if (!differ)
+    return 0;
+  i = __builtin_ctz (differ);
+  return ((const unsigned char *)a)[i] - ((const unsigned char *)b)[i];
+#else
+  int cmp = fixed_cmp8 (a, b);
+  return cmp ? cmp : fixed_cmp8 ((const char *)a + 8, (const char *)b + 8);
+#endif
+}
+
+static int
+fixed_cmp (size_t width, const void *a, const void *b)
+{
+  int cmp;
+  switch (width)
+    {
+    case 8:
+      return fixed_cmp8 (a, b);
+    case 16:
+      return fixed_cmp16 (a, b);
+    case 32:
+      cmp = fixed_cmp16 (a, b);
+      return cmp ? cmp : fixed_cmp16 ((const char *)a + 16,
+                                      (const char *)b + 16);
+    default:
+      return memcmp (a, b, width);
+    }
+}
+
+/* Hash a word at a time, finishing off with any odd bytes. */
+static inline unsigned
+fixed_hash_words (const unsigned char *p, size_t width)
+{
+  uint64_t hash = width;
+  for (; width >= 8; p += 8, width -= 8)
+    {
+      uint64_t w;
+      memcpy (&w, p, 8);
+      hash = (hash ^ w) * 0x9e3779b97f4a7c15ull;
+      hash ^= hash >> 29;
+    }
+  for (; width; p++, width--)
+    hash = (hash ^ *p) * 0x100000001b3ull;
+  return hash ^ (hash >> 32);
+}
+
+static unsigned
+fixed_hash (size_t width, const void *k)
+{
+  /* Let the common widths be unrolled. */
+  switch (width)
+    {
+    case 8:
+      return fixed_hash_words (k, 8);
+    case 16:
+      return fixed_hash_words (k, 16);
+    case 32:
+      return fixed_hash_words (k, 32);
+    default:
+      return fixed_hash_words (k, width);
+    }
+}
+
+static inline int
+key_cmp (DictKeyFuncs *funcs, const void *a, const void *b)
+{
+  if (funcs->key_width)
+    return fixed_cmp (funcs->key_width, a, b);
+  return funcs->cmp_fn (a, b);
+}
+
 
 /* ------------------------------------------------------------
  * Dictionary data structures
  */
 
 typedef struct DictNode DictNode;
+typedef struct DictPage DictPage;
+typedef struct DictVersions DictVersions;
+typedef struct DictCache DictCache;
+typedef struct DictKeyArena DictKeyArena;
+typedef struct DictRadix DictRadix;
+typedef struct DictHugeHeap DictHugeHeap;
+typedef struct DictSlab DictSlab;
+typedef struct DictOrdered DictOrdered;
 
 struct Dict
 {
@@ -90,20 +224,382 @@ struct Dict
   DictKeyFuncs *keyfuncs;
   int n_entries;
   int rehash_benefit;
+  DictBuckets buckets;
+  int n_pages;                  /* Paged buckets */
+  DictOrdered *ordered;         /* Ordered buckets */
+  unsigned promote_tick;        /* Adaptive buckets */
+  int n_iterators;              /* Buckets mustn't change shape if >0 */
+  unsigned n_changes;           /* Entries added, removed, copied or moved */
+  DictVersions *versions;       /* Non-NULL for versioned dictionaries */
+  DictCache *cache;             /* Non-NULL for cache dictionaries */
+  DictKeyArena *arena;          /* Non-NULL for string arena dictionaries */
+  DictRadix *radix;             /* Non-NULL for radix tree dictionaries */
+  DictHugeHeap *huge;           /* Non-NULL for huge page dictionaries */
+  DictSlab *slabs;              /* Nodes laid out by dict_defragment() */
+  size_t slab_dead;             /* Bytes of those nodes since deleted */
+  DictAllocFn alloc_fn;
+  DictDeallocFn dealloc_fn;     /* NULL if blocks needn't be freed */
+  void *alloc_ctx;
 };
 
 struct DictNode
 {
   DictEntry entry;
   unsigned hash;
+  /* The flags share their bytes with the epoch, so they mean nothing
+     in a versioned dictionary. */
+  union
+  {
+    unsigned epoch;             /* Versioned: epoch the node was written in */
+    struct
+    {
+      unsigned char referenced; /* Cache: CLOCK reference bit */
+      unsigned char in_slab;    /* Laid out by dict_defragment() */
+      unsigned char key_in_slab; /* The key too, so not to be freed */
+    };
+  };
   DictNode *children[2];
+  unsigned char key_data[];     /* Fixed-size keys are kept here */
+};
+
+/* dict_defragment() copies the nodes of each bucket into slabs, next
+   to each other, with copies of their keys if they are strings of the
+   dictionary's own. Nodes and keys in slabs aren't freed one by one:
+   their space is only reclaimed when the slab is, by the next
+   dict_defragment() or dict_free(). A key in a slab may end up in
+   another node, when entries are exchanged, so the flag saying so
+   moves with the entry. */
+#define SLAB_SIZE 65536
+
+struct DictSlab
+{
+  DictSlab *next;
+  size_t size;
+  size_t used;
+  unsigned char data[];
+};
+
+/* Versioned dictionaries aren't defragmented, and their nodes' flags
+   are bytes of the epoch. */
+static inline bool
+node_in_slab (Dict *d, DictNode *n)
+{
+  return !d->versions && n->in_slab;
+}
+
+static inline bool
+key_in_slab (Dict *d, DictNode *n)
+{
+  return !d->versions && n->key_in_slab;
+}
+
+/* Paged buckets are B-trees whose nodes hold up to PAGE_KEYS entries,
+   ordered by hash and then key. Everything needed to pass through a
+   page (hashes, count and children) fits in its first 64 bytes. */
+#define PAGE_KEYS 4
+
+struct DictPage
+{
+  unsigned hashes[PAGE_KEYS];
+  unsigned n;
+  DictPage *children[PAGE_KEYS + 1];
+  DictEntry entries[PAGE_KEYS];
+};
+
+/* Slot array of a dictionary with paged buckets */
+#define PAGE_SLOTS(d) ((DictPage **)(d)->slots)
+
+/* Ordered buckets keep the entries in a dense array, in the order they
+   were added, and the slots hold only their positions (plus one, as 0
+   is an empty slot), probed linearly from the slot given by the hash.
+   Deleted entries stay in the array, and in the slots as tombstones,
+   until the array is compacted. There are twice as many slots as
+   entries allocated. */
+#define ORDERED_SLOTS(d) ((unsigned *)(d)->slots)
+
+struct DictOrdered
+{
+  unsigned char *entries;
+  unsigned n_used;              /* Including deleted entries */
+  unsigned n_deleted;
+  unsigned size;                /* Entries allocated */
+};
+
+typedef struct DictOrderedEntry DictOrderedEntry;
+struct DictOrderedEntry
+{
+  DictEntry entry;
+  unsigned hash;
+  unsigned deleted;
+  unsigned char key_data[];     /* Fixed-size keys are kept here */
 };
 
+/* Radix tree dictionaries keep string keys in an adaptive radix tree
+   with compressed paths. Inner nodes have room for 4, 16, 48 or 256
+   children and are followed by their prefix: the bytes, shared by
+   every key below, that come before the byte choosing a child. A
+   key's terminating NUL chooses a child like any other byte, so no
+   key is a prefix of another. Children are tagged pointers; leaves
+   have the low bit set. */
+enum { RADIX_4, RADIX_16, RADIX_48, RADIX_256 };
+
+typedef struct RadixNode RadixNode;
+struct RadixNode
+{
+  unsigned char type;
+  unsigned short n_children;
+  unsigned prefix_len;
+};
+
+typedef struct RadixNode4 RadixNode4;
+struct RadixNode4
+{
+  RadixNode h;
+  unsigned char keys[4];        /* Sorted */
+  void *children[4];
+};
+
+typedef struct RadixNode16 RadixNode16;
+struct RadixNode16
+{
+  RadixNode h;
+  unsigned char keys[16];       /* Sorted */
+  void *children[16];
+};
+
+typedef struct RadixNode48 RadixNode48;
+struct RadixNode48
+{
+  RadixNode h;
+  unsigned char index[256];     /* 1 + position in children, or 0 */
+  void *children[48];
+};
+
+typedef struct RadixNode256 RadixNode256;
+struct RadixNode256
+{
+  RadixNode h;
+  void *children[256];
+};
+
+/* A leaf holds the rest of its key, after the byte choosing it. */
+typedef struct RadixLeaf RadixLeaf;
+struct RadixLeaf
+{
+  DictEntry entry;
+  char tail[];
+};
+
+struct DictRadix
+{
+  void *root;
+  size_t bytes;                 /* Allocated to nodes and leaves */
+};
+
+/* All memory belonging to a dictionary comes from its allocator. */
+static void *
+mem_alloc (Dict *d, size_t size)
+{
+  return d->alloc_fn (d->alloc_ctx, size);
+}
+
+static void *
+mem_zalloc (Dict *d, size_t size)
+{
+  void *p = d->alloc_fn (d->alloc_ctx, size);
+  memset (p, 0, size);
+  return p;
+}
+
+static void
+mem_free (Dict *d, void *p)
+{
+  if (d->dealloc_fn && p)
+    d->dealloc_fn (d->alloc_ctx, p);
+}
+
+static void *
+default_alloc (void *ctx, size_t size)
+{
+  return malloc (size);
+}
+
+static void
+default_dealloc (void *ctx, void *p)
+{
+  free (p);
+}
+
+/* Huge page dictionaries allocate from regions aligned to HUGE_SIZE,
+   each starting with a header. Blocks of up to HUGE_MAX_BLOCK bytes are
+   carved from regions holding only blocks of their size class, so a
+   block's size is found from the header of the region it lies in;
+   larger blocks (slot arrays) get a region of their own. Regions are
+   unmapped when the dictionary is freed. */
+#define HUGE_SIZE (2u << 20)
+#define HUGE_HEADER 64
+#define HUGE_GRAIN 16
+#define HUGE_MAX_BLOCK 1024
+#define HUGE_CLASSES (HUGE_MAX_BLOCK / HUGE_GRAIN)
+
+typedef struct DictHugeRegion DictHugeRegion;
+struct DictHugeRegion
+{
+  DictHugeRegion *next, *prev;
+  size_t size;                  /* Of the mapping */
+  size_t block_size;            /* 0 for a single large block */
+};
+
+struct DictHugeHeap
+{
+  DictHugeRegion *regions;
+  void *free[HUGE_CLASSES];     /* Freed blocks, linked through them */
+  char *next[HUGE_CLASSES];     /* Unused space in each class's region */
+  char *end[HUGE_CLASSES];
+};
+
+/* Map SIZE bytes (a multiple of HUGE_SIZE) at an aligned address, by
+   over-allocating and trimming. Without transparent huge pages the
+   advice fails, leaving ordinary pages. */
+static DictHugeRegion *
+huge_map (DictHugeHeap *h, size_t size)
+{
+  char *p = mmap (NULL, size + HUGE_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *start;
+  DictHugeRegion *r;
+  if (p == MAP_FAILED)
+    return NULL;
+  start = (char *)(((uintptr_t)p + HUGE_SIZE - 1)
+                   & ~(uintptr_t)(HUGE_SIZE - 1));
+  if (start > p)
+    munmap (p, start - p);
+  munmap (start + size, p + HUGE_SIZE - start);
+#ifdef MADV_HUGEPAGE
+  madvise (start, size, MADV_HUGEPAGE);
+#endif
+  r = (DictHugeRegion *)start;
+  r->size = size;
+  r->prev = NULL;
+  r->next = h->regions;
+  if (r->next)
+    r->next->prev = r;
+  h->regions = r;
+  return r;
+}
+
+static void *
+huge_alloc (void *ctx, size_t size)
+{
+  DictHugeHeap *h = ctx;
+  DictHugeRegion *r;
+  void *p;
+  unsigned c;
+  if (size > HUGE_MAX_BLOCK)
+    {
+      size = (HUGE_HEADER + size + HUGE_SIZE - 1) & ~(size_t)(HUGE_SIZE - 1);
+      r = huge_map (h, size);
+      if (!r)
+        return NULL;
+      r->block_size = 0;
+      return (char *)r + HUGE_HEADER;
+    }
+  c = size ? (size - 1) / HUGE_GRAIN : 0;
+  if (h->free[c])
+    {
+      p = h->free[c];
+      h->free[c] = *(void **)p;
+      return p;
+    }
+  size = (c + 1) * HUGE_GRAIN;
+  if (h->next[c] + size > h->end[c])
+    {
+      r = huge_map (h, HUGE_SIZE);
+      if (!r)
+        return NULL;
+      r->block_size = size;
+      h->next[c] = (char *)r + HUGE_HEADER;
+      h->end[c] = (char *)r + HUGE_SIZE;
+    }
+  p = h->next[c];
+  h->next[c] += size;
+  return p;
+}
+
+static void
+huge_dealloc (void *ctx, void *p)
+{
+  DictHugeHeap *h = ctx;
+  DictHugeRegion *r =
+    (DictHugeRegion *)((uintptr_t)p & ~(uintptr_t)(HUGE_SIZE - 1));
+  if (r->block_size)
+    {
+      unsigned c = r->block_size / HUGE_GRAIN - 1;
+      *(void **)p = h->free[c];
+      h->free[c] = p;
+      return;
+    }
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    h->regions = r->next;
+  if (r->next)
+    r->next->prev = r->prev;
+  munmap (r, r->size);
+}
+
+static void
+huge_release (DictHugeHeap *h)
+{
+  DictHugeRegion *r = h->regions;
+  while (r)
+    {
+      DictHugeRegion *next = r->next;
+      munmap (r, r->size);
+      r = next;
+    }
+  free (h);
+}
+
+/* Keys' hashes are mixed before use, so that every bit of the hash
+   depends on every bit of the key functions' hash. The mix is
+   invertible, so keys with different hashes still differ. */
+static unsigned
+mix_hash (unsigned hash)
+{
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/* Mixed hash of key K */
+static unsigned
+key_hash (DictKeyFuncs *funcs, const void *k)
+{
+  if (funcs->key_width && !funcs->hash_fn)
+    return mix_hash (fixed_hash (funcs->key_width, k));
+  return mix_hash (funcs->hash_fn (k));
+}
+
+/* The slot is given by the top bits of the hash, so that, as buckets
+   are ordered by hash, the slots' contents in order are all the
+   entries in order of hash whatever the size of the table. A table of
+   one slot takes no bits, which a shift by the hash's width can't do. */
+static unsigned
+slot_index (unsigned hash, unsigned l2_n_slots)
+{
+  if (l2_n_slots == 0)
+    return 0;
+  return hash >> (sizeof (unsigned) * CHAR_BIT - l2_n_slots);
+}
+
 static unsigned
 hash_to_index (Dict * d, unsigned hash)
 {
-  return ((hash + (hash >> d->l2_n_slots))
-          & ((1u << d->l2_n_slots) -1));
+  return slot_index (hash, d->l2_n_slots);
 }
 
 typedef struct Indent Indent;
@@ -170,6 +666,99 @@ dict_dump_nodes (Dict *d, FILE *out,
 
 }
 
+static void
+dict_dump_page (Dict *d, FILE *out,
+                void (*print) (FILE *out, const void *k, void *value),
+                DictPage *p, int depth, int *total_depth, int *n_entries)
+{
+  int i;
+  for (i = 0; i <= p->n; i++)
+    {
+      if (p->children[i])
+        dict_dump_page (d, out, print, p->children[i], depth + 1,
+                        total_depth, n_entries);
+      if (i < p->n)
+        {
+          fprintf (out, "%*s", 4 * depth + 4, "");
+          fprintf (out, "hash=0x%x ", p->hashes[i]);
+          if (print)
+            print (out, p->entries[i].key, p->entries[i].value);
+          else
+            fprintf (out, "'%s' => %p", (const char *)p->entries[i].key,
+                     p->entries[i].value);
+          fputc ('\n', out);
+          *total_depth += 1 + depth;
+          *n_entries += 1;
+        }
+    }
+}
+
+static void
+dict_dump_list (Dict *d, FILE *out,
+                void (*print) (FILE *out, const void *k, void *value),
+                DictNode *n, int *total_depth, int *n_entries)
+{
+  int depth;
+  for (depth = 0; n; n = n->children[0], depth++)
+    {
+      fprintf (out, "    hash=0x%x ", n->hash);
+      if (print)
+        print (out, n->entry.key, n->entry.value);
+      else
+        fprintf (out, "'%s' => %p", (const char *)n->entry.key,
+                 n->entry.value);
+      fputc ('\n', out);
+      *total_depth += 1 + depth;
+      *n_entries += 1;
+    }
+}
+
+static void dict_dump_radix (Dict *d, FILE *out,
+                             void (*print) (FILE *out, const void *k,
+                                            void *value));
+static void dict_dump_dot_radix (FILE *out, void *p);
+static DictOrderedEntry *ordered_entry (Dict *d, unsigned pos);
+
+/* Ordered buckets are dumped in order, followed by the average number
+   of slots probed to find an entry. */
+static void
+dict_dump_ordered (Dict *d, FILE *out,
+                   void (*print) (FILE *out, const void *k, void *value))
+{
+  unsigned i, mask = (1u << d->l2_n_slots) - 1;
+  unsigned total_probes = 0;
+  fprintf (out, "Dictionary at %p\n", d);
+  for (i = 0; i < d->ordered->n_used; i++)
+    {
+      DictOrderedEntry *e = ordered_entry (d, i);
+      fprintf (out, "[%u]: ", i);
+      if (e->deleted)
+        fprintf (out, "(deleted)");
+      else
+        {
+          fprintf (out, "hash=0x%x ", e->hash);
+          if (print)
+            print (out, e->entry.key, e->entry.value);
+          else
+            fprintf (out, "'%s' => %p", (const char *)e->entry.key,
+                     e->entry.value);
+        }
+      fputc ('\n', out);
+    }
+  for (i = 0; i <= mask; i++)
+    if (ORDERED_SLOTS (d)[i])
+      {
+        DictOrderedEntry *e = ordered_entry (d, ORDERED_SLOTS (d)[i] - 1);
+        if (!e->deleted)
+          total_probes += 1 + ((i - hash_to_index (d, e->hash)) & mask);
+      }
+  fprintf (out, "n_entries=%d, deleted=%u, allocated=%u, slots=%d\n",
+           d->n_entries, d->ordered->n_deleted, d->ordered->size,
+           (1u << d->l2_n_slots));
+  fprintf (out, "average probes=%f\n",
+           (double)total_probes / d->n_entries);
+}
+
 void
 dict_dump (Dict * d, FILE * out,
 	   void (*print) (FILE * out, const void *k, void *value))
@@ -180,6 +769,16 @@ dict_dump (Dict * d, FILE * out,
   int total_ideal_depth = 0;
   int occupied = 0;
   int total_nodes = 0;
+  if (d->radix)
+    {
+      dict_dump_radix (d, out, print);
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      dict_dump_ordered (d, out, print);
+      return;
+    }
   total_depth = 0;
   fprintf (out, "Dictionary at %p\n", d);
   for (i = 0; i < (1u << d->l2_n_slots); i++)
@@ -193,9 +792,16 @@ dict_dump (Dict * d, FILE * out,
           int ideal_depth = 0;
 
           occupied++;
-          dict_dump_nodes (d, out, print, n, 0, 2,
-                           &bucket_total_depth,
-                           &n_bucket_entries, NULL);
+          if (d->buckets == DICT_BUCKETS_PAGES)
+            dict_dump_page (d, out, print, (DictPage *)n, 0,
+                            &bucket_total_depth, &n_bucket_entries);
+          else if (d->buckets == DICT_BUCKETS_LIST)
+            dict_dump_list (d, out, print, n,
+                            &bucket_total_depth, &n_bucket_entries);
+          else
+            dict_dump_nodes (d, out, print, n, 0, 2,
+                             &bucket_total_depth,
+                             &n_bucket_entries, NULL);
           
           /* Calculate the total depth of a perfectly balanced
              tree containing N_BUCKET_ENTRIES nodes */
@@ -233,10 +839,20 @@ dict_dump (Dict * d, FILE * out,
   fprintf (out, "n_entries=%d, total_nodes=%d, rehash_benefit=%d, slots=%d\n",
            d->n_entries, total_nodes, d->rehash_benefit,
            (1u << d->l2_n_slots));
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    fprintf (out, "pages=%d, %f entries per page\n", d->n_pages,
+             (double)d->n_entries / d->n_pages);
   fprintf (out, "occupied=%f%%, average depth=%f, efficiency=%f%%\n",
            100.0 * (double)occupied/(1u<<d->l2_n_slots),
            (double)total_depth / d->n_entries,
            100.0 * total_ideal_depth / total_depth);
+  if (d->cache)
+    {
+      DictStats stats;
+      dict_get_stats (d, &stats);
+      fprintf (out, "hits=%lu, misses=%lu, evictions=%lu\n",
+               stats.hits, stats.misses, stats.evictions);
+    }
 }
 
 static const char *dict_dump_fmt;
@@ -277,12 +893,70 @@ dict_dump_dot_node (Dict *d, FILE *out,
 }
 
 
+static void
+dict_dump_dot_page (Dict *d, FILE *out,
+                    void (*print) (FILE * out, const void *k, void *value),
+                    DictPage *p)
+{
+  int i;
+  fprintf (out, "  \"%p\" [ shape=record, label=\"", p);
+  for (i = 0; i <= p->n; i++)
+    {
+      fprintf (out, "%s<c%d>", i ? "|" : "", i);
+      if (i < p->n)
+        {
+          fprintf (out, "|");
+          if (print)
+            print (out, p->entries[i].key, p->entries[i].value);
+          else
+            fprintf (out, "%s: %p", (const char *)p->entries[i].key,
+                     p->entries[i].value);
+        }
+    }
+  fprintf (out, "\"];\n");
+  for (i = 0; i <= p->n; i++)
+    if (p->children[i])
+      {
+        dict_dump_dot_page (d, out, print, p->children[i]);
+        fprintf (out, "  \"%p\":c%d -> \"%p\";\n", p, i, p->children[i]);
+      }
+}
+
 /* Dump dictionary in dot format */
 void dict_dump_dot (Dict *d, FILE *out,
                     void (*print) (FILE * out, const void *k, void *value))
 {
   int i;
   fprintf (out, "digraph \"dict\" {\n  rankdir=LR;\n");
+  if (d->radix)
+    {
+      if (d->radix->root)
+        dict_dump_dot_radix (out, d->radix->root);
+      fprintf (out, "}\n");
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      /* A single record, of the entries in order */
+      bool first = true;
+      fprintf (out, "  entries [ shape=record, label=\"");
+      for (i = 0; i < d->ordered->n_used; i++)
+        {
+          DictOrderedEntry *e = ordered_entry (d, i);
+          if (e->deleted)
+            continue;
+          if (!first)
+            fprintf (out, "|");
+          first = false;
+          if (print)
+            print (out, e->entry.key, e->entry.value);
+          else
+            fprintf (out, "%s: %p", (const char *)e->entry.key,
+                     e->entry.value);
+        }
+      fprintf (out, "\"];\n}\n");
+      return;
+    }
   /* Print out the table */
   fprintf (out, "  root [ shape=record, label=\"");
   for (i = 0; i < (1u << d->l2_n_slots); i++)
@@ -297,8 +971,11 @@ void dict_dump_dot (Dict *d, FILE *out,
     {
       if (d->slots[i])
         {
-          fprintf (out, "  \"root\":s%d -> \"%p\"", i, d->slots[i]);
-          dict_dump_dot_node (d, out, print, d->slots[i]);
+          fprintf (out, "  \"root\":s%d -> \"%p\";\n", i, d->slots[i]);
+          if (d->buckets == DICT_BUCKETS_PAGES)
+            dict_dump_dot_page (d, out, print, PAGE_SLOTS (d)[i]);
+          else
+            dict_dump_dot_node (d, out, print, d->slots[i]);
         }
     }
   fprintf (out, "}\n");
@@ -312,6 +989,37 @@ dict_dumpf_dot (Dict *d, FILE *out, const char *fmt)
 }
 
 
+/* Size of a node, including any fixed-size key. */
+static size_t
+node_size (Dict *d)
+{
+  return sizeof (DictNode) + d->keyfuncs->key_width;
+}
+
+/* Point the entries of nodes whose contents have been moved or
+   exchanged back at their own fixed-size keys, moving the key data
+   to match. */
+static void
+swap_inline_keys (Dict *d, DictNode *a, DictNode *b)
+{
+  size_t i, width = d->keyfuncs->key_width;
+  for (i = 0; i < width; i++)
+    {
+      unsigned char t = a->key_data[i];
+      a->key_data[i] = b->key_data[i];
+      b->key_data[i] = t;
+    }
+  a->entry.key = a->key_data;
+  b->entry.key = b->key_data;
+}
+
+static void
+copy_inline_key (Dict *d, DictNode *to, const DictNode *from)
+{
+  memcpy (to->key_data, from->key_data, d->keyfuncs->key_width);
+  to->entry.key = to->key_data;
+}
+
 /* Statistical Rebalancing.
  * To try to avoid unbalanced binary trees, but without incurring the
  * extra storage overhead for an AVL or RB tree, this statistical
@@ -344,7 +1052,7 @@ rebalance_height (DictNode *node)
 }
 
 static void
-rebalance_node (DictNode *node)
+rebalance_node (Dict *d, DictNode *node)
 {
   int lh, rh;
   lh = rebalance_height (node->children[0]);
@@ -359,10 +1067,20 @@ rebalance_node (DictNode *node)
         *outer2 = node->children[1];
       DictEntry tmpentry = lower->entry;
       unsigned tmphash = lower->hash;
+      unsigned char tmpref = lower->referenced;
+      unsigned char tmpslab = lower->key_in_slab;
+      /* The entries change nodes. */
+      d->n_changes++;
       lower->entry = node->entry;
       lower->hash = node->hash;
+      lower->referenced = node->referenced;
+      lower->key_in_slab = node->key_in_slab;
       node->entry = tmpentry;
       node->hash = tmphash;
+      node->referenced = tmpref;
+      node->key_in_slab = tmpslab;
+      if (d->keyfuncs->key_width)
+        swap_inline_keys (d, node, lower);
 
       node->children[0] = outer0;
       node->children[1] = lower;
@@ -378,10 +1096,20 @@ rebalance_node (DictNode *node)
         *outer2 = lower->children[1];
       DictEntry tmpentry = lower->entry;
       unsigned tmphash = lower->hash;
+      unsigned char tmpref = lower->referenced;
+      unsigned char tmpslab = lower->key_in_slab;
+      /* The entries change nodes. */
+      d->n_changes++;
       lower->entry = node->entry;
       lower->hash = node->hash;
+      lower->referenced = node->referenced;
+      lower->key_in_slab = node->key_in_slab;
       node->entry = tmpentry;
       node->hash = tmphash;
+      node->referenced = tmpref;
+      node->key_in_slab = tmpslab;
+      if (d->keyfuncs->key_width)
+        swap_inline_keys (d, node, lower);
 
       lower->children[0] = outer0;
       lower->children[1] = outer1;
@@ -396,15 +1124,60 @@ extern void dict_lock_rebalance_TEST(bool lock)
   lock_rebalance = lock;
 }
 
+/* List buckets chain their nodes through children[0], leaving
+   children[1] NULL, so that a list looks like a tree that only ever
+   goes left. A node that is found is moved to the front of its
+   list. The unused pointer makes list nodes as big as tree nodes, but
+   lets every walk over trees take lists too. */
+static DictNode **
+list_search (Dict *d, const void *k, unsigned hash, int *depth_p)
+{
+  DictNode **head = &(d->slots[hash_to_index (d, hash)]);
+  DictNode **np;
+  int depth = 0;
+  for (np = head; *np; np = &(*np)->children[0])
+    {
+      DictNode *n = *np;
+      if (n->hash == hash && key_cmp (d->keyfuncs, k, n->entry.key) == 0)
+        {
+          if (np != head && !lock_rebalance && !d->n_iterators)
+            {
+              *np = n->children[0];
+              n->children[0] = *head;
+              *head = n;
+              np = head;
+            }
+          break;
+        }
+      depth++;
+    }
+  *depth_p = depth;
+  return np;
+}
+
+/* Rotate the node at *NP above its parent at *PARENT_NP. */
+static void
+promote_node (DictNode **parent_np, DictNode **np)
+{
+  DictNode *parent = *parent_np, *n = *np;
+  int side = (parent->children[1] == n);
+  parent->children[side] = n->children[side ^ 1];
+  n->children[side ^ 1] = parent;
+  *parent_np = n;
+}
+
 static DictNode **search (Dict *d, const void *k, unsigned hash, 
                           int *depth_p)
 {
   DictNode **np = &(d->slots[hash_to_index (d, hash)]);
+  DictNode **parent_np = NULL;
   DictNode *n;
   int heur_size = 0;
   int heur_depth = 0;
   int depth = 0;
   static int to_rebalance = 16;
+  if (d->buckets == DICT_BUCKETS_LIST)
+    return list_search (d, k, hash, depth_p);
   for (;;)
     {
       int cmp;
@@ -413,8 +1186,9 @@ static DictNode **search (Dict *d, const void *k, unsigned hash,
       if (n && to_rebalance-- <= 0)
         {
           to_rebalance = rand() % 16;
-          if (!lock_rebalance)
-            rebalance_node (n);
+          /* Published nodes of a versioned dictionary are immutable. */
+          if (!lock_rebalance && !d->versions && !d->n_iterators)
+            rebalance_node (d, n);
         }
 
       if (!n)
@@ -423,7 +1197,7 @@ static DictNode **search (Dict *d, const void *k, unsigned hash,
           return np;
         }
       if (n->hash == hash)
-        cmp = d->keyfuncs->cmp_fn (k, n->entry.key);
+        cmp = key_cmp (d->keyfuncs, k, n->entry.key);
       else
         if (hash < n->hash)
           cmp = -1;
@@ -435,6 +1209,7 @@ static DictNode **search (Dict *d, const void *k, unsigned hash,
             heur_size = (heur_size << 1) + 1;
           else
             heur_depth ++;
+          parent_np = np;
           np = &(n->children[0]);
         }
       else if (cmp > 0)
@@ -443,10 +1218,20 @@ static DictNode **search (Dict *d, const void *k, unsigned hash,
             heur_size = (heur_size << 1) + 1;
           else
             heur_depth ++;
+          parent_np = np;
           np = &(n->children[1]);
         }
       else
         {
+          /* Adaptive buckets move every other node found up a level,
+             so that frequently found ones rise to the top. */
+          if (d->buckets == DICT_BUCKETS_ADAPTIVE && parent_np
+              && !lock_rebalance && !d->n_iterators
+              && (d->promote_tick++ & 1))
+            {
+              promote_node (parent_np, np);
+              np = parent_np;
+            }
           *depth_p = depth;
           return np;
         }
@@ -455,419 +1240,4419 @@ static DictNode **search (Dict *d, const void *k, unsigned hash,
     }
 }
 
-Dict *
-dict_new (DictKeyFuncs * funcs)
+/* ------------------------------------------------------------
+ * Versioned dictionaries.
+ *
+ * The writer works on its own copy of the slot array, and never
+ * modifies a node that a published snapshot may be reading. Instead,
+ * the path from the bucket root down to the node is copied (nodes
+ * written since the last dict_publish() are private to the writer
+ * and are modified in place), and the originals are retired.
+ *
+ * Snapshots are reference counted using split counts: the published
+ * word holds the ring index of the current snapshot in its top bits
+ * and a count of acquisitions in the rest, so a reader pins the
+ * snapshot with a single atomic add. When a new snapshot is
+ * published, the acquisition count of the old one is transferred to
+ * its own counter, which readers decrement on release. Nodes retired
+ * while a snapshot was current are reclaimed once it, and every older
+ * snapshot, have been released.
+ */
+
+#define SNAPSHOT_RING 64
+#define PUBLISHED_SHIFT 56
+#define PUBLISHED_COUNT_MASK ((1ull << PUBLISHED_SHIFT) - 1)
+
+struct DictSnapshot
 {
-  Dict *d = malloc (sizeof *d);
-  if (funcs)
-    d->keyfuncs = funcs;
-  else
-    d->keyfuncs = &strkeyfuncs;
-  d->l2_n_slots = 2;
-  d->slots = calloc ((1u << d->l2_n_slots), sizeof *d->slots);
-  d->n_entries = 0;
-  d->rehash_benefit = 0;
-  return d;
+  DictNode **slots;
+  unsigned l2_n_slots;
+  int n_entries;
+  DictKeyFuncs *keyfuncs;
+  atomic_llong refs;
+  /* Nodes and keys unlinked by the writer while this was the current
+     snapshot. */
+  DictNode **retired_nodes;
+  int n_retired_nodes;
+  const void **retired_keys;
+  int n_retired_keys;
+};
+
+struct DictVersions
+{
+  atomic_ullong published;
+  DictSnapshot *ring[SNAPSHOT_RING];
+  unsigned epoch;               /* Generation being built by the writer */
+  unsigned oldest;              /* Oldest unreclaimed generation */
+  bool slots_shared;            /* d->slots belongs to the current snapshot */
+  bool dirty;
+};
+
+static DictSnapshot *
+current_snapshot (DictVersions *v)
+{
+  return v->ring[(v->epoch - 1) % SNAPSHOT_RING];
 }
 
+/* Append to a retire list, doubling its size at powers of two. */
+#define RETIRE(d, array, len, value)                                    \
+  do                                                                    \
+    {                                                                   \
+      if (((len) & ((len) - 1)) == 0)                                   \
+        {                                                               \
+          void *grown = mem_alloc ((d), ((len) ? 2 * (len) : 1)         \
+                                   * sizeof *(array));                  \
+          if (len)                                                      \
+            memcpy (grown, (array), (len) * sizeof *(array));           \
+          mem_free ((d), (array));                                      \
+          (array) = grown;                                              \
+        }                                                               \
+      (array)[(len)++] = (value);                                       \
+    }                                                                   \
+  while (0)
+
+/* Retire a node that may be visible to readers. */
 static void
-insert_nodes (Dict *d, DictNode *n)
+retire_node (Dict *d, DictNode *n)
 {
-  DictNode **np;
-  int i;
-  DictNode *children[2];
-  int depth;
-  for (i = 0; i < 2; i++)
-    {
-      children[i] = n->children[i];
-      n->children[i] = NULL;
-    }
-  np = search (d, n->entry.key, n->hash, &depth);
-  *np = n;
-  for (i = 0; i < 2; i++)
-    if (children[i])
-      insert_nodes (d, children[i]);
+  DictSnapshot *s = current_snapshot (d->versions);
+  RETIRE (d, s->retired_nodes, s->n_retired_nodes, n);
 }
 
+/* Release a deleted node's key. Even a node written in the current
+   epoch may have inherited its key from a published copy, so keys are
+   always freed via the retire list. */
 static void
-rehash (Dict * d, int size)
+retire_key (Dict *d, const void *key)
 {
-  int i;
-  DictNode **old_slots;
-  int n_old_slots;
-  assert ((size & (size - 1)) == 0);
-  old_slots = d->slots;
-  n_old_slots = 1u << d->l2_n_slots;
-  d->slots = calloc (size, sizeof *d->slots);
-  d->l2_n_slots = ffs (size) - 1;
-  for (i = 0; i < n_old_slots; i++)
-    if (old_slots[i])
-      insert_nodes (d, old_slots[i]);
-  free (old_slots);
+  DictSnapshot *s;
+  if (!d->keyfuncs->free_fn)
+    return;
+  s = current_snapshot (d->versions);
+  RETIRE (d, s->retired_keys, s->n_retired_keys, key);
 }
 
-static bool lock_rehash = false;
-
-extern void dict_rehash_TEST (Dict *d, int size)
+/* Free a node unlinked by the writer. */
+static void
+discard_node (Dict *d, DictNode *n)
 {
-  rehash (d, size);
+  if (n->epoch != d->versions->epoch)
+    retire_node (d, n);
+  else
+    mem_free (d, n);
 }
-extern void dict_lock_rehash_TEST(bool lock)
+
+/* Give the writer its own slot array. */
+static void
+cow_slots (Dict *d)
 {
-  lock_rehash = lock;
+  DictVersions *v = d->versions;
+  v->dirty = true;
+  if (v->slots_shared)
+    {
+      size_t size = (sizeof *d->slots) << d->l2_n_slots;
+      DictNode **slots = mem_alloc (d, size);
+      memcpy (slots, d->slots, size);
+      d->slots = slots;
+      v->slots_shared = false;
+    }
 }
 
-/* Expanding the hash table costs approximately O(n.log(n)) in
-   time. Expanding the table by doubling its size would, on average,
-   half the number of entries in each bucket, reducing the height of
-   each tree by approximately 1.
-   
-   Hence each time we access a node that is not the root node of the
-   bucket, we reason that this access may have required one fewer
-   node traversals, and count this towards the future benefit of
-   rehashing.
-
-   The cost of rehashing is approximated as the number of nodes in
-   the table, plus the number of slots in the table, as each of
-   these contributes a linear factor to the cost of the rehashing.
-*/
-#define CHECK_REHASH(d, depth) do {             \
-if (depth != 0 && !lock_rehash)                 \
-  {                                             \
-    (d)->rehash_benefit+=depth;                 \
-    check_rehash ((d), (depth));                \
-  }                                             \
- } while (0)
+/* Make the node at *NP writable, copying it if it may be visible to
+   readers. NP must itself be writable. */
+static DictNode *
+cow_node (Dict *d, DictNode **np)
+{
+  DictNode *n = *np;
+  if (n->epoch != d->versions->epoch)
+    {
+      DictNode *copy = mem_alloc (d, node_size (d));
+      *copy = *n;
+      if (d->keyfuncs->key_width)
+        copy_inline_key (d, copy, n);
+      copy->epoch = d->versions->epoch;
+      retire_node (d, n);
+      d->n_changes++;
+      *np = n = copy;
+    }
+  return n;
+}
 
-static void
-check_rehash (Dict * d, unsigned depth)
+/* As search(), but copying the path to the node so that the result
+   and every node above it may be modified by the writer. */
+static DictNode **
+cow_search (Dict *d, const void *k, unsigned hash, int *depth_p)
 {
-  if (d->rehash_benefit > d->n_entries + (1u << d->l2_n_slots)
-      && d->n_entries * 4 > (1u << d->l2_n_slots))
+  DictNode **np;
+  int depth = 0;
+  cow_slots (d);
+  np = &(d->slots[hash_to_index (d, hash)]);
+  while (*np)
     {
-      /* Profitable to quadruple the size of the table. */
-      rehash (d, 4u << d->l2_n_slots);
-      d->rehash_benefit = 0;
+      DictNode *n = cow_node (d, np);
+      int cmp;
+      if (n->hash == hash)
+        cmp = key_cmp (d->keyfuncs, k, n->entry.key);
+      else
+        cmp = (hash < n->hash) ? -1 : 1;
+      if (cmp == 0)
+        break;
+      np = &(n->children[cmp > 0]);
+      depth++;
     }
+  *depth_p = depth;
+  return np;
 }
 
-void *
-dict_get (Dict * d, const void *k)
+/* Copy every shared node of a tree, ahead of restructuring it. */
+static void
+cow_tree (Dict *d, DictNode **np)
 {
-  unsigned hash = d->keyfuncs->hash_fn (k);
-  int depth;
-  DictNode **np = search(d, k, hash, &depth);
-  void *res;
-  if (*np)
-    res = (*np)->entry.value;
-  else
-    res = NULL;
-  CHECK_REHASH (d, depth);
-  return res;
+  DictNode *n = cow_node (d, np);
+  int i;
+  for (i = 0; i < 2; i++)
+    if (n->children[i])
+      cow_tree (d, &n->children[i]);
 }
 
-bool
-dict_has_key (Dict * d, const void *k)
+static void
+free_snapshot (Dict *d, DictSnapshot *s)
 {
-  unsigned hash = d->keyfuncs->hash_fn (k);
-  int depth;
-  DictNode **np = search (d, k, hash, &depth);
-  bool res = (*np != NULL);
-  CHECK_REHASH (d, depth);
-  return res;
+  int i;
+  for (i = 0; i < s->n_retired_nodes; i++)
+    mem_free (d, s->retired_nodes[i]);
+  for (i = 0; i < s->n_retired_keys; i++)
+    d->keyfuncs->free_fn (s->retired_keys[i]);
+  mem_free (d, s->retired_nodes);
+  mem_free (d, s->retired_keys);
+  if (s->slots != d->slots)
+    mem_free (d, s->slots);
+  mem_free (d, s);
 }
 
-void
-dict_set (Dict * d, const void *k, void *value)
+/* Free snapshots, oldest first, that are no longer current and that
+   no reader holds. */
+static void
+reclaim_snapshots (Dict *d)
 {
-  unsigned hash = d->keyfuncs->hash_fn (k);
-  int depth;
-  DictNode **np = search (d, k, hash, &depth);
-  if (*np)
-    (*np)->entry.value = value;
-  else
+  DictVersions *v = d->versions;
+  while (v->oldest != v->epoch - 1)
     {
-      DictNode *n = malloc (sizeof *n);
-      if (d->keyfuncs->dup_fn)
-        n->entry.key = d->keyfuncs->dup_fn (k);
-      else
-        n->entry.key = k;
-      n->entry.value = value;
-      n->hash = hash;
-      n->children[0] = n->children[1] = NULL;
-      *np = n;
-      d->n_entries++;
+      DictSnapshot *s = v->ring[v->oldest % SNAPSHOT_RING];
+      if (atomic_load_explicit (&s->refs, memory_order_acquire) != 0)
+        break;
+      v->ring[v->oldest % SNAPSHOT_RING] = NULL;
+      free_snapshot (d, s);
+      v->oldest++;
     }
-  CHECK_REHASH (d, depth);
 }
 
-void
-dict_insert (Dict * d, const void *k, void *value)
+static DictSnapshot *
+new_snapshot (Dict *d)
 {
-  unsigned hash = d->keyfuncs->hash_fn (k);
-  int depth;
-  DictNode *n;
-  DictNode **np = search (d, k, hash, &depth);
-  assert(!*np);
-  n = malloc (sizeof *n);
-  if (d->keyfuncs->dup_fn)
-    n->entry.key = d->keyfuncs->dup_fn (k);
-  else
-    n->entry.key = k;
-  n->entry.value = value;
-  n->hash = hash;
-  n->children[0] = n->children[1] = NULL;
-  *np = n;
-  d->n_entries++;
-  CHECK_REHASH (d, depth);
+  DictSnapshot *s = mem_zalloc (d, sizeof *s);
+  s->slots = d->slots;
+  s->l2_n_slots = d->l2_n_slots;
+  s->n_entries = d->n_entries;
+  s->keyfuncs = d->keyfuncs;
+  atomic_init (&s->refs, 0);
+  return s;
 }
 
-void
-dict_insert_entries (Dict *d, ...)
+bool
+dict_publish (Dict *d)
 {
-  va_list va;
-  const void *key;
-  void *value;
-  va_start (va, d);
-  while ((key = va_arg (va, const void *)))
-    {
-      value = va_arg (va, void *);
-      dict_insert (d, key, value);
-    }
-  va_end (va);
+  DictVersions *v = d->versions;
+  DictSnapshot *s, *old;
+  unsigned index = v->epoch % SNAPSHOT_RING;
+  unsigned long long word;
+
+  reclaim_snapshots (d);
+  if (!v->dirty)
+    return true;
+  if (v->ring[index])
+    /* Readers still hold a snapshot SNAPSHOT_RING generations old. */
+    return false;
+
+  s = new_snapshot (d);
+  v->ring[index] = s;
+  old = current_snapshot (v);
+  word = atomic_exchange (&v->published,
+                          (unsigned long long)index << PUBLISHED_SHIFT);
+  atomic_fetch_add (&old->refs, word & PUBLISHED_COUNT_MASK);
+
+  v->epoch++;
+  v->slots_shared = true;
+  v->dirty = false;
+  reclaim_snapshots (d);
+  return true;
 }
 
-void
-dict_set_entries (Dict *d, ...)
+DictSnapshot *
+dict_snapshot_acquire (Dict *d)
 {
-  va_list va;
-  const void *key;
-  void *value;
-  va_start (va, d);
-  while ((key = va_arg (va, const void *)))
-    {
-      value = va_arg (va, void *);
-      dict_set (d, key, value);
-    }
-  va_end (va);
+  DictVersions *v = d->versions;
+  unsigned long long word = atomic_fetch_add (&v->published, 1);
+  return v->ring[word >> PUBLISHED_SHIFT];
 }
 
 void
-dict_delete (Dict * d, const void *k)
+dict_snapshot_release (Dict *d, DictSnapshot *s)
 {
-  DictNode ** np, *n;
-  int depth;
-  unsigned hash = d->keyfuncs->hash_fn (k);
-  np = search (d, k, hash, &depth);
-  n = *np;
-  if (!n)
-    /* not found */
-    return;
-  if (n->children[0])
+  atomic_fetch_sub_explicit (&s->refs, 1, memory_order_release);
+}
+
+static DictNode *
+snapshot_search (DictSnapshot *s, const void *k)
+{
+  unsigned hash = key_hash (s->keyfuncs, k);
+  DictNode *n = s->slots[slot_index (hash, s->l2_n_slots)];
+  while (n)
     {
-      if (n->children[1])
+      int cmp;
+      if (n->hash == hash)
         {
-          /* Pick the successor (leftmost child of the right subtree)
-             or predecessor (rightmost child of the left subtree) and
-             replace this node's contents with that.
-          */
-          static int i = 0;
-          DictNode *repl;
-          np = &(n->children[i]);
-          i ^= 1;               /* alternate left/right */
-          while ((*np)->children[i])
-            np = &(*np)->children[i];
-          repl = *np;
-          /* copy the adjacent node's data to N */
-          n->entry = repl->entry;
-          n->hash = repl->hash;
-          *np = repl->children[i^1];
-          free (repl);
-          d->n_entries--;
+          cmp = key_cmp (s->keyfuncs, k, n->entry.key);
+          if (cmp == 0)
+            break;
         }
       else
-        {
-          *np = n->children[0];
-	  if (d->keyfuncs->free_fn)
-	    d->keyfuncs->free_fn (n->entry.key);
-          free (n);
-          d->n_entries--;
-        }
-    }
-  else
-    {
-      *np = n->children[1];
-      if (d->keyfuncs->free_fn)
-        d->keyfuncs->free_fn (n->entry.key);
-      free (n);
-      d->n_entries--;
+        cmp = (hash < n->hash) ? -1 : 1;
+      n = n->children[cmp > 0];
     }
+  return n;
 }
 
-void dict_free_nodes (Dict *d, DictNode *n)
-{
-  int i;
-  if (d->keyfuncs->free_fn)
-    d->keyfuncs->free_fn (n->entry.key);
-  for (i = 0; i < 2; i++)
-    if (n->children[i])
-      dict_free_nodes (d, n->children[i]);
-  free (n);
-}
-
-void
-dict_free (Dict * d)
+void *
+dict_snapshot_get (DictSnapshot *s, const void *k)
 {
-  int i;
-  for (i = 0; i < (1u << d->l2_n_slots); i++)
-    if (d->slots[i])
-      dict_free_nodes (d, d->slots[i]);
-  free (d->slots);
-  free (d);
+  DictNode *n = snapshot_search (s, k);
+  return n ? n->entry.value : NULL;
 }
 
-/* Number of entries in the dictionary */
-unsigned int
-dict_n_entries (Dict *d)
+bool
+dict_snapshot_has_key (DictSnapshot *s, const void *k)
 {
-  return d->n_entries;
+  return snapshot_search (s, k) != NULL;
 }
 
-/* Amount of memory allocated to dictionary */
 unsigned int
-dict_allocated_bytes (Dict *d)
+dict_snapshot_n_entries (DictSnapshot *s)
 {
-  unsigned int total;
-  if (!d)
-    return 0;
-  total = sizeof (Dict);
-  total += sizeof (*(d->slots)) << d->l2_n_slots;
-  total += sizeof (DictNode) * d->n_entries;
-  return total;
+  return s->n_entries;
 }
 
 /* ------------------------------------------------------------
- * Iterators
+ * Cache dictionaries.
  *
- * The buckets are tree-structured, so a simple linear iterator is
- * insufficient. Instead, we'll keep a stack of entries.
+ * Each node carries a reference bit which is set when it is looked
+ * up. To evict, a clock hand sweeps the slots, clearing reference
+ * bits, and the first node found without one is evicted.
  */
 
-typedef struct DictEntryStack DictEntryStack;
-struct DictEntryStack
+struct DictCache
 {
-  DictEntry entry;
-  DictNode *node;
-  DictEntryStack *up;
+  unsigned max_entries;
+  size_t max_bytes;
+  DictEvictFn evict_fn;
+  void *cl;
+  DictSizeFn size_fn;
+  size_t bytes;                 /* Total reported by SIZE_FN */
+  unsigned hand;                /* Slot the clock hand points at */
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
 };
 
-DictEntry *
-dict_first (Dict * d)
+/* Record a lookup of node N (or a miss, if N is NULL) */
+#define CACHE_ACCESS(d, n) do {                 \
+if ((d)->cache)                                 \
+  {                                             \
+    if (n)                                      \
+      {                                         \
+        (d)->cache->hits++;                     \
+        if (!(n)->referenced)                   \
+          (n)->referenced = 1;                  \
+      }                                         \
+    else                                        \
+      (d)->cache->misses++;                     \
+  }                                             \
+ } while (0)
+
+static bool
+cache_over_limit (Dict *d)
+{
+  DictCache *c = d->cache;
+  if (c->max_entries && d->n_entries > c->max_entries)
+    return true;
+  if (c->max_bytes && dict_allocated_bytes (d) + c->bytes > c->max_bytes)
+    return true;
+  return false;
+}
+
+/* Sweep one bucket, clearing reference bits until finding a node
+   (other than KEEP's) that has not been referenced. */
+static DictNode **
+clock_victim (Dict *d, DictNode **np, const DictKey *keep)
 {
+  DictNode *n = *np;
+  DictNode **res;
   int i;
-  int size = (1u << d->l2_n_slots);
-  for (i = 0; i < size; i++)
-    if (d->slots[i])
-      {
-        DictEntryStack *des = malloc (sizeof *des);
-        des->node = d->slots[i];
-        des->up = NULL;
-        des->entry = des->node->entry;
-        return (DictEntry *)des;
-      }
+  if (!n)
+    return NULL;
+  if (n->hash != keep->hash
+      || key_cmp (d->keyfuncs, keep->key, n->entry.key) != 0)
+    {
+      if (!n->referenced)
+        return np;
+      n->referenced = 0;
+    }
+  for (i = 0; i < 2; i++)
+    if ((res = clock_victim (d, &n->children[i], keep)))
+      return res;
   return NULL;
 }
 
-DictEntry *
-dict_next (Dict *d, DictEntry *de)
+static void unlink_node (Dict *d, DictNode **np);
+
+/* Evict entries until the cache is within its limits. The entry just
+   added for KEEP is never evicted. It is known by its key rather than
+   its node, as unlinking a node with two children moves the entry of
+   another node into it. */
+static void
+cache_trim (Dict *d, const DictKey *keep)
 {
-  DictEntryStack *des = (DictEntryStack *)de;
-  if (des->node->children[0])
+  DictCache *c = d->cache;
+  while (d->n_entries > 1 && cache_over_limit (d))
     {
-      if (des->node->children[1])
+      DictNode **np = clock_victim (d, &d->slots[c->hand], keep);
+      DictNode *n;
+      if (!np)
+        {
+          c->hand = (c->hand + 1) & ((1u << d->l2_n_slots) - 1);
+          continue;
+        }
+      n = *np;
+      c->evictions++;
+      if (c->size_fn)
+        c->bytes -= c->size_fn (n->entry.key, n->entry.value);
+      if (c->evict_fn)
+        c->evict_fn (n->entry.key, n->entry.value, c->cl);
+      unlink_node (d, np);
+    }
+}
+
+/* ------------------------------------------------------------
+ * String arena dictionaries.
+ *
+ * Keys are appended to the current chunk as records holding the hash
+ * and length ahead of the string itself. The string is what the rest
+ * of the dictionary sees as the key.
+ */
+
+#define ARENA_CHUNK_SIZE 65536
+
+typedef struct DictKeyChunk DictKeyChunk;
+struct DictKeyChunk
+{
+  DictKeyChunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+typedef struct DictKeyRecord DictKeyRecord;
+struct DictKeyRecord
+{
+  unsigned hash;
+  unsigned len;
+  char str[];
+};
+
+struct DictKeyArena
+{
+  DictKeyChunk *chunks;         /* Current chunk first */
+  size_t allocated;             /* Total size of the chunks */
+  size_t dead;                  /* Bytes of deleted records */
+};
+
+static size_t
+record_size (size_t len)
+{
+  size_t size = offsetof (DictKeyRecord, str) + len + 1;
+  return (size + sizeof (unsigned) - 1) & ~(sizeof (unsigned) - 1);
+}
+
+static DictKeyRecord *
+key_record (const void *key)
+{
+  return (DictKeyRecord *)((char *)key - offsetof (DictKeyRecord, str));
+}
+
+static const char *
+arena_add (Dict *d, const char *k, size_t len, unsigned hash)
+{
+  DictKeyArena *a = d->arena;
+  DictKeyChunk *c = a->chunks;
+  DictKeyRecord *r;
+  size_t size = record_size (len);
+  if (!c || c->used + size > c->size)
+    {
+      size_t chunk_size = ARENA_CHUNK_SIZE;
+      if (size > chunk_size)
+        chunk_size = size;
+      c = mem_alloc (d, offsetof (DictKeyChunk, data) + chunk_size);
+      c->size = chunk_size;
+      c->used = 0;
+      c->next = a->chunks;
+      a->chunks = c;
+      a->allocated += chunk_size;
+    }
+  r = (DictKeyRecord *)(c->data + c->used);
+  c->used += size;
+  r->hash = hash;
+  r->len = len;
+  memcpy (r->str, k, len + 1);
+  return r->str;
+}
+
+static void
+arena_delete (DictKeyArena *a, const void *key)
+{
+  a->dead += record_size (key_record (key)->len);
+}
+
+static void
+arena_free_chunks (Dict *d, DictKeyChunk *c)
+{
+  while (c)
+    {
+      DictKeyChunk *next = c->next;
+      mem_free (d, c);
+      c = next;
+    }
+}
+
+Dict *
+dict_new_with_allocator (DictKeyFuncs *funcs, void *alloc_ctx,
+                         DictAllocFn alloc_fn, DictDeallocFn dealloc_fn)
+{
+  Dict *d = alloc_fn (alloc_ctx, sizeof *d);
+  d->alloc_fn = alloc_fn;
+  d->dealloc_fn = dealloc_fn;
+  d->alloc_ctx = alloc_ctx;
+  if (funcs)
+    d->keyfuncs = funcs;
+  else
+    d->keyfuncs = &strkeyfuncs;
+  d->l2_n_slots = 2;
+  d->slots = mem_zalloc (d, (1u << d->l2_n_slots) * sizeof *d->slots);
+  d->n_entries = 0;
+  d->rehash_benefit = 0;
+  d->versions = NULL;
+  d->cache = NULL;
+  d->arena = NULL;
+  d->radix = NULL;
+  d->huge = NULL;
+  d->slabs = NULL;
+  d->slab_dead = 0;
+  d->buckets = DICT_BUCKETS_TREE;
+  d->n_pages = 0;
+  d->ordered = NULL;
+  d->promote_tick = 0;
+  d->n_iterators = 0;
+  d->n_changes = 0;
+  return d;
+}
+
+Dict *
+dict_new (DictKeyFuncs * funcs)
+{
+  return dict_new_with_allocator (funcs, NULL, default_alloc,
+                                  default_dealloc);
+}
+
+static void
+set_buckets (Dict *d, DictBuckets buckets)
+{
+  d->buckets = buckets;
+  if (buckets == DICT_BUCKETS_ORDERED)
+    d->ordered = mem_zalloc (d, sizeof *d->ordered);
+}
+
+Dict *
+dict_new_with_buckets (DictKeyFuncs *funcs, DictBuckets buckets)
+{
+  Dict *d = dict_new (funcs);
+  set_buckets (d, buckets);
+  return d;
+}
+
+Dict *
+dict_new_hugepages (DictKeyFuncs *funcs, DictBuckets buckets)
+{
+  DictHugeHeap *h = calloc (1, sizeof *h);
+  Dict *d = dict_new_with_allocator (funcs, h, huge_alloc, huge_dealloc);
+  d->huge = h;
+  set_buckets (d, buckets);
+  return d;
+}
+
+Dict *
+dict_new_strarena (void)
+{
+  return dict_new_strarena_with_buckets (DICT_BUCKETS_TREE);
+}
+
+Dict *
+dict_new_strarena_with_buckets (DictBuckets buckets)
+{
+  Dict *d;
+  /* Pages copy their keys themselves. */
+  assert (buckets != DICT_BUCKETS_PAGES);
+  d = dict_new_with_buckets (&staticstrkeyfuncs, buckets);
+  d->arena = mem_zalloc (d, sizeof *d->arena);
+  return d;
+}
+
+static void
+compact_nodes (Dict *d, DictNode *n)
+{
+  int i;
+  DictKeyRecord *r = key_record (n->entry.key);
+  n->entry.key = arena_add (d, r->str, r->len, r->hash);
+  for (i = 0; i < 2; i++)
+    if (n->children[i])
+      compact_nodes (d, n->children[i]);
+}
+
+void
+dict_compact_keys (Dict *d)
+{
+  DictKeyArena *a = d->arena;
+  DictKeyChunk *old = a->chunks;
+  int i;
+  a->chunks = NULL;
+  a->allocated = 0;
+  a->dead = 0;
+  d->n_changes++;
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    for (i = 0; i < d->ordered->n_used; i++)
+      {
+        DictOrderedEntry *e = ordered_entry (d, i);
+        if (!e->deleted)
+          {
+            DictKeyRecord *r = key_record (e->entry.key);
+            e->entry.key = arena_add (d, r->str, r->len, r->hash);
+          }
+      }
+  else
+    for (i = 0; i < (1u << d->l2_n_slots); i++)
+      if (d->slots[i])
+        compact_nodes (d, d->slots[i]);
+  arena_free_chunks (d, old);
+}
+
+Dict *
+dict_new_cache (DictKeyFuncs *funcs, unsigned int max_entries,
+                size_t max_bytes, DictEvictFn evict_fn, void *cl)
+{
+  Dict *d = dict_new (funcs);
+  DictCache *c = mem_zalloc (d, sizeof *c);
+  c->max_entries = max_entries;
+  c->max_bytes = max_bytes;
+  c->evict_fn = evict_fn;
+  c->cl = cl;
+  d->cache = c;
+  return d;
+}
+
+void
+dict_cache_set_size_fn (Dict *d, DictSizeFn size_fn)
+{
+  DictEntry *de;
+  DictCache *c = d->cache;
+  c->size_fn = size_fn;
+  c->bytes = 0;
+  for (de = dict_first (d); de; de = dict_next (d, de))
+    c->bytes += size_fn (de->key, de->value);
+}
+
+Dict *
+dict_new_versioned (DictKeyFuncs *funcs)
+{
+  Dict *d = dict_new (funcs);
+  DictVersions *v = mem_zalloc (d, sizeof *v);
+  d->versions = v;
+  /* Generation 0 is the empty dictionary. */
+  v->ring[0] = new_snapshot (d);
+  atomic_init (&v->published, 0);
+  v->epoch = 1;
+  v->oldest = 0;
+  v->slots_shared = true;
+  return d;
+}
+
+/* The dictionary's own copy of a key, made in KEY_DATA if keys are
+   fixed-size. */
+static const void *
+copy_key (Dict *d, const DictKey *key, unsigned char *key_data)
+{
+  const void *k = key->key;
+  if (d->keyfuncs->key_width)
+    {
+      memcpy (key_data, k, d->keyfuncs->key_width);
+      return key_data;
+    }
+  else if (d->arena)
+    return arena_add (d, k, key->len ? key->len : strlen (k), key->hash);
+  else if (d->keyfuncs->dup_fn)
+    return d->keyfuncs->dup_fn (k);
+  else
+    return k;
+}
+
+static DictNode *
+new_node (Dict *d, const DictKey *key, void *value)
+{
+  unsigned hash = key->hash;
+  DictNode *n = mem_alloc (d, node_size (d));
+  n->entry.key = copy_key (d, key, n->key_data);
+  n->entry.value = value;
+  n->hash = hash;
+  n->epoch = d->versions ? d->versions->epoch : 0;
+  if (d->cache)
+    {
+      /* Not referenced until looked up, so that entries which are
+         never used again are the first to go. */
+      n->referenced = 0;
+      if (d->cache->size_fn)
+        d->cache->bytes += d->cache->size_fn (n->entry.key, value);
+    }
+  n->children[0] = n->children[1] = NULL;
+  d->n_changes++;
+  return n;
+}
+
+/* ------------------------------------------------------------
+ * Ordered buckets.
+ */
+
+static size_t
+ordered_entry_size (Dict *d)
+{
+  return ((sizeof (DictOrderedEntry) + d->keyfuncs->key_width + 7)
+          & ~(size_t)7);
+}
+
+static DictOrderedEntry *
+ordered_entry (Dict *d, unsigned pos)
+{
+  return (DictOrderedEntry *)(d->ordered->entries
+                              + pos * ordered_entry_size (d));
+}
+
+/* Find the entry for K. If SLOTP is not NULL, store in it the slot
+   holding the entry or, if there is none, the slot a new entry should
+   take: the first tombstone passed, or else the empty slot ending the
+   probe. */
+static DictOrderedEntry *
+ordered_search (Dict *d, const void *k, unsigned hash, unsigned **slotp)
+{
+  unsigned *slots = ORDERED_SLOTS (d), *free_slot = NULL;
+  unsigned mask = (1u << d->l2_n_slots) - 1;
+  unsigned i;
+  for (i = hash_to_index (d, hash); slots[i]; i = (i + 1) & mask)
+    {
+      DictOrderedEntry *e = ordered_entry (d, slots[i] - 1);
+      if (e->deleted)
+        {
+          if (!free_slot)
+            free_slot = &slots[i];
+        }
+      else if (e->hash == hash && key_cmp (d->keyfuncs, k, e->entry.key) == 0)
+        {
+          if (slotp)
+            *slotp = &slots[i];
+          return e;
+        }
+    }
+  if (slotp)
+    *slotp = free_slot ? free_slot : &slots[i];
+  return NULL;
+}
+
+/* Move the entries to an array of SIZE entries, with twice as many
+   slots, dropping deleted entries if COMPACT. Positions must not
+   change while there are iterators. */
+static void
+ordered_rebuild (Dict *d, unsigned size, bool compact)
+{
+  DictOrdered *o = d->ordered;
+  size_t entry_size = ordered_entry_size (d);
+  unsigned char *entries = o->entries;
+  unsigned i, n = 0, l2 = 1, mask;
+  assert (!compact || !d->n_iterators);
+  if (size != o->size)
+    entries = mem_alloc (d, size * entry_size);
+  for (i = 0; i < o->n_used; i++)
+    {
+      DictOrderedEntry *e = ordered_entry (d, i), *to;
+      if (compact && e->deleted)
+        continue;
+      to = (DictOrderedEntry *)(entries + n++ * entry_size);
+      if (to != e)
+        memcpy (to, e, entry_size);
+      if (d->keyfuncs->key_width)
+        to->entry.key = to->key_data;
+    }
+  if (entries != o->entries)
+    {
+      mem_free (d, o->entries);
+      o->entries = entries;
+    }
+  if (compact)
+    o->n_deleted = 0;
+  o->n_used = n;
+  o->size = size;
+  while ((1u << l2) < 2 * size)
+    l2++;
+  if (l2 != d->l2_n_slots)
+    {
+      mem_free (d, d->slots);
+      d->l2_n_slots = l2;
+      d->slots = mem_alloc (d, sizeof (unsigned) << l2);
+    }
+  memset (d->slots, 0, sizeof (unsigned) << l2);
+  mask = (1u << l2) - 1;
+  for (i = 0; i < n; i++)
+    {
+      DictOrderedEntry *e = ordered_entry (d, i);
+      unsigned j;
+      if (e->deleted)
+        continue;
+      for (j = hash_to_index (d, e->hash); ORDERED_SLOTS (d)[j];
+           j = (j + 1) & mask)
+        ;
+      ORDERED_SLOTS (d)[j] = i + 1;
+    }
+}
+
+/* Find the entry for KEY, appending one with a NULL value if there is
+   none. When the array is full it is compacted if a quarter of it is
+   deleted, or else doubled. */
+static DictOrderedEntry *
+ordered_add (Dict *d, const DictKey *key, bool *added)
+{
+  DictOrdered *o = d->ordered;
+  unsigned *slot;
+  DictOrderedEntry *e = ordered_search (d, key->key, key->hash, &slot);
+  *added = !e;
+  if (e)
+    return e;
+  if (o->n_used == o->size)
+    {
+      if (o->n_deleted >= o->size / 4 && o->n_deleted && !d->n_iterators)
+        ordered_rebuild (d, o->size, true);
+      else
+        ordered_rebuild (d, o->size ? 2 * o->size : 4, false);
+      ordered_search (d, key->key, key->hash, &slot);
+    }
+  e = ordered_entry (d, o->n_used);
+  *slot = ++o->n_used;
+  e->entry.key = copy_key (d, key, e->key_data);
+  e->entry.value = NULL;
+  e->hash = key->hash;
+  e->deleted = 0;
+  d->n_entries++;
+  d->n_changes++;
+  return e;
+}
+
+/* Mark an entry deleted, leaving it in place. */
+static void
+ordered_delete_entry (Dict *d, DictOrderedEntry *e)
+{
+  if (d->arena)
+    arena_delete (d->arena, e->entry.key);
+  else if (d->keyfuncs->free_fn)
+    d->keyfuncs->free_fn (e->entry.key);
+  e->deleted = 1;
+  d->ordered->n_deleted++;
+  d->n_entries--;
+  d->n_changes++;
+}
+
+/* Drop the deleted entries, shrinking the array if it is mostly
+   unused. */
+static void
+ordered_compact (Dict *d)
+{
+  unsigned size = d->ordered->size;
+  while (size > 4 && size / 4 >= d->n_entries)
+    size /= 2;
+  ordered_rebuild (d, size, true);
+}
+
+static void
+ordered_delete (Dict *d, const void *k, unsigned hash)
+{
+  DictOrdered *o = d->ordered;
+  DictOrderedEntry *e = ordered_search (d, k, hash, NULL);
+  if (!e)
+    return;
+  ordered_delete_entry (d, e);
+  /* Compacting once half the array is deleted costs no more than a
+     move per deletion. */
+  if (o->n_deleted > o->n_used / 2 && !d->n_iterators)
+    ordered_compact (d);
+}
+
+static void
+ordered_delete_if (Dict *d, bool (*pred) (DictEntry *de, void *cl), void *cl)
+{
+  DictOrdered *o = d->ordered;
+  unsigned i;
+  for (i = 0; i < o->n_used; i++)
+    {
+      DictOrderedEntry *e = ordered_entry (d, i);
+      if (!e->deleted && pred (&e->entry, cl))
+        ordered_delete_entry (d, e);
+    }
+  if (o->n_deleted)
+    ordered_compact (d);
+}
+
+static void
+ordered_free (Dict *d)
+{
+  DictOrdered *o = d->ordered;
+  unsigned i;
+  if (d->keyfuncs->free_fn)
+    for (i = 0; i < o->n_used; i++)
+      {
+        DictOrderedEntry *e = ordered_entry (d, i);
+        if (!e->deleted)
+          d->keyfuncs->free_fn (e->entry.key);
+      }
+  mem_free (d, o->entries);
+  mem_free (d, o);
+}
+
+/* ------------------------------------------------------------
+ * Paged buckets.
+ *
+ * Each page's hashes are sorted, so the position of a hash within a
+ * page is found with a single vector comparison. Inserts split full
+ * pages on the way down, so the parent of a page always has room for
+ * the median of a split. Deletes do not merge pages, instead letting
+ * pages become sparse (or empty and removed); a key may then be
+ * inserted into the gap left by a missing child of an inner page.
+ */
+
+static DictPage *
+page_new (Dict *d)
+{
+  DictPage *p = mem_zalloc (d, sizeof *p);
+  d->n_pages++;
+  return p;
+}
+
+static void
+page_free (Dict *d, DictPage *p)
+{
+  d->n_pages--;
+  mem_free (d, p);
+}
+
+/* Pages can't hold fixed-size keys, so have their own copies. */
+static void
+page_free_key (Dict *d, const void *key)
+{
+  if (d->keyfuncs->key_width)
+    mem_free (d, (void *)key);
+  else if (d->keyfuncs->free_fn)
+    d->keyfuncs->free_fn (key);
+}
+
+static void
+page_free_tree (Dict *d, DictPage *p)
+{
+  int i;
+  for (i = 0; i <= p->n; i++)
+    if (p->children[i])
+      page_free_tree (d, p->children[i]);
+  for (i = 0; i < p->n; i++)
+    page_free_key (d, p->entries[i].key);
+  page_free (d, p);
+}
+
+/* Index of the first hash in P that is not less than HASH */
+static int
+page_lower_bound (DictPage *p, unsigned hash)
+{
+#ifdef __SSE2__
+  /* Signed comparison of biased values is unsigned comparison. */
+  __m128i bias = _mm_set1_epi32 (0x80000000);
+  __m128i h = _mm_xor_si128 (_mm_set1_epi32 (hash), bias);
+  __m128i hashes = _mm_xor_si128 (_mm_loadu_si128 ((__m128i *)p->hashes),
+                                  bias);
+  unsigned less = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpgt_epi32 (h,
+                                                                      hashes)));
+  return __builtin_popcount (less & ((1u << p->n) - 1));
+#else
+  int i = 0;
+  while (i < p->n && p->hashes[i] < hash)
+    i++;
+  return i;
+#endif
+}
+
+/* Look for K within page P. Returns the index of K if found, or
+   (-1 - the index of the child to search next) if not. */
+static int
+page_find (Dict *d, DictPage *p, const void *k, unsigned hash)
+{
+  int i = page_lower_bound (p, hash);
+  while (i < p->n && p->hashes[i] == hash)
+    {
+      int cmp = key_cmp (d->keyfuncs, k, p->entries[i].key);
+      if (cmp == 0)
+        return i;
+      if (cmp < 0)
+        break;
+      i++;
+    }
+  return -1 - i;
+}
+
+static DictEntry *
+page_search (Dict *d, const void *k, unsigned hash, int *depth_p)
+{
+  DictPage *p = PAGE_SLOTS (d)[hash_to_index (d, hash)];
+  int depth = 0;
+  while (p)
+    {
+      int i = page_find (d, p, k, hash);
+      if (i >= 0)
+        {
+          *depth_p = depth;
+          return &p->entries[i];
+        }
+      p = p->children[-1 - i];
+      depth++;
+    }
+  *depth_p = depth;
+  return NULL;
+}
+
+/* Split the full page PARENT->children[CI], moving its median up
+   into PARENT, which must not be full. */
+static void
+page_split (Dict *d, DictPage *parent, int ci)
+{
+  DictPage *left = parent->children[ci];
+  DictPage *right = page_new (d);
+  int m = PAGE_KEYS / 2;
+  int i;
+
+  right->n = PAGE_KEYS - m - 1;
+  memcpy (right->hashes, left->hashes + m + 1,
+          right->n * sizeof *right->hashes);
+  memcpy (right->entries, left->entries + m + 1,
+          right->n * sizeof *right->entries);
+  memcpy (right->children, left->children + m + 1,
+          (right->n + 1) * sizeof *right->children);
+  left->n = m;
+  for (i = m + 1; i <= PAGE_KEYS; i++)
+    left->children[i] = NULL;
+
+  memmove (parent->hashes + ci + 1, parent->hashes + ci,
+           (parent->n - ci) * sizeof *parent->hashes);
+  memmove (parent->entries + ci + 1, parent->entries + ci,
+           (parent->n - ci) * sizeof *parent->entries);
+  memmove (parent->children + ci + 2, parent->children + ci + 1,
+           (parent->n - ci) * sizeof *parent->children);
+  parent->hashes[ci] = left->hashes[m];
+  parent->entries[ci] = left->entries[m];
+  parent->children[ci + 1] = right;
+  parent->n++;
+  /* Entries move pages, even on the way to a key already present. */
+  d->n_changes++;
+}
+
+/* Find K, or make room for it. If a new entry is made, its hash is
+   set, *ADDED_P is set, and the caller must fill in the entry. */
+static DictEntry *
+page_add (Dict *d, DictPage **root, const void *k, unsigned hash,
+          int *depth_p, bool *added_p)
+{
+  DictPage *p = *root, *parent = NULL;
+  int ci = 0;
+  int depth = 0;
+  if (!p)
+    p = *root = page_new (d);
+  for (;;)
+    {
+      int i;
+      if (p->n == PAGE_KEYS)
+        {
+          if (!parent)
+            {
+              parent = *root = page_new (d);
+              parent->children[0] = p;
+              ci = 0;
+            }
+          else
+            depth--;
+          page_split (d, parent, ci);
+          /* Parent had room, so won't need splitting again. */
+          p = parent;
+        }
+      i = page_find (d, p, k, hash);
+      if (i >= 0)
+        {
+          *depth_p = depth;
+          *added_p = false;
+          return &p->entries[i];
+        }
+      i = -1 - i;
+      if (!p->children[i])
+        {
+          memmove (p->hashes + i + 1, p->hashes + i,
+                   (p->n - i) * sizeof *p->hashes);
+          memmove (p->entries + i + 1, p->entries + i,
+                   (p->n - i) * sizeof *p->entries);
+          memmove (p->children + i + 2, p->children + i + 1,
+                   (p->n - i) * sizeof *p->children);
+          p->children[i + 1] = NULL;
+          p->hashes[i] = hash;
+          p->n++;
+          *depth_p = depth;
+          *added_p = true;
+          return &p->entries[i];
+        }
+      parent = p;
+      ci = i;
+      p = p->children[i];
+      depth++;
+    }
+}
+
+/* Remove entry I from the page at *LINK. */
+static void
+page_remove_at (Dict *d, DictPage **link, int i)
+{
+  DictPage *p = *link;
+  int drop;
+  if (p->children[i] && p->children[i + 1])
+    {
+      /* Replace with the predecessor, the last entry of the rightmost
+         page of the left subtree. */
+      DictPage **l = &p->children[i], *q;
+      while ((*l)->children[(*l)->n])
+        l = &(*l)->children[(*l)->n];
+      q = *l;
+      p->hashes[i] = q->hashes[q->n - 1];
+      p->entries[i] = q->entries[q->n - 1];
+      page_remove_at (d, l, q->n - 1);
+      return;
+    }
+  /* At most one child either side of the entry; keep that one. */
+  drop = p->children[i] ? i + 1 : i;
+  memmove (p->hashes + i, p->hashes + i + 1,
+           (p->n - i - 1) * sizeof *p->hashes);
+  memmove (p->entries + i, p->entries + i + 1,
+           (p->n - i - 1) * sizeof *p->entries);
+  memmove (p->children + drop, p->children + drop + 1,
+           (p->n - drop) * sizeof *p->children);
+  p->n--;
+  p->children[p->n + 1] = NULL;
+  if (p->n == 0)
+    {
+      *link = p->children[0];
+      page_free (d, p);
+    }
+}
+
+static bool
+page_delete (Dict *d, const void *k, unsigned hash)
+{
+  DictPage **link = &PAGE_SLOTS (d)[hash_to_index (d, hash)];
+  while (*link)
+    {
+      int i = page_find (d, *link, k, hash);
+      if (i >= 0)
+        {
+          page_free_key (d, (*link)->entries[i].key);
+          page_remove_at (d, link, i);
+          return true;
+        }
+      link = &(*link)->children[-1 - i];
+    }
+  return false;
+}
+
+/* Move every entry of a page tree into the (new) slot array, except
+   those for which PRED (if given) is true, which are deleted. */
+static void
+page_rehash (Dict *d, DictPage *p, bool (*pred) (DictEntry *, void *),
+             void *cl)
+{
+  int i, depth;
+  bool added;
+  for (i = 0; i <= p->n; i++)
+    if (p->children[i])
+      page_rehash (d, p->children[i], pred, cl);
+  for (i = 0; i < p->n; i++)
+    {
+      DictEntry *e;
+      if (pred && pred (&p->entries[i], cl))
+        {
+          page_free_key (d, p->entries[i].key);
+          d->n_entries--;
+          continue;
+        }
+      e = page_add (d, &PAGE_SLOTS (d)[hash_to_index (d, p->hashes[i])],
+                    p->entries[i].key, p->hashes[i], &depth, &added);
+      *e = p->entries[i];
+    }
+  page_free (d, p);
+}
+
+/* Rehashing tree buckets.
+ *
+ * Visiting the old slots in order, and each tree in order, meets the
+ * nodes in order of their new slots (see slot_index()). So nodes are
+ * appended to a list (linked through children[1]) of the nodes for
+ * the current new slot as they are met, and a finished list is built
+ * into a balanced tree by the Day-Stout-Warren algorithm. Nothing is
+ * searched, and nothing recurses.
+ */
+
+typedef struct DictRun DictRun;
+struct DictRun
+{
+  unsigned slot;
+  DictNode **tail;
+  unsigned size;
+  DictNode **stack;             /* For visiting the old trees */
+  unsigned stack_size;
+  /* dict_delete_if(): nodes for which PRED is true are deleted
+     instead of being appended. */
+  bool (*pred) (DictEntry *de, void *cl);
+  void *cl;
+};
+
+static void delete_node (Dict *d, DictNode *n, bool with_key);
+
+/* Delete node N, already unlinked, for dict_delete_if(). */
+static void
+delete_if_node (Dict *d, DictNode *n)
+{
+  if (d->cache && d->cache->size_fn)
+    d->cache->bytes -= d->cache->size_fn (n->entry.key, n->entry.value);
+  delete_node (d, n, true);
+  d->n_entries--;
+}
+
+/* Rotate every other one of the first 2 * COUNT nodes of the list
+   below ROOT to the left. */
+static void
+vine_compress (DictNode *root, unsigned count)
+{
+  DictNode *scanner = root;
+  while (count--)
+    {
+      DictNode *child = scanner->children[1];
+      scanner->children[1] = child->children[1];
+      scanner = scanner->children[1];
+      child->children[1] = scanner->children[0];
+      scanner->children[0] = child;
+    }
+}
+
+/* Turn the list of SIZE nodes at *NP into a balanced tree. */
+static void
+vine_to_tree (DictNode **np, unsigned size)
+{
+  DictNode root;
+  unsigned full = size + 1;
+  while (full & (full - 1))
+    full &= full - 1;
+  root.children[1] = *np;
+  /* Make the bottom level, then halve the list until it is a tree. */
+  vine_compress (&root, size + 1 - full);
+  for (size = full - 1; size > 1; size /= 2)
+    vine_compress (&root, size / 2);
+  *np = root.children[1];
+}
+
+static void
+run_finish (Dict *d, DictRun *run)
+{
+  if (run->size)
+    {
+      *run->tail = NULL;
+      vine_to_tree (&d->slots[run->slot], run->size);
+    }
+  run->size = 0;
+}
+
+/* Append the nodes of tree N, in order, to the lists for their new
+   slots, unless deleting them. */
+static void
+run_append (Dict *d, DictRun *run, DictNode *n)
+{
+  unsigned depth = 0;
+  for (;;)
+    {
+      unsigned slot;
+      for (; n; n = n->children[0])
+        {
+          if (depth == run->stack_size)
+            {
+              DictNode **grown = mem_alloc (d, 2 * depth * sizeof *grown);
+              memcpy (grown, run->stack, depth * sizeof *grown);
+              mem_free (d, run->stack);
+              run->stack = grown;
+              run->stack_size = 2 * depth;
+            }
+          /* Fetch the right subtree while the left is visited. */
+          __builtin_prefetch (n->children[1]);
+          run->stack[depth++] = n;
+        }
+      if (!depth)
+        return;
+      n = run->stack[--depth];
+      if (run->pred && run->pred (&n->entry, run->cl))
+        {
+          DictNode *right = n->children[1];
+          delete_if_node (d, n);
+          n = right;
+          continue;
+        }
+      slot = hash_to_index (d, n->hash);
+      if (!run->size || slot != run->slot)
+        {
+          assert (!run->size || slot > run->slot);
+          run_finish (d, run);
+          run->slot = slot;
+          run->tail = &d->slots[slot];
+        }
+      *run->tail = n;
+      run->tail = &n->children[1];
+      run->size++;
+      n->children[0] = NULL;
+      n = n->children[1];
+    }
+}
+
+/* Move the nodes of a list bucket into the (new) slot array, keeping
+   their order. TAILS holds the link at the end of each new slot's
+   list, or NULL while the slot is empty. */
+static void
+list_rehash (Dict *d, DictNode *n, DictNode ***tails)
+{
+  while (n)
+    {
+      DictNode *next = n->children[0];
+      unsigned slot = hash_to_index (d, n->hash);
+      *(tails[slot] ? tails[slot] : &d->slots[slot]) = n;
+      tails[slot] = &n->children[0];
+      n->children[0] = NULL;
+      n = next;
+    }
+}
+
+static void
+rehash (Dict * d, int size)
+{
+  int i;
+  DictNode **old_slots;
+  int n_old_slots;
+  DictRun run;
+  DictNode ***tails = NULL;
+  assert ((size & (size - 1)) == 0);
+  if (d->versions)
+    {
+      /* Nodes are about to be relinked, so the writer needs its own
+         copy of all of them. */
+      cow_slots (d);
+      for (i = 0; i < (1u << d->l2_n_slots); i++)
+        if (d->slots[i])
+          cow_tree (d, &d->slots[i]);
+    }
+  old_slots = d->slots;
+  n_old_slots = 1u << d->l2_n_slots;
+  d->slots = mem_zalloc (d, size * sizeof *d->slots);
+  d->l2_n_slots = ffs (size) - 1;
+  run.size = 0;
+  run.stack_size = 64;
+  run.stack = mem_alloc (d, run.stack_size * sizeof *run.stack);
+  run.pred = NULL;
+  if (d->buckets == DICT_BUCKETS_LIST)
+    tails = mem_zalloc (d, size * sizeof *tails);
+  for (i = 0; i < n_old_slots; i++)
+    if (old_slots[i])
+      {
+        if (d->buckets == DICT_BUCKETS_PAGES)
+          page_rehash (d, (DictPage *)old_slots[i], NULL, NULL);
+        else if (d->buckets == DICT_BUCKETS_LIST)
+          list_rehash (d, old_slots[i], tails);
+        else
+          run_append (d, &run, old_slots[i]);
+      }
+  run_finish (d, &run);
+  mem_free (d, run.stack);
+  mem_free (d, tails);
+  mem_free (d, old_slots);
+  /* Trees and lists are relinked, but paged entries are copied. */
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    d->n_changes++;
+}
+
+static bool lock_rehash = false;
+
+extern void dict_rehash_TEST (Dict *d, int size)
+{
+  if (d->ordered)
+    {
+      /* There are half as many entries as slots. */
+      if (size / 2 >= d->ordered->n_used)
+        ordered_rebuild (d, size / 2, false);
+      return;
+    }
+  rehash (d, size);
+}
+extern void dict_lock_rehash_TEST(bool lock)
+{
+  lock_rehash = lock;
+}
+
+/* Expanding the hash table costs approximately O(n.log(n)) in
+   time. Expanding the table by doubling its size would, on average,
+   half the number of entries in each bucket, reducing the height of
+   each tree by approximately 1.
+   
+   Hence each time we access a node that is not the root node of the
+   bucket, we reason that this access may have required one fewer
+   node traversals, and count this towards the future benefit of
+   rehashing.
+
+   The cost of rehashing is approximated as the number of nodes in
+   the table, plus the number of slots in the table, as each of
+   these contributes a linear factor to the cost of the rehashing.
+*/
+#define CHECK_REHASH(d, depth) do {             \
+if (depth != 0 && !lock_rehash)                 \
+  {                                             \
+    (d)->rehash_benefit+=depth;                 \
+    check_rehash ((d), (depth));                \
+  }                                             \
+ } while (0)
+
+static void
+check_rehash (Dict * d, unsigned depth)
+{
+  if (d->n_iterators)
+    /* Wait until the iterators are done (forever, if one is abandoned
+       without dict_end()). */
+    return;
+  if (d->rehash_benefit > d->n_entries + (1u << d->l2_n_slots)
+      && d->n_entries * 4 > (1u << d->l2_n_slots))
+    {
+      /* Profitable to quadruple the size of the table. */
+      rehash (d, 4u << d->l2_n_slots);
+      d->rehash_benefit = 0;
+    }
+}
+
+/* ------------------------------------------------------------
+ * Radix tree dictionaries.
+ *
+ * Nothing is hashed. Each key is looked up by walking down from the
+ * root, matching each node's prefix and then choosing the child for
+ * the next byte, until a leaf is reached whose tail must match the
+ * rest of the key. Nodes grow (and shrink) between sizes as children
+ * are added (and removed), and a node left with one child is merged
+ * into it, so that every inner node has at least two children.
+ *
+ * Leaves don't keep whole keys. The entries they hand out point to
+ * the caller's copy of the key, or while iterating, to the iterator's
+ * copy, rebuilt on the way down.
+ */
+
+#define RADIX_IS_LEAF(p) ((uintptr_t)(p) & 1)
+#define RADIX_LEAF(p) ((RadixLeaf *)((uintptr_t)(p) - 1))
+#define RADIX_TAG(l) ((void *)((uintptr_t)(l) + 1))
+
+static const size_t radix_node_size[] = {
+  sizeof (RadixNode4), sizeof (RadixNode16),
+  sizeof (RadixNode48), sizeof (RadixNode256)
+};
+
+/* Resize nodes with fewer children than this to the next size down */
+static const int radix_shrink_at[] = { 0, 4, 13, 38 };
+
+static unsigned char *
+radix_prefix (RadixNode *n)
+{
+  return (unsigned char *)n + radix_node_size[n->type];
+}
+
+static size_t
+radix_node_bytes (RadixNode *n)
+{
+  return radix_node_size[n->type] + n->prefix_len;
+}
+
+static size_t
+radix_leaf_bytes (RadixLeaf *l)
+{
+  return sizeof *l + strlen (l->tail) + 1;
+}
+
+static void *
+radix_alloc (Dict *d, size_t size)
+{
+  d->radix->bytes += size;
+  return mem_alloc (d, size);
+}
+
+static void
+radix_free (Dict *d, void *p, size_t size)
+{
+  d->radix->bytes -= size;
+  mem_free (d, p);
+}
+
+static RadixNode *
+radix_new_node (Dict *d, int type, const void *prefix, size_t prefix_len)
+{
+  RadixNode *n = radix_alloc (d, radix_node_size[type] + prefix_len);
+  memset (n, 0, radix_node_size[type]);
+  n->type = type;
+  n->prefix_len = prefix_len;
+  memcpy (radix_prefix (n), prefix, prefix_len);
+  return n;
+}
+
+static RadixLeaf *
+radix_new_leaf (Dict *d, const char *tail)
+{
+  size_t len = strlen (tail);
+  RadixLeaf *l = radix_alloc (d, sizeof *l + len + 1);
+  l->entry.key = NULL;
+  l->entry.value = NULL;
+  memcpy (l->tail, tail, len + 1);
+  return l;
+}
+
+/* Length of the part of KEY matching a prefix. Prefixes contain no
+   NULs, so this never reads past the end of the key. */
+static size_t
+radix_match (const unsigned char *prefix, size_t len, const char *k)
+{
+  size_t i;
+  for (i = 0; i < len && prefix[i] == (unsigned char)k[i]; i++)
+    ;
+  return i;
+}
+
+static void
+radix_small_node (RadixNode *n, unsigned char **keys, void ***children)
+{
+  if (n->type == RADIX_4)
+    {
+      *keys = ((RadixNode4 *)n)->keys;
+      *children = ((RadixNode4 *)n)->children;
+    }
+  else
+    {
+      *keys = ((RadixNode16 *)n)->keys;
+      *children = ((RadixNode16 *)n)->children;
+    }
+}
+
+/* Pointer to N's child for byte C, or NULL */
+static void **
+radix_find_child (RadixNode *n, unsigned char c)
+{
+  int i;
+  switch (n->type)
+    {
+    case RADIX_4:
+      {
+        RadixNode4 *n4 = (RadixNode4 *)n;
+        for (i = 0; i < n->n_children; i++)
+          if (n4->keys[i] == c)
+            return &n4->children[i];
+        return NULL;
+      }
+    case RADIX_16:
+      {
+        RadixNode16 *n16 = (RadixNode16 *)n;
+#ifdef __SSE2__
+        __m128i keys = _mm_loadu_si128 ((const __m128i *)n16->keys);
+        unsigned found = (_mm_movemask_epi8 (_mm_cmpeq_epi8
+                                             (keys, _mm_set1_epi8 (c)))
+                          & ((1u << n->n_children) - 1));
+        return found ? &n16->children[__builtin_ctz (found)] : NULL;
+#else
+        for (i = 0; i < n->n_children; i++)
+          if (n16->keys[i] == c)
+            return &n16->children[i];
+        return NULL;
+#endif
+      }
+    case RADIX_48:
+      {
+        RadixNode48 *n48 = (RadixNode48 *)n;
+        i = n48->index[c];
+        return i ? &n48->children[i - 1] : NULL;
+      }
+    default:
+      {
+        RadixNode256 *n256 = (RadixNode256 *)n;
+        return n256->children[c] ? &n256->children[c] : NULL;
+      }
+    }
+}
+
+/* Children of N in order of their bytes: the next after position *POS,
+   or NULL. */
+static void *
+radix_next_child (RadixNode *n, int *pos, unsigned char *c)
+{
+  switch (n->type)
+    {
+    case RADIX_4:
+    case RADIX_16:
+      {
+        unsigned char *keys;
+        void **children;
+        radix_small_node (n, &keys, &children);
+        if (*pos >= n->n_children)
+          return NULL;
+        *c = keys[*pos];
+        return children[(*pos)++];
+      }
+    case RADIX_48:
+      {
+        RadixNode48 *n48 = (RadixNode48 *)n;
+        for (; *pos < 256; (*pos)++)
+          if (n48->index[*pos])
+            {
+              *c = *pos;
+              return n48->children[n48->index[(*pos)++] - 1];
+            }
+        return NULL;
+      }
+    default:
+      {
+        RadixNode256 *n256 = (RadixNode256 *)n;
+        for (; *pos < 256; (*pos)++)
+          if (n256->children[*pos])
+            {
+              *c = *pos;
+              return n256->children[(*pos)++];
+            }
+        return NULL;
+      }
+    }
+}
+
+static void radix_add_child (Dict *d, void **np, unsigned char c,
+                             void *child);
+
+/* Replace *NP with a node of type TYPE having the same prefix and
+   children. */
+static void
+radix_resize (Dict *d, void **np, int type)
+{
+  RadixNode *n = *np;
+  void *nn = radix_new_node (d, type, radix_prefix (n), n->prefix_len);
+  void *child;
+  int pos = 0;
+  unsigned char c;
+  while ((child = radix_next_child (n, &pos, &c)))
+    radix_add_child (d, &nn, c, child);
+  radix_free (d, n, radix_node_bytes (n));
+  *np = nn;
+}
+
+/* Add CHILD for byte C to the node at *NP, growing it if need be. */
+static void
+radix_add_child (Dict *d, void **np, unsigned char c, void *child)
+{
+  RadixNode *n = *np;
+  int i;
+  switch (n->type)
+    {
+    case RADIX_4:
+    case RADIX_16:
+      if (n->n_children < (n->type == RADIX_4 ? 4 : 16))
+        {
+          unsigned char *keys;
+          void **children;
+          radix_small_node (n, &keys, &children);
+          for (i = n->n_children; i > 0 && keys[i - 1] > c; i--)
+            {
+              keys[i] = keys[i - 1];
+              children[i] = children[i - 1];
+            }
+          keys[i] = c;
+          children[i] = child;
+          n->n_children++;
+          return;
+        }
+      break;
+    case RADIX_48:
+      if (n->n_children < 48)
+        {
+          RadixNode48 *n48 = (RadixNode48 *)n;
+          for (i = 0; n48->children[i]; i++)
+            ;
+          n48->children[i] = child;
+          n48->index[c] = i + 1;
+          n->n_children++;
+          return;
+        }
+      break;
+    default:
+      ((RadixNode256 *)n)->children[c] = child;
+      n->n_children++;
+      return;
+    }
+  radix_resize (d, np, n->type + 1);
+  radix_add_child (d, np, c, child);
+}
+
+/* Replace *NP, a node with a single child, by the child, taking on the
+   node's prefix and the child's byte ahead of its own prefix or tail. */
+static void
+radix_merge (Dict *d, void **np)
+{
+  RadixNode *n = *np;
+  unsigned char *prefix = radix_prefix (n);
+  int pos = 0;
+  unsigned char c;
+  void *child = radix_next_child (n, &pos, &c);
+  size_t head_len = n->prefix_len + (c != 0);
+  if (RADIX_IS_LEAF (child))
+    {
+      RadixLeaf *l = RADIX_LEAF (child);
+      size_t tail_len = strlen (l->tail);
+      RadixLeaf *nl = radix_alloc (d, sizeof *nl + head_len + tail_len + 1);
+      nl->entry = l->entry;
+      memcpy (nl->tail, prefix, n->prefix_len);
+      nl->tail[n->prefix_len] = c;
+      memcpy (nl->tail + head_len, l->tail, tail_len + 1);
+      radix_free (d, l, radix_leaf_bytes (l));
+      *np = RADIX_TAG (nl);
+    }
+  else
+    {
+      /* Keys end in leaves, so C isn't NUL. */
+      RadixNode *cn = child;
+      size_t size = radix_node_size[cn->type];
+      RadixNode *nn = radix_alloc (d, size + head_len + cn->prefix_len);
+      memcpy (nn, cn, size);
+      nn->prefix_len = head_len + cn->prefix_len;
+      memcpy (radix_prefix (nn), prefix, n->prefix_len);
+      radix_prefix (nn)[n->prefix_len] = c;
+      memcpy (radix_prefix (nn) + head_len, radix_prefix (cn),
+              cn->prefix_len);
+      radix_free (d, cn, radix_node_bytes (cn));
+      *np = nn;
+    }
+  radix_free (d, n, radix_node_bytes (n));
+}
+
+/* Remove the child for byte C from the node at *NP, shrinking or
+   merging it if need be. */
+static void
+radix_remove_child (Dict *d, void **np, unsigned char c)
+{
+  RadixNode *n = *np;
+  switch (n->type)
+    {
+    case RADIX_4:
+    case RADIX_16:
+      {
+        unsigned char *keys;
+        void **children;
+        int i;
+        radix_small_node (n, &keys, &children);
+        for (i = 0; keys[i] != c; i++)
+          ;
+        memmove (keys + i, keys + i + 1, n->n_children - i - 1);
+        memmove (children + i, children + i + 1,
+                 (n->n_children - i - 1) * sizeof *children);
+        break;
+      }
+    case RADIX_48:
+      {
+        RadixNode48 *n48 = (RadixNode48 *)n;
+        n48->children[n48->index[c] - 1] = NULL;
+        n48->index[c] = 0;
+        break;
+      }
+    default:
+      ((RadixNode256 *)n)->children[c] = NULL;
+      break;
+    }
+  n->n_children--;
+  if (n->n_children == 1)
+    radix_merge (d, np);
+  else if (n->n_children < radix_shrink_at[n->type])
+    radix_resize (d, np, n->type - 1);
+}
+
+static RadixLeaf *
+radix_search (Dict *d, const char *k)
+{
+  void *p = d->radix->root;
+  while (p && !RADIX_IS_LEAF (p))
+    {
+      RadixNode *n = p;
+      void **cp;
+      if (radix_match (radix_prefix (n), n->prefix_len, k) != n->prefix_len)
+        return NULL;
+      k += n->prefix_len;
+      cp = radix_find_child (n, *k);
+      if (!cp)
+        return NULL;
+      p = *cp;
+      if (*k)
+        k++;
+    }
+  if (p && strcmp (RADIX_LEAF (p)->tail, k) == 0)
+    return RADIX_LEAF (p);
+  return NULL;
+}
+
+/* Find the leaf for K, adding it with a NULL value if need be. */
+static RadixLeaf *
+radix_add (Dict *d, const char *k, bool *added)
+{
+  void **np = &d->radix->root;
+  RadixLeaf *l, *nl;
+  void *top;
+  size_t i;
+  *added = false;
+  while (*np && !RADIX_IS_LEAF (*np))
+    {
+      RadixNode *n = *np;
+      void **cp;
+      i = radix_match (radix_prefix (n), n->prefix_len, k);
+      if (i < n->prefix_len)
+        {
+          /* Split the prefix, putting a new node above N. */
+          unsigned char c = radix_prefix (n)[i];
+          void *rest = radix_new_node (d, n->type, radix_prefix (n) + i + 1,
+                                       n->prefix_len - i - 1);
+          memcpy ((char *)rest + sizeof (RadixNode),
+                  (char *)n + sizeof (RadixNode),
+                  radix_node_size[n->type] - sizeof (RadixNode));
+          ((RadixNode *)rest)->n_children = n->n_children;
+          top = radix_new_node (d, RADIX_4, radix_prefix (n), i);
+          radix_free (d, n, radix_node_bytes (n));
+          nl = radix_new_leaf (d, k + i + (k[i] != 0));
+          radix_add_child (d, &top, c, rest);
+          radix_add_child (d, &top, k[i], RADIX_TAG (nl));
+          *np = top;
+          *added = true;
+          d->n_entries++;
+          return nl;
+        }
+      k += i;
+      cp = radix_find_child (n, *k);
+      if (!cp)
+        {
+          nl = radix_new_leaf (d, k + (*k != 0));
+          radix_add_child (d, np, *k, RADIX_TAG (nl));
+          *added = true;
+          d->n_entries++;
+          return nl;
+        }
+      np = cp;
+      if (*k)
+        k++;
+    }
+  if (!*np)
+    {
+      nl = radix_new_leaf (d, k);
+      *np = RADIX_TAG (nl);
+      *added = true;
+      d->n_entries++;
+      return nl;
+    }
+  l = RADIX_LEAF (*np);
+  for (i = 0; l->tail[i] == k[i]; i++)
+    if (!k[i])
+      return l;
+  /* Split the leaf, putting a new node above it for the common part. */
+  top = radix_new_node (d, RADIX_4, k, i);
+  nl = radix_new_leaf (d, l->tail + i + (l->tail[i] != 0));
+  nl->entry = l->entry;
+  radix_add_child (d, &top, l->tail[i], RADIX_TAG (nl));
+  radix_free (d, l, radix_leaf_bytes (l));
+  nl = radix_new_leaf (d, k + i + (k[i] != 0));
+  radix_add_child (d, &top, k[i], RADIX_TAG (nl));
+  *np = top;
+  *added = true;
+  d->n_entries++;
+  return nl;
+}
+
+static bool
+radix_delete (Dict *d, const char *k)
+{
+  void **np = &d->radix->root, **parent = NULL;
+  unsigned char c = 0;
+  RadixLeaf *l;
+  while (*np && !RADIX_IS_LEAF (*np))
+    {
+      RadixNode *n = *np;
+      if (radix_match (radix_prefix (n), n->prefix_len, k) != n->prefix_len)
+        return false;
+      k += n->prefix_len;
+      c = *k;
+      parent = np;
+      np = radix_find_child (n, c);
+      if (!np)
+        return false;
+      if (*k)
+        k++;
+    }
+  if (!*np || strcmp (RADIX_LEAF (*np)->tail, k))
+    return false;
+  l = RADIX_LEAF (*np);
+  if (parent)
+    radix_remove_child (d, parent, c);
+  else
+    *np = NULL;
+  radix_free (d, l, radix_leaf_bytes (l));
+  d->n_entries--;
+  return true;
+}
+
+static void
+radix_free_tree (Dict *d, void *p)
+{
+  void *child;
+  int pos = 0;
+  unsigned char c;
+  if (RADIX_IS_LEAF (p))
+    {
+      mem_free (d, RADIX_LEAF (p));
+      return;
+    }
+  while ((child = radix_next_child (p, &pos, &c)))
+    radix_free_tree (d, child);
+  mem_free (d, p);
+}
+
+/* Delete the leaves below *NP for which PRED is true, rebuilding the
+   keys in *KEY, whose first LEN bytes lead to *NP. Nodes are then
+   shrunk or merged as if the leaves had been deleted one by one. */
+static void
+radix_delete_if (Dict *d, void **np, bool (*pred) (DictEntry *, void *),
+                 void *cl, char **key, size_t *key_size, size_t len)
+{
+  RadixNode *n = *np;
+  int i, j, type;
+  size_t need;
+  if (RADIX_IS_LEAF (n))
+    {
+      RadixLeaf *l = RADIX_LEAF (n);
+      need = len + strlen (l->tail) + 1;
+    }
+  else
+    need = len + n->prefix_len + 1;
+  if (need > *key_size)
+    {
+      char *grown = mem_alloc (d, 2 * need);
+      memcpy (grown, *key, len);
+      mem_free (d, *key);
+      *key = grown;
+      *key_size = 2 * need;
+    }
+  if (RADIX_IS_LEAF (n))
+    {
+      RadixLeaf *l = RADIX_LEAF (n);
+      strcpy (*key + len, l->tail);
+      l->entry.key = *key;
+      if (pred (&l->entry, cl))
+        {
+          radix_free (d, l, radix_leaf_bytes (l));
+          d->n_entries--;
+          *np = NULL;
+        }
+      return;
+    }
+  memcpy (*key + len, radix_prefix (n), n->prefix_len);
+  len += n->prefix_len;
+  switch (n->type)
+    {
+    case RADIX_4:
+    case RADIX_16:
+      {
+        unsigned char *keys;
+        void **children;
+        radix_small_node (n, &keys, &children);
+        for (i = j = 0; i < n->n_children; i++)
+          {
+            (*key)[len] = keys[i];
+            radix_delete_if (d, &children[i], pred, cl, key, key_size,
+                             len + (keys[i] != 0));
+            if (children[i])
+              {
+                keys[j] = keys[i];
+                children[j++] = children[i];
+              }
+          }
+        n->n_children = j;
+        break;
+      }
+    case RADIX_48:
+      {
+        RadixNode48 *n48 = (RadixNode48 *)n;
+        for (i = 0; i < 256; i++)
+          if (n48->index[i])
+            {
+              (*key)[len] = i;
+              radix_delete_if (d, &n48->children[n48->index[i] - 1], pred,
+                               cl, key, key_size, len + (i != 0));
+              if (!n48->children[n48->index[i] - 1])
+                {
+                  n48->index[i] = 0;
+                  n->n_children--;
+                }
+            }
+        break;
+      }
+    default:
+      {
+        RadixNode256 *n256 = (RadixNode256 *)n;
+        for (i = 0; i < 256; i++)
+          if (n256->children[i])
+            {
+              (*key)[len] = i;
+              radix_delete_if (d, &n256->children[i], pred, cl, key,
+                               key_size, len + (i != 0));
+              if (!n256->children[i])
+                n->n_children--;
+            }
+        break;
+      }
+    }
+  if (n->n_children == 0)
+    {
+      radix_free (d, n, radix_node_bytes (n));
+      *np = NULL;
+    }
+  else if (n->n_children == 1)
+    radix_merge (d, np);
+  else
+    {
+      for (type = n->type;
+           type > RADIX_4 && n->n_children < radix_shrink_at[type]; type--)
+        ;
+      if (type != n->type)
+        radix_resize (d, np, type);
+    }
+}
+
+Dict *
+dict_new_radix (void)
+{
+  Dict *d = dict_new (&strkeyfuncs);
+  d->radix = mem_zalloc (d, sizeof *d->radix);
+  return d;
+}
+
+/* Iterators walk the tree depth first, keeping a stack of nodes, each
+   with the position of the next child to visit and the length of the
+   key down to that child, and build each key in turn. */
+typedef struct RadixFrame RadixFrame;
+struct RadixFrame
+{
+  RadixNode *node;
+  int pos;
+  size_t len;
+};
+
+typedef struct DictRadixIter DictRadixIter;
+struct DictRadixIter
+{
+  DictEntry entry;
+  RadixLeaf *leaf;
+  RadixFrame *stack;
+  int depth;
+  int stack_size;
+  char *key;
+  size_t key_size;
+};
+
+static void
+radix_iter_reserve (Dict *d, DictRadixIter *it, size_t key_size)
+{
+  if (key_size > it->key_size)
+    {
+      char *key = mem_alloc (d, 2 * key_size);
+      memcpy (key, it->key, it->key_size);
+      mem_free (d, it->key);
+      it->key = key;
+      it->key_size = 2 * key_size;
+    }
+  if (it->depth == it->stack_size)
+    {
+      RadixFrame *stack = mem_alloc (d, 2 * it->stack_size * sizeof *stack);
+      memcpy (stack, it->stack, it->stack_size * sizeof *stack);
+      mem_free (d, it->stack);
+      it->stack = stack;
+      it->stack_size *= 2;
+    }
+}
+
+/* Descend to P, whose key starts with the first LEN bytes of the
+   iterator's. Returns true if P is a leaf, which is now the current
+   entry. */
+static bool
+radix_iter_push (Dict *d, DictRadixIter *it, void *p, size_t len)
+{
+  if (RADIX_IS_LEAF (p))
+    {
+      RadixLeaf *l = RADIX_LEAF (p);
+      size_t tail_len = strlen (l->tail);
+      radix_iter_reserve (d, it, len + tail_len + 1);
+      memcpy (it->key + len, l->tail, tail_len + 1);
+      it->leaf = l;
+      it->entry.key = it->key;
+      it->entry.value = l->entry.value;
+      return true;
+    }
+  else
+    {
+      RadixNode *n = p;
+      RadixFrame *f;
+      radix_iter_reserve (d, it, len + n->prefix_len + 1);
+      memcpy (it->key + len, radix_prefix (n), n->prefix_len);
+      f = &it->stack[it->depth++];
+      f->node = n;
+      f->pos = 0;
+      f->len = len + n->prefix_len;
+      return false;
+    }
+}
+
+static void
+radix_iter_free (Dict *d, DictRadixIter *it)
+{
+  mem_free (d, it->stack);
+  mem_free (d, it->key);
+  mem_free (d, it);
+}
+
+static DictEntry *
+radix_iter_next (Dict *d, DictRadixIter *it)
+{
+  while (it->depth > 0)
+    {
+      RadixFrame *f = &it->stack[it->depth - 1];
+      unsigned char c;
+      size_t len = f->len;
+      void *child = radix_next_child (f->node, &f->pos, &c);
+      if (!child)
+        {
+          it->depth--;
+          continue;
+        }
+      it->key[len] = c;
+      if (radix_iter_push (d, it, child, len + (c != 0)))
+        return (DictEntry *)it;
+    }
+  radix_iter_free (d, it);
+  d->n_iterators--;
+  return NULL;
+}
+
+/* Iterate over the subtree P, whose keys all start with the first LEN
+   bytes of KEY. */
+static DictEntry *
+radix_iter_start (Dict *d, void *p, const char *key, size_t len)
+{
+  DictRadixIter *it;
+  if (!p)
+    return NULL;
+  it = mem_alloc (d, sizeof *it);
+  it->depth = 0;
+  it->stack_size = 8;
+  it->stack = mem_alloc (d, it->stack_size * sizeof *it->stack);
+  it->key_size = len + 64;
+  it->key = mem_alloc (d, it->key_size);
+  memcpy (it->key, key, len);
+  d->n_iterators++;
+  if (radix_iter_push (d, it, p, len))
+    return (DictEntry *)it;
+  return radix_iter_next (d, it);
+}
+
+DictEntry *
+dict_prefix_first (Dict *d, const char *prefix)
+{
+  void *p;
+  const char *k = prefix;
+  assert (d->radix);
+  p = d->radix->root;
+  while (p && !RADIX_IS_LEAF (p) && *k)
+    {
+      RadixNode *n = p;
+      size_t i = radix_match (radix_prefix (n), n->prefix_len, k);
+      void **cp;
+      if (!k[i])
+        /* The prefix ends within this node's, so all its keys match. */
+        break;
+      if (i < n->prefix_len)
+        return NULL;
+      cp = radix_find_child (n, k[i]);
+      if (!cp)
+        return NULL;
+      p = *cp;
+      k += i + 1;
+    }
+  if (p && RADIX_IS_LEAF (p)
+      && strncmp (RADIX_LEAF (p)->tail, k, strlen (k)) != 0)
+    return NULL;
+  return radix_iter_start (d, p, prefix, k - prefix);
+}
+
+/* Print P, chosen by BYTE (or the root if BYTE is -1) */
+static void
+dict_dump_radix_tree (FILE *out,
+                      void (*print) (FILE *out, const void *k, void *value),
+                      void *p, int byte, int depth, char **key,
+                      size_t *key_size, size_t len, int *n_nodes,
+                      int *total_depth)
+{
+  fprintf (out, "%*s", 4 * depth, "");
+  if (byte > 0)
+    fprintf (out, "%c: ", byte);
+  else if (byte == 0)
+    fprintf (out, "\\0: ");
+  if (RADIX_IS_LEAF (p))
+    {
+      RadixLeaf *l = RADIX_LEAF (p);
+      size_t tail_len = strlen (l->tail);
+      if (len + tail_len + 1 > *key_size)
+        {
+          *key_size = 2 * (len + tail_len + 1);
+          *key = realloc (*key, *key_size);
+        }
+      memcpy (*key + len, l->tail, tail_len + 1);
+      fprintf (out, "\"%s\" ", l->tail);
+      if (print)
+        print (out, *key, l->entry.value);
+      else
+        fprintf (out, "'%s' => %p", *key, l->entry.value);
+      fputc ('\n', out);
+      *total_depth += depth;
+    }
+  else
+    {
+      static const int sizes[] = { 4, 16, 48, 256 };
+      RadixNode *n = p;
+      void *child;
+      int pos = 0;
+      unsigned char c;
+      if (len + n->prefix_len + 1 > *key_size)
+        {
+          *key_size = 2 * (len + n->prefix_len + 1);
+          *key = realloc (*key, *key_size);
+        }
+      memcpy (*key + len, radix_prefix (n), n->prefix_len);
+      len += n->prefix_len;
+      fprintf (out, "\"%.*s\" node%d, %d children\n", (int)n->prefix_len,
+               (char *)radix_prefix (n), sizes[n->type], n->n_children);
+      (*n_nodes)++;
+      while ((child = radix_next_child (n, &pos, &c)))
+        {
+          (*key)[len] = c;
+          dict_dump_radix_tree (out, print, child, c, depth + 1, key,
+                                key_size, len + (c != 0), n_nodes,
+                                total_depth);
+        }
+    }
+}
+
+static void
+dict_dump_radix (Dict *d, FILE *out,
+                 void (*print) (FILE *out, const void *k, void *value))
+{
+  int n_nodes = 0, total_depth = 0;
+  size_t key_size = 64;
+  char *key = malloc (key_size);
+  fprintf (out, "Radix dictionary at %p\n", d);
+  if (d->radix->root)
+    dict_dump_radix_tree (out, print, d->radix->root, -1, 0, &key,
+                          &key_size, 0, &n_nodes, &total_depth);
+  free (key);
+  fprintf (out, "n_entries=%d, nodes=%d, average depth=%f, bytes=%zu\n",
+           d->n_entries, n_nodes,
+           d->n_entries ? (double)total_depth / d->n_entries : 0.0,
+           d->radix->bytes);
+}
+
+static void
+dict_dump_dot_radix (FILE *out, void *p)
+{
+  if (RADIX_IS_LEAF (p))
+    fprintf (out, "  \"%p\" [ label=\"%s\" ];\n", p, RADIX_LEAF (p)->tail);
+  else
+    {
+      RadixNode *n = p;
+      void *child;
+      int pos = 0;
+      unsigned char c;
+      fprintf (out, "  \"%p\" [ shape=box, label=\"%.*s\" ];\n", p,
+               (int)n->prefix_len, (char *)radix_prefix (n));
+      while ((child = radix_next_child (n, &pos, &c)))
+        {
+          dict_dump_dot_radix (out, child);
+          if (c)
+            fprintf (out, "  \"%p\" -> \"%p\" [ label=\"%c\" ];\n",
+                     p, child, c);
+          else
+            fprintf (out, "  \"%p\" -> \"%p\" [ label=\"\\\\0\" ];\n",
+                     p, child);
+        }
+    }
+}
+
+/* ------------------------------------------------------------
+ * Key handles.
+ *
+ * Every method works on a handle; the plain ones make a handle for
+ * the one call.
+ */
+
+DictKey
+dict_key (DictKeyFuncs *funcs, const void *k)
+{
+  DictKey key;
+  if (!funcs)
+    funcs = &strkeyfuncs;
+  key.key = k;
+  key.hash_fn = funcs->hash_fn;
+  if (funcs->key_width)
+    {
+      key.hash = key_hash (funcs, k);
+      key.len = funcs->key_width;
+    }
+  else if (funcs->hash_fn == (DictKeyHashFn) strhash)
+    key.hash = mix_hash (strhash_len (k, &key.len));
+  else
+    {
+      key.hash = key_hash (funcs, k);
+      key.len = 0;
+    }
+  return key;
+}
+
+/* Handle for a key whose hash the caller has computed already, eg. by
+   an inlined function. HASH must be what the key functions' hash
+   function would return for K. */
+DictKey
+dict_key_with_hash (DictKeyFuncs *funcs, const void *k, unsigned hash)
+{
+  DictKey key;
+  if (!funcs)
+    funcs = &strkeyfuncs;
+  key.key = k;
+  key.len = funcs->key_width;
+  key.hash = mix_hash (hash);
+  key.hash_fn = funcs->hash_fn;
+  return key;
+}
+
+static void
+local_key (Dict *d, const void *k, DictKey *key)
+{
+  key->key = k;
+  key->len = d->keyfuncs->key_width;
+  /* Radix trees don't use hashes. */
+  key->hash = d->radix ? 0 : key_hash (d->keyfuncs, k);
+  key->hash_fn = d->keyfuncs->hash_fn;
+}
+
+/* A handle's hash is only meaningful to dictionaries hashing keys the
+   same way. */
+#define CHECK_KEY(d, key)                                       \
+  assert ((key)->hash_fn == (d)->keyfuncs->hash_fn                \
+          && (!(d)->keyfuncs->key_width                           \
+              || (key)->len == (d)->keyfuncs->key_width))
+
+void *
+dict_get (Dict * d, const void *k)
+{
+  DictKey key;
+  local_key (d, k, &key);
+  return dict_get_hashed (d, &key);
+}
+
+void *
+dict_get_hashed (Dict *d, const DictKey *key)
+{
+  const void *k = key->key;
+  unsigned hash = key->hash;
+  int depth;
+  DictNode **np;
+  void *res;
+  CHECK_KEY (d, key);
+  if (d->radix)
+    {
+      RadixLeaf *l = radix_search (d, k);
+      return l ? l->entry.value : NULL;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      DictOrderedEntry *e = ordered_search (d, k, hash, NULL);
+      return e ? e->entry.value : NULL;
+    }
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      DictEntry *e = page_search (d, k, hash, &depth);
+      res = e ? e->value : NULL;
+      CHECK_REHASH (d, depth);
+      return res;
+    }
+  np = search(d, k, hash, &depth);
+  CACHE_ACCESS (d, *np);
+  if (*np)
+    res = (*np)->entry.value;
+  else
+    res = NULL;
+  CHECK_REHASH (d, depth);
+  return res;
+}
+
+bool
+dict_has_key (Dict * d, const void *k)
+{
+  DictKey key;
+  local_key (d, k, &key);
+  return dict_has_key_hashed (d, &key);
+}
+
+bool
+dict_has_key_hashed (Dict *d, const DictKey *key)
+{
+  const void *k = key->key;
+  unsigned hash = key->hash;
+  int depth;
+  DictNode **np;
+  bool res;
+  CHECK_KEY (d, key);
+  if (d->radix)
+    return radix_search (d, k) != NULL;
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    return ordered_search (d, k, hash, NULL) != NULL;
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      res = page_search (d, k, hash, &depth) != NULL;
+      CHECK_REHASH (d, depth);
+      return res;
+    }
+  np = search (d, k, hash, &depth);
+  res = (*np != NULL);
+  CACHE_ACCESS (d, *np);
+  CHECK_REHASH (d, depth);
+  return res;
+}
+
+/* Give a newly added page entry its own copy of key K. */
+static void
+page_own_key (Dict *d, DictEntry *e, const void *k)
+{
+  if (d->keyfuncs->key_width)
+    {
+      void *copy = mem_alloc (d, d->keyfuncs->key_width);
+      memcpy (copy, k, d->keyfuncs->key_width);
+      e->key = copy;
+    }
+  else if (d->keyfuncs->dup_fn)
+    e->key = d->keyfuncs->dup_fn (k);
+  else
+    e->key = k;
+  d->n_entries++;
+  d->n_changes++;
+}
+
+static void
+page_set (Dict *d, const void *k, unsigned hash, void *value, bool insert)
+{
+  int depth;
+  bool added;
+  DictEntry *e = page_add (d, &PAGE_SLOTS (d)[hash_to_index (d, hash)],
+                           k, hash, &depth, &added);
+  assert (added || !insert);
+  if (added)
+    page_own_key (d, e, k);
+  e->value = value;
+  CHECK_REHASH (d, depth);
+}
+
+void
+dict_set (Dict * d, const void *k, void *value)
+{
+  DictKey key;
+  local_key (d, k, &key);
+  dict_set_hashed (d, &key, value);
+}
+
+void
+dict_set_hashed (Dict *d, const DictKey *key, void *value)
+{
+  const void *k = key->key;
+  unsigned hash = key->hash;
+  int depth;
+  DictNode **np;
+  CHECK_KEY (d, key);
+  if (d->radix)
+    {
+      bool added;
+      radix_add (d, k, &added)->entry.value = value;
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      bool added;
+      ordered_add (d, key, &added)->entry.value = value;
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      page_set (d, k, hash, value, false);
+      return;
+    }
+  if (d->versions)
+    np = cow_search (d, k, hash, &depth);
+  else
+    np = search (d, k, hash, &depth);
+  if (*np)
+    {
+      DictNode *n = *np;
+      if (d->cache && d->cache->size_fn)
+        d->cache->bytes += (d->cache->size_fn (n->entry.key, value)
+                            - d->cache->size_fn (n->entry.key,
+                                                 n->entry.value));
+      n->entry.value = value;
+    }
+  else
+    {
+      *np = new_node (d, key, value);
+      d->n_entries++;
+      if (d->cache)
+        cache_trim (d, key);
+    }
+  CHECK_REHASH (d, depth);
+}
+
+void
+dict_insert (Dict * d, const void *k, void *value)
+{
+  DictKey key;
+  local_key (d, k, &key);
+  dict_insert_hashed (d, &key, value);
+}
+
+void
+dict_insert_hashed (Dict *d, const DictKey *key, void *value)
+{
+  const void *k = key->key;
+  unsigned hash = key->hash;
+  int depth;
+  DictNode **np;
+  CHECK_KEY (d, key);
+  if (d->radix)
+    {
+      bool added;
+      radix_add (d, k, &added)->entry.value = value;
+      assert (added);
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      bool added;
+      ordered_add (d, key, &added)->entry.value = value;
+      assert (added);
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      page_set (d, k, hash, value, true);
+      return;
+    }
+  if (d->versions)
+    np = cow_search (d, k, hash, &depth);
+  else
+    np = search (d, k, hash, &depth);
+  assert(!*np);
+  *np = new_node (d, key, value);
+  d->n_entries++;
+  if (d->cache)
+    cache_trim (d, key);
+  CHECK_REHASH (d, depth);
+}
+
+void
+dict_insert_entries (Dict *d, ...)
+{
+  va_list va;
+  const void *key;
+  void *value;
+  va_start (va, d);
+  while ((key = va_arg (va, const void *)))
+    {
+      value = va_arg (va, void *);
+      dict_insert (d, key, value);
+    }
+  va_end (va);
+}
+
+void
+dict_set_entries (Dict *d, ...)
+{
+  va_list va;
+  const void *key;
+  void *value;
+  va_start (va, d);
+  while ((key = va_arg (va, const void *)))
+    {
+      value = va_arg (va, void *);
+      dict_set (d, key, value);
+    }
+  va_end (va);
+}
+
+/* Release a node removed from the tree by dict_delete(), and
+   optionally its key. */
+static void
+free_node_key (Dict *d, DictNode *n)
+{
+  if (!key_in_slab (d, n) && d->keyfuncs->free_fn)
+    d->keyfuncs->free_fn (n->entry.key);
+}
+
+static void
+free_node (Dict *d, DictNode *n)
+{
+  if (node_in_slab (d, n))
+    d->slab_dead += node_size (d);
+  else
+    mem_free (d, n);
+}
+
+static void
+delete_node (Dict *d, DictNode *n, bool with_key)
+{
+  if (d->versions)
+    {
+      if (with_key)
+        retire_key (d, n->entry.key);
+      discard_node (d, n);
+    }
+  else
+    {
+      if (with_key && d->arena)
+        arena_delete (d->arena, n->entry.key);
+      else if (with_key)
+        free_node_key (d, n);
+      free_node (d, n);
+    }
+}
+
+/* Remove the node at *NP from its tree. */
+static void
+unlink_node (Dict *d, DictNode **np)
+{
+  DictNode *n = *np;
+  d->n_changes++;
+  if (n->children[0])
+    {
+      if (n->children[1])
+        {
+          /* Pick the successor (leftmost child of the right subtree)
+             or predecessor (rightmost child of the left subtree) and
+             replace this node's contents with that.
+          */
+          static int i = 0;
+          DictNode *repl;
+          np = &(n->children[i]);
+          i ^= 1;               /* alternate left/right */
+          if (d->versions)
+            cow_node (d, np);
+          while ((*np)->children[i])
+            {
+              np = &(*np)->children[i];
+              if (d->versions)
+                cow_node (d, np);
+            }
+          repl = *np;
+          /* copy the adjacent node's data to N */
+          if (d->versions)
+            retire_key (d, n->entry.key);
+          else if (d->arena)
+            arena_delete (d->arena, n->entry.key);
+          else
+            free_node_key (d, n);
+          n->entry = repl->entry;
+          if (!d->versions)
+            n->key_in_slab = repl->key_in_slab;
+          if (d->keyfuncs->key_width)
+            copy_inline_key (d, n, repl);
+          n->hash = repl->hash;
+          if (d->cache)
+            n->referenced = repl->referenced;
+          *np = repl->children[i^1];
+          delete_node (d, repl, false);
+          d->n_entries--;
+        }
+      else
+        {
+          *np = n->children[0];
+          delete_node (d, n, true);
+          d->n_entries--;
+        }
+    }
+  else
+    {
+      *np = n->children[1];
+      delete_node (d, n, true);
+      d->n_entries--;
+    }
+}
+
+void
+dict_delete (Dict * d, const void *k)
+{
+  DictKey key;
+  local_key (d, k, &key);
+  dict_delete_hashed (d, &key);
+}
+
+void
+dict_delete_hashed (Dict *d, const DictKey *key)
+{
+  const void *k = key->key;
+  unsigned hash = key->hash;
+  DictNode ** np, *n;
+  int depth;
+  CHECK_KEY (d, key);
+  if (d->radix)
+    {
+      radix_delete (d, k);
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      ordered_delete (d, k, hash);
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      if (page_delete (d, k, hash))
+        {
+          d->n_entries--;
+          d->n_changes++;
+        }
+      return;
+    }
+  np = search (d, k, hash, &depth);
+  n = *np;
+  if (!n)
+    /* not found */
+    return;
+  if (d->versions)
+    np = cow_search (d, k, hash, &depth);
+  if (d->cache && d->cache->size_fn)
+    d->cache->bytes -= d->cache->size_fn (n->entry.key, n->entry.value);
+  unlink_node (d, np);
+}
+
+/* Delete every entry for which PRED is true, visiting each bucket once
+   and rebuilding it from the entries that are kept, instead of
+   searching for each entry in turn. Returns the number deleted. */
+unsigned int
+dict_delete_if (Dict *d, bool (*pred) (DictEntry *de, void *cl), void *cl)
+{
+  unsigned int n_entries = d->n_entries;
+  DictRun run;
+  int i;
+  assert (!d->n_iterators);
+  d->n_changes++;
+  if (d->radix)
+    {
+      if (d->radix->root)
+        {
+          size_t key_size = 256;
+          char *key = mem_alloc (d, key_size);
+          radix_delete_if (d, &d->radix->root, pred, cl, &key, &key_size, 0);
+          mem_free (d, key);
+        }
+      return n_entries - d->n_entries;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      ordered_delete_if (d, pred, cl);
+      return n_entries - d->n_entries;
+    }
+  if (d->versions)
+    cow_slots (d);
+  run.size = 0;
+  run.stack_size = 64;
+  run.stack = mem_alloc (d, run.stack_size * sizeof *run.stack);
+  run.pred = pred;
+  run.cl = cl;
+  for (i = 0; i < (1u << d->l2_n_slots); i++)
+    if (d->slots[i])
+      {
+        if (d->buckets == DICT_BUCKETS_LIST)
+          {
+            DictNode **np = &d->slots[i];
+            while (*np)
+              {
+                DictNode *n = *np;
+                if (pred (&n->entry, cl))
+                  {
+                    *np = n->children[0];
+                    delete_if_node (d, n);
+                  }
+                else
+                  np = &n->children[0];
+              }
+          }
+        else if (d->buckets == DICT_BUCKETS_PAGES)
+          {
+            DictPage *p = PAGE_SLOTS (d)[i];
+            PAGE_SLOTS (d)[i] = NULL;
+            page_rehash (d, p, pred, cl);
+          }
+        else
+          {
+            DictNode *n;
+            /* Every node is relinked, so the writer needs its own
+               copy of them. */
+            if (d->versions)
+              cow_tree (d, &d->slots[i]);
+            n = d->slots[i];
+            d->slots[i] = NULL;
+            run_append (d, &run, n);
+          }
+      }
+  run_finish (d, &run);
+  mem_free (d, run.stack);
+  return n_entries - d->n_entries;
+}
+
+/* Recurses only to the right, so that list buckets of any length
+   are freed in constant stack space. */
+void dict_free_nodes (Dict *d, DictNode *n)
+{
+  while (n)
+    {
+      DictNode *left = n->children[0];
+      free_node_key (d, n);
+      if (n->children[1])
+        dict_free_nodes (d, n->children[1]);
+      free_node (d, n);
+      n = left;
+    }
+}
+
+/* ------------------------------------------------------------
+ * Cloning.
+ *
+ * A clone gets a slot array of the same size and copies of the
+ * buckets, node by node, so the stored hashes are reused and nothing
+ * is searched for or rehashed. Keys are copied as the dictionary
+ * would copy them (into the clone's own arena for string arena
+ * dictionaries); those it doesn't copy are shared.
+ */
+
+static const void *
+clone_key (Dict *c, const void *k)
+{
+  if (c->arena)
+    {
+      DictKeyRecord *r = key_record (k);
+      return arena_add (c, r->str, r->len, r->hash);
+    }
+  else if (c->keyfuncs->dup_fn)
+    return c->keyfuncs->dup_fn (k);
+  return k;
+}
+
+/* Like dict_free_nodes(), recurses only to the right. */
+static DictNode *
+clone_nodes (Dict *c, DictNode *n)
+{
+  DictNode *top, **np = &top;
+  size_t size = node_size (c);
+  for (; n; n = n->children[0])
+    {
+      DictNode *copy;
+      __builtin_prefetch (n->children[0]);
+      __builtin_prefetch (n->children[1]);
+      if (!c->keyfuncs->key_width)
+        __builtin_prefetch (n->entry.key);
+      copy = mem_alloc (c, size);
+      memcpy (copy, n, size);
+      copy->in_slab = copy->key_in_slab = 0;
+      if (c->keyfuncs->key_width)
+        copy->entry.key = copy->key_data;
+      else
+        copy->entry.key = clone_key (c, n->entry.key);
+      if (n->children[1])
+        copy->children[1] = clone_nodes (c, n->children[1]);
+      *np = copy;
+      np = &copy->children[0];
+    }
+  *np = NULL;
+  return top;
+}
+
+static DictPage *
+clone_pages (Dict *c, DictPage *p)
+{
+  DictPage *copy = page_new (c);
+  size_t width = c->keyfuncs->key_width;
+  int i;
+  *copy = *p;
+  for (i = 0; i <= p->n; i++)
+    if (p->children[i])
+      copy->children[i] = clone_pages (c, p->children[i]);
+  for (i = 0; i < p->n; i++)
+    if (width)
+      {
+        void *key = mem_alloc (c, width);
+        memcpy (key, p->entries[i].key, width);
+        copy->entries[i].key = key;
+      }
+    else
+      copy->entries[i].key = clone_key (c, p->entries[i].key);
+  return copy;
+}
+
+static void
+clone_ordered (Dict *c, Dict *d)
+{
+  DictOrdered *from = d->ordered, *o = c->ordered;
+  size_t entry_size = ordered_entry_size (d);
+  unsigned i;
+  *o = *from;
+  if (!from->size)
+    return;
+  o->entries = mem_alloc (c, from->size * entry_size);
+  memcpy (o->entries, from->entries, from->n_used * entry_size);
+  for (i = 0; i < o->n_used; i++)
+    {
+      DictOrderedEntry *e = ordered_entry (c, i);
+      if (e->deleted)
+        continue;
+      if (c->keyfuncs->key_width)
+        e->entry.key = e->key_data;
+      else
+        e->entry.key = clone_key (c, e->entry.key);
+    }
+}
+
+static void *
+radix_clone_tree (Dict *c, void *p)
+{
+  void *child;
+  int pos = 0;
+  unsigned char ch;
+  RadixNode *copy;
+  if (RADIX_IS_LEAF (p))
+    {
+      RadixLeaf *l = RADIX_LEAF (p);
+      size_t size = radix_leaf_bytes (l);
+      RadixLeaf *copy = radix_alloc (c, size);
+      memcpy (copy, l, size);
+      return RADIX_TAG (copy);
+    }
+  copy = radix_alloc (c, radix_node_bytes (p));
+  memcpy (copy, p, radix_node_bytes (p));
+  while ((child = radix_next_child (p, &pos, &ch)))
+    *radix_find_child (copy, ch) = radix_clone_tree (c, child);
+  return copy;
+}
+
+/* An empty dictionary of the same kind as D, other than versioned. */
+static Dict *
+new_like (Dict *d)
+{
+  Dict *c;
+  if (d->huge)
+    c = dict_new_hugepages (d->keyfuncs, d->buckets);
+  else
+    {
+      c = dict_new_with_allocator (d->keyfuncs, d->alloc_ctx, d->alloc_fn,
+                                   d->dealloc_fn);
+      set_buckets (c, d->buckets);
+    }
+  if (d->radix)
+    c->radix = mem_zalloc (c, sizeof *c->radix);
+  if (d->arena)
+    c->arena = mem_zalloc (c, sizeof *c->arena);
+  if (d->cache)
+    {
+      c->cache = mem_alloc (c, sizeof *c->cache);
+      *c->cache = *d->cache;
+      c->cache->bytes = 0;
+      c->cache->hand = 0;
+      c->cache->hits = c->cache->misses = c->cache->evictions = 0;
+    }
+  return c;
+}
+
+Dict *
+dict_clone (Dict *d)
+{
+  Dict *c;
+  size_t slot_size;
+  int i;
+  /* Versioned dictionaries share their nodes with snapshots. */
+  assert (!d->versions);
+  c = new_like (d);
+  if (d->radix)
+    {
+      if (d->radix->root)
+        c->radix->root = radix_clone_tree (c, d->radix->root);
+      c->n_entries = d->n_entries;
+      return c;
+    }
+  if (c->cache)
+    {
+      c->cache->bytes = d->cache->bytes;
+      c->cache->hand = d->cache->hand;
+    }
+  slot_size = d->ordered ? sizeof (unsigned) : sizeof *d->slots;
+  mem_free (c, c->slots);
+  c->l2_n_slots = d->l2_n_slots;
+  c->slots = mem_alloc (c, slot_size << d->l2_n_slots);
+  if (d->ordered)
+    {
+      memcpy (c->slots, d->slots, slot_size << d->l2_n_slots);
+      clone_ordered (c, d);
+    }
+  else
+    for (i = 0; i < (1u << d->l2_n_slots); i++)
+      {
+        /* The buckets are scattered: fetch ahead. */
+        if (i + 8 < (1u << d->l2_n_slots))
+          __builtin_prefetch (d->slots[i + 8]);
+        if (!d->slots[i])
+          c->slots[i] = NULL;
+        else if (d->buckets == DICT_BUCKETS_PAGES)
+          PAGE_SLOTS (c)[i] = clone_pages (c, PAGE_SLOTS (d)[i]);
+        else
+          c->slots[i] = clone_nodes (c, d->slots[i]);
+      }
+  c->n_entries = d->n_entries;
+  c->rehash_benefit = d->rehash_benefit;
+  c->promote_tick = d->promote_tick;
+  return c;
+}
+
+/* ------------------------------------------------------------
+ * Defragmentation.
+ *
+ * Each bucket's nodes are copied into consecutive space in fresh
+ * slabs, breadth first from the root so that the nodes a search meets
+ * first come first (a list is simply kept in order), and the buckets
+ * follow one another in slot order. Owned string keys are copied to
+ * just after their nodes, so that a search which finds its node has
+ * the key to hand, and arena keys into fresh chunks in the same
+ * order. The old nodes and keys are freed and the old slabs
+ * released.
+ */
+
+static void *
+slab_alloc (Dict *d, DictSlab **slabs, size_t size)
+{
+  DictSlab *s = *slabs;
+  void *p;
+  size = (size + 7) & ~(size_t)7;
+  if (!s || s->used + size > s->size)
+    {
+      size_t slab_size = size > SLAB_SIZE ? size : SLAB_SIZE;
+      s = mem_alloc (d, offsetof (DictSlab, data) + slab_size);
+      s->size = slab_size;
+      s->used = 0;
+      s->next = *slabs;
+      *slabs = s;
+    }
+  p = s->data + s->used;
+  s->used += size;
+  return p;
+}
+
+static void
+slabs_free (Dict *d, DictSlab *s)
+{
+  while (s)
+    {
+      DictSlab *next = s->next;
+      mem_free (d, s);
+      s = next;
+    }
+}
+
+typedef struct DictDefrag DictDefrag;
+struct DictDefrag
+{
+  DictSlab *slabs;
+  bool string_keys;             /* strdup()ed keys, copied alongside */
+  DictNode ***queue;            /* Links to the nodes still to copy */
+  size_t queue_size;
+};
+
+static void
+defragment_bucket (Dict *d, DictDefrag *df, DictNode **root)
+{
+  size_t head = 0, tail = 0;
+  df->queue[tail++] = root;
+  while (head < tail)
+    {
+      DictNode **np = df->queue[head++], *old = *np, *n;
+      size_t key_size = df->string_keys ? strlen (old->entry.key) + 1 : 0;
+      int i;
+      n = slab_alloc (d, &df->slabs, node_size (d) + key_size);
+      memcpy (n, old, node_size (d));
+      n->in_slab = 1;
+      if (d->keyfuncs->key_width)
+        n->entry.key = n->key_data;
+      else if (d->arena)
+        {
+          DictKeyRecord *r = key_record (old->entry.key);
+          n->entry.key = arena_add (d, r->str, r->len, r->hash);
+        }
+      else if (key_size)
+        {
+          char *key = (char *)n + node_size (d);
+          memcpy (key, old->entry.key, key_size);
+          free_node_key (d, old);
+          n->entry.key = key;
+          n->key_in_slab = 1;
+        }
+      *np = n;
+      free_node (d, old);
+      for (i = 0; i < 2; i++)
+        if (n->children[i])
+          {
+            if (tail == df->queue_size)
+              {
+                DictNode ***grown = mem_alloc (d, 2 * tail * sizeof *grown);
+                memcpy (grown, df->queue, tail * sizeof *grown);
+                mem_free (d, df->queue);
+                df->queue = grown;
+                df->queue_size = 2 * tail;
+              }
+            df->queue[tail++] = &n->children[i];
+          }
+    }
+}
+
+void
+dict_defragment (Dict *d)
+{
+  DictDefrag df;
+  DictKeyChunk *old_keys = NULL;
+  int i;
+  assert (!d->n_iterators);
+  /* Snapshots may share the nodes. */
+  assert (!d->versions);
+  if (d->radix || d->buckets == DICT_BUCKETS_PAGES)
+    return;
+  d->n_changes++;
+  if (d->ordered)
+    {
+      ordered_compact (d);
+      if (d->arena)
+        dict_compact_keys (d);
+      return;
+    }
+  if (d->arena)
+    {
+      old_keys = d->arena->chunks;
+      d->arena->chunks = NULL;
+      d->arena->allocated = 0;
+      d->arena->dead = 0;
+    }
+  df.slabs = NULL;
+  /* Only keys that strkeyfuncs copies are known to be plain strings
+     that may be freed early. */
+  df.string_keys = (!d->arena && d->keyfuncs->dup_fn == strkeyfuncs.dup_fn
+                    && d->keyfuncs->free_fn == strkeyfuncs.free_fn);
+  df.queue_size = 64;
+  df.queue = mem_alloc (d, df.queue_size * sizeof *df.queue);
+  for (i = 0; i < (1u << d->l2_n_slots); i++)
+    {
+      if (i + 8 < (1u << d->l2_n_slots))
+        __builtin_prefetch (d->slots[i + 8]);
+      if (d->slots[i])
+        defragment_bucket (d, &df, &d->slots[i]);
+    }
+  mem_free (d, df.queue);
+  slabs_free (d, d->slabs);
+  d->slabs = df.slabs;
+  d->slab_dead = 0;
+  arena_free_chunks (d, old_keys);
+}
+
+void
+dict_free (Dict * d)
+{
+  int i;
+  /* Nothing to do for each node if the allocator releases memory in
+     bulk and the keys don't need freeing. */
+  if (d->ordered)
+    ordered_free (d);
+  else if ((d->dealloc_fn && !d->huge) || d->keyfuncs->free_fn)
+    for (i = 0; i < (1u << d->l2_n_slots); i++)
+      if (d->slots[i])
+        {
+          if (d->buckets == DICT_BUCKETS_PAGES)
+            page_free_tree (d, PAGE_SLOTS (d)[i]);
+          else
+            dict_free_nodes (d, d->slots[i]);
+        }
+  if (d->versions)
+    {
+      /* Assumes there are no readers left. Free every retired node,
+         including those still pending on the current snapshot. */
+      DictVersions *v = d->versions;
+      unsigned g;
+      for (g = v->oldest; g != v->epoch; g++)
+        free_snapshot (d, v->ring[g % SNAPSHOT_RING]);
+      mem_free (d, v);
+    }
+  mem_free (d, d->cache);
+  if (d->arena)
+    {
+      arena_free_chunks (d, d->arena->chunks);
+      mem_free (d, d->arena);
+    }
+  if (d->radix)
+    {
+      if (d->radix->root && d->dealloc_fn)
+        radix_free_tree (d, d->radix->root);
+      mem_free (d, d->radix);
+    }
+  slabs_free (d, d->slabs);
+  mem_free (d, d->slots);
+  if (d->huge)
+    huge_release (d->huge);     /* Including D itself */
+  else
+    mem_free (d, d);
+}
+
+/* Number of entries in the dictionary */
+unsigned int
+dict_n_entries (Dict *d)
+{
+  return d->n_entries;
+}
+
+/* Amount of memory allocated to dictionary */
+size_t
+dict_allocated_bytes (Dict *d)
+{
+  size_t total;
+  if (!d)
+    return 0;
+  total = sizeof (Dict);
+  total += ((d->ordered ? sizeof (unsigned) : sizeof (*(d->slots)))
+            << d->l2_n_slots);
+  if (d->radix)
+    total += sizeof (DictRadix) + d->radix->bytes;
+  else if (d->ordered)
+    total += (sizeof (DictOrdered)
+              + ordered_entry_size (d) * d->ordered->size);
+  else if (d->buckets == DICT_BUCKETS_PAGES)
+    total += (sizeof (DictPage) * d->n_pages
+              + d->keyfuncs->key_width * d->n_entries);
+  else
+    total += node_size (d) * d->n_entries + d->slab_dead;
+  if (d->arena)
+    total += d->arena->allocated;
+  return total;
+}
+
+void
+dict_get_stats (Dict *d, DictStats *stats)
+{
+  stats->n_entries = d->n_entries;
+  stats->n_slots = 1u << d->l2_n_slots;
+  stats->allocated_bytes = dict_allocated_bytes (d);
+  stats->dead_key_bytes = d->arena ? d->arena->dead : 0;
+  if (d->cache)
+    {
+      stats->hits = d->cache->hits;
+      stats->misses = d->cache->misses;
+      stats->evictions = d->cache->evictions;
+    }
+  else
+    stats->hits = stats->misses = stats->evictions = 0;
+}
+
+/* ------------------------------------------------------------
+ * Iterators
+ *
+ * The buckets are tree-structured, so a simple linear iterator is
+ * insufficient. Instead, we'll keep a stack of entries.
+ */
+
+typedef struct DictEntryStack DictEntryStack;
+struct DictEntryStack
+{
+  DictEntry entry;
+  DictNode *node;
+  DictEntryStack *up;
+};
+
+/* Paged buckets keep a stack of pages, each with the position of the
+   next entry to return or (after the entries) child to visit. */
+typedef struct DictPageStack DictPageStack;
+struct DictPageStack
+{
+  DictEntry entry;
+  DictPage *page;
+  int pos;
+  int slot;
+  DictPageStack *up;
+};
+
+/* Ordered buckets just keep the position of the next entry. */
+typedef struct DictOrderedIter DictOrderedIter;
+struct DictOrderedIter
+{
+  DictEntry entry;
+  unsigned pos;
+};
+
+static DictEntry *
+ordered_next (Dict *d, DictOrderedIter *it)
+{
+  while (it->pos < d->ordered->n_used)
+    {
+      DictOrderedEntry *e = ordered_entry (d, it->pos++);
+      if (!e->deleted)
+        {
+          it->entry = e->entry;
+          return (DictEntry *)it;
+        }
+    }
+  mem_free (d, it);
+  d->n_iterators--;
+  return NULL;
+}
+
+static DictEntry *
+page_next (Dict *d, DictPageStack *ps)
+{
+  for (;;)
+    {
+      DictPage *p = ps->page;
+      int child = ps->pos - p->n;
+      if (child < 0)
+        {
+          ps->entry = p->entries[ps->pos++];
+          return (DictEntry *)ps;
+        }
+      else if (child <= p->n)
+        {
+          ps->pos++;
+          if (p->children[child])
+            {
+              DictPageStack *ps2 = mem_alloc (d, sizeof *ps2);
+              ps2->page = p->children[child];
+              ps2->pos = 0;
+              ps2->slot = ps->slot;
+              ps2->up = ps;
+              ps = ps2;
+            }
+        }
+      else if (ps->up)
+        {
+          DictPageStack *old = ps;
+          ps = ps->up;
+          mem_free (d, old);
+        }
+      else
+        {
+          /* Stack empty. Next bucket. */
+          while (++ps->slot < (1u << d->l2_n_slots))
+            if (d->slots[ps->slot])
+              break;
+          if (ps->slot == (1u << d->l2_n_slots))
+            {
+              mem_free (d, ps);
+              d->n_iterators--;
+              return NULL;
+            }
+          ps->page = PAGE_SLOTS (d)[ps->slot];
+          ps->pos = 0;
+        }
+    }
+}
+
+DictEntry *
+dict_first (Dict * d)
+{
+  int i;
+  int size = (1u << d->l2_n_slots);
+  if (d->radix)
+    return radix_iter_start (d, d->radix->root, "", 0);
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      DictOrderedIter *it;
+      if (!d->n_entries)
+        return NULL;
+      it = mem_alloc (d, sizeof *it);
+      it->pos = 0;
+      d->n_iterators++;
+      return ordered_next (d, it);
+    }
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      for (i = 0; i < size; i++)
+        if (d->slots[i])
+          {
+            DictPageStack *ps = mem_alloc (d, sizeof *ps);
+            ps->page = PAGE_SLOTS (d)[i];
+            ps->pos = 0;
+            ps->slot = i;
+            ps->up = NULL;
+            d->n_iterators++;
+            return page_next (d, ps);
+          }
+      return NULL;
+    }
+  for (i = 0; i < size; i++)
+    if (d->slots[i])
+      {
+        DictEntryStack *des = mem_alloc (d, sizeof *des);
+        des->node = d->slots[i];
+        des->up = NULL;
+        des->entry = des->node->entry;
+        d->n_iterators++;
+        return (DictEntry *)des;
+      }
+  return NULL;
+}
+
+DictEntry *
+dict_next (Dict *d, DictEntry *de)
+{
+  DictEntryStack *des = (DictEntryStack *)de;
+  if (d->radix)
+    return radix_iter_next (d, (DictRadixIter *)de);
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    return ordered_next (d, (DictOrderedIter *)de);
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    return page_next (d, (DictPageStack *)de);
+  if (des->node->children[0])
+    {
+      if (des->node->children[1])
         {
           /* Two children. Push one onto the stack. */
-          DictEntryStack *des2 = malloc (sizeof *des2);
+          DictEntryStack *des2 = mem_alloc (d, sizeof *des2);
           des2->node = des->node->children[1];
           des2->up = des->up;
           des->up = des2;
         }
-      des->node = des->node->children[0];
-      des->entry = des->node->entry;
-      return (DictEntry *)des;
+      des->node = des->node->children[0];
+      des->entry = des->node->entry;
+      return (DictEntry *)des;
+    }
+  else if (des->node->children[1])
+    {
+      des->node = des->node->children[1];
+      des->entry = des->node->entry;
+      return (DictEntry *)des;
+    }
+  else if (des->up)
+    {
+      DictEntryStack *old = des;
+      des = des->up;
+      mem_free (d, old);
+      /* Prepare entry */
+      des->entry = des->node->entry;
+      return (DictEntry *)des;
+    }
+  else
+    {
+      /* Stack empty. Next bucket. */
+      int i;
+      for (i = hash_to_index (d, des->node->hash) + 1;
+           i < (1u << d->l2_n_slots);
+           i++)
+        {
+          if (d->slots[i])
+            {
+              des->node = d->slots[i];
+              des->entry = des->node->entry;
+              return (DictEntry *)des;
+            }
+        }
+      /* Didn't find any more */
+      mem_free (d, des);
+      d->n_iterators--;
+      return NULL;
+    }
+}
+
+void dict_end (Dict *d, DictEntry *de)
+{
+  /* Cancel iteration over a dictionary. Just free up the
+     DictEntryStack. */
+  DictEntryStack *des, *old;
+  if (de)
+    d->n_iterators--;
+  if (d->radix)
+    {
+      if (de)
+        radix_iter_free (d, (DictRadixIter *)de);
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      mem_free (d, de);
+      return;
+    }
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      DictPageStack *ps = (DictPageStack *)de, *up;
+      for (; ps; ps = up)
+        {
+          up = ps->up;
+          mem_free (d, ps);
+        }
+      return;
+    }
+  des = (DictEntryStack *)de;
+  while (des)
+    {
+      old = des;
+      des = des->up;
+      mem_free (d, old);
+    }
+}
+
+/* The dictionary's own entry for an iterator's current position, whose
+   value may be modified in place. */
+DictEntry *
+dict_iter_entry (Dict *d, DictEntry *de)
+{
+  if (d->radix)
+    {
+      DictRadixIter *it = (DictRadixIter *)de;
+      it->leaf->entry.key = it->key;
+      return &it->leaf->entry;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    return &ordered_entry (d, ((DictOrderedIter *)de)->pos - 1)->entry;
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      DictPageStack *ps = (DictPageStack *)de;
+      return &ps->page->entries[ps->pos - 1];
+    }
+  return &((DictEntryStack *)de)->node->entry;
+}
+
+void
+dict_map (Dict * d, void (*fn) (DictEntry *, void *), void *cl)
+{
+  DictEntry *e;
+  for (e = dict_first (d); e; e = dict_next (d, e))
+    fn (e, cl);
+}
+
+/* Find the DictEntry for a given key. NULL if it does not exist. */
+DictEntry *
+dict_get_entry (Dict *d, const void *k)
+{
+  DictKey key;
+  local_key (d, k, &key);
+  return dict_get_entry_hashed (d, &key);
+}
+
+DictEntry *
+dict_get_entry_hashed (Dict *d, const DictKey *key)
+{
+  const void *k = key->key;
+  unsigned hash = key->hash;
+  int depth;
+  DictNode **np;
+  DictEntry *res = NULL;
+  CHECK_KEY (d, key);
+  if (d->radix)
+    {
+      RadixLeaf *l = radix_search (d, k);
+      if (!l)
+        return NULL;
+      l->entry.key = k;
+      return &l->entry;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    {
+      DictOrderedEntry *e = ordered_search (d, k, hash, NULL);
+      return e ? &e->entry : NULL;
+    }
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      /* Rehashing moves entries between pages. */
+      unsigned l2_n_slots = d->l2_n_slots;
+      res = page_search (d, k, hash, &depth);
+      CHECK_REHASH (d, depth);
+      if (d->l2_n_slots != l2_n_slots)
+        res = page_search (d, k, hash, &depth);
+      return res;
+    }
+  /* The caller may modify the value, so in a versioned dictionary the
+     entry must belong to the writer. */
+  if (d->versions && dict_has_key_hashed (d, key))
+    np = cow_search (d, k, hash, &depth);
+  else
+    np = search (d, k, hash, &depth);
+  if (*np)
+    res = &((*np)->entry);
+  else
+    res = NULL;
+  CACHE_ACCESS (d, *np);
+  CHECK_REHASH (d, depth);
+  return res;
+}
+
+/* Find the DictEntry for a key, adding one with a NULL value if there
+   is none, with a single search. */
+DictEntry *
+dict_find_or_add (Dict *d, const void *k, bool *added)
+{
+  DictKey key;
+  local_key (d, k, &key);
+  return dict_find_or_add_hashed (d, &key, added);
+}
+
+DictEntry *
+dict_find_or_add_hashed (Dict *d, const DictKey *key, bool *added)
+{
+  const void *k = key->key;
+  unsigned hash = key->hash;
+  int depth;
+  DictNode **np, *n;
+  CHECK_KEY (d, key);
+  if (d->radix)
+    {
+      RadixLeaf *l = radix_add (d, k, added);
+      l->entry.key = k;
+      return &l->entry;
+    }
+  if (d->buckets == DICT_BUCKETS_ORDERED)
+    return &ordered_add (d, key, added)->entry;
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      unsigned l2_n_slots = d->l2_n_slots;
+      DictEntry *e = page_add (d, &PAGE_SLOTS (d)[hash_to_index (d, hash)],
+                               k, hash, &depth, added);
+      if (*added)
+        {
+          page_own_key (d, e, k);
+          e->value = NULL;
+        }
+      CHECK_REHASH (d, depth);
+      if (d->l2_n_slots != l2_n_slots)
+        e = page_search (d, k, hash, &depth);
+      return e;
+    }
+  if (d->versions)
+    np = cow_search (d, k, hash, &depth);
+  else
+    np = search (d, k, hash, &depth);
+  *added = !*np;
+  if (*added)
+    {
+      *np = new_node (d, key, NULL);
+      d->n_entries++;
+      if (d->cache)
+        {
+          /* Evicting a neighbour may move the new entry into its
+             node. */
+          cache_trim (d, key);
+          np = search (d, k, hash, &depth);
+        }
+    }
+  else
+    CACHE_ACCESS (d, *np);
+  /* Rehashing moves nodes but not their contents. */
+  n = *np;
+  CHECK_REHASH (d, depth);
+  return &n->entry;
+}
+
+
+/* ------------------------------------------------------------
+ * Sorted iteration.
+ *
+ * The index is an array of items, each holding an entry and its key.
+ * Items for string keys also hold the 8 bytes of the key from the
+ * depth to which their range has been sorted, packed big-endian so
+ * that comparing them as integers compares the strings. They are
+ * sorted by a multikey quicksort on those words, the items whose words
+ * are equal being sorted on the next 8 bytes, so most of the work is
+ * done within the array, without following the key pointers. Other
+ * keys are sorted by a three-way quicksort using their comparison
+ * function.
+ *
+ * Sorting is lazy. The unsorted part of the index is a stack of
+ * ranges, leftmost on top, each of whose keys come before all of the
+ * next one's. Entries are handed out once the ranges in front of them
+ * have been partitioned down to a few items and insertion sorted, so
+ * that the first K entries cost a pass over the index and little more
+ * than sorting K of them.
+ */
+
+#define SORTED_SMALL 16
+
+typedef struct DictSortedItem DictSortedItem;
+struct DictSortedItem
+{
+  uint64_t word;                /* String keys: 8 bytes from the depth */
+  const void *key;
+  DictEntry *entry;
+};
+
+typedef struct DictSortedRange DictSortedRange;
+struct DictSortedRange
+{
+  unsigned lo, hi;
+  unsigned depth;               /* String keys: bytes known to be equal */
+  bool reload;                  /* The words are for the last depth */
+};
+
+struct DictSorted
+{
+  Dict *d;
+  unsigned n_changes;           /* The dictionary's, when indexed */
+  bool strings;
+  DictSortedItem *items;
+  unsigned n_items;
+  unsigned n_sorted;            /* Items in their final places */
+  DictSortedRange *ranges;      /* Still to sort, the leftmost last */
+  unsigned n_ranges, ranges_size;
+};
+
+/* Whether a string key ends within a word */
+#define WORD_ENDS(w) (((w) & 0xff) == 0)
+
+static uint64_t
+sorted_word (const char *k)
+{
+  uint64_t w = 0;
+  int i;
+  for (i = 0; i < 8 && k[i]; i++)
+    w |= (uint64_t)(unsigned char)k[i] << (56 - 8 * i);
+  return w;
+}
+
+static void
+sorted_push (DictSorted *s, unsigned lo, unsigned hi, unsigned depth,
+             bool reload)
+{
+  DictSortedRange *r;
+  if (lo == hi)
+    return;
+  if (s->n_ranges == s->ranges_size)
+    {
+      DictSortedRange *old = s->ranges;
+      s->ranges_size = s->ranges_size ? 2 * s->ranges_size : 64;
+      s->ranges = mem_alloc (s->d, s->ranges_size * sizeof *s->ranges);
+      if (old)
+        {
+          memcpy (s->ranges, old, s->n_ranges * sizeof *s->ranges);
+          mem_free (s->d, old);
+        }
+    }
+  r = &s->ranges[s->n_ranges++];
+  r->lo = lo;
+  r->hi = hi;
+  r->depth = depth;
+  r->reload = reload;
+}
+
+static int
+sorted_cmp (DictSorted *s, const DictSortedItem *a, const DictSortedItem *b,
+            unsigned depth)
+{
+  if (!s->strings)
+    return key_cmp (s->d->keyfuncs, a->key, b->key);
+  if (a->word != b->word)
+    return a->word < b->word ? -1 : 1;
+  if (WORD_ENDS (a->word))
+    return 0;
+  return strcmp ((const char *)a->key + depth + 8,
+                 (const char *)b->key + depth + 8);
+}
+
+static inline void
+sorted_swap (DictSortedItem *a, DictSortedItem *b)
+{
+  DictSortedItem t = *a;
+  *a = *b;
+  *b = t;
+}
+
+static void
+sorted_insertion_sort (DictSorted *s, DictSortedRange *r)
+{
+  DictSortedItem *items = s->items;
+  unsigned i, j;
+  for (i = r->lo + 1; i < r->hi; i++)
+    {
+      DictSortedItem t = items[i];
+      for (j = i; j > r->lo && sorted_cmp (s, &t, &items[j - 1],
+                                           r->depth) < 0; j--)
+        items[j] = items[j - 1];
+      items[j] = t;
+    }
+}
+
+/* The median of the first, middle and last items */
+static DictSortedItem *
+sorted_pivot (DictSorted *s, DictSortedRange *r)
+{
+  DictSortedItem *a = &s->items[r->lo];
+  DictSortedItem *b = &s->items[r->lo + (r->hi - r->lo) / 2];
+  DictSortedItem *c = &s->items[r->hi - 1];
+  if (sorted_cmp (s, a, b, r->depth) < 0)
+    {
+      if (sorted_cmp (s, b, c, r->depth) < 0)
+        return b;
+      return sorted_cmp (s, a, c, r->depth) < 0 ? c : a;
+    }
+  if (sorted_cmp (s, a, c, r->depth) < 0)
+    return a;
+  return sorted_cmp (s, b, c, r->depth) < 0 ? c : b;
+}
+
+/* Split a range into the keys before, equal to (on their words, for
+   strings) and after a pivot, leaving the first on top of the stack. */
+static void
+sorted_partition (DictSorted *s, DictSortedRange *r)
+{
+  DictSortedItem *items = s->items;
+  DictSortedItem pivot = *sorted_pivot (s, r);
+  unsigned lt = r->lo, i = r->lo, gt = r->hi;
+  if (s->strings)
+    while (i < gt)
+      {
+        if (items[i].word < pivot.word)
+          sorted_swap (&items[lt++], &items[i++]);
+        else if (items[i].word > pivot.word)
+          sorted_swap (&items[i], &items[--gt]);
+        else
+          i++;
+      }
+  else
+    while (i < gt)
+      {
+        int c = key_cmp (s->d->keyfuncs, items[i].key, pivot.key);
+        if (c < 0)
+          sorted_swap (&items[lt++], &items[i++]);
+        else if (c > 0)
+          sorted_swap (&items[i], &items[--gt]);
+        else
+          i++;
+      }
+  sorted_push (s, gt, r->hi, r->depth, false);
+  if (s->strings && !WORD_ENDS (pivot.word))
+    sorted_push (s, lt, gt, r->depth + 8, true);
+  else
+    {
+      /* Keys are unique, so this is the pivot alone. */
+      assert (gt - lt == 1);
+      sorted_push (s, lt, gt, r->depth, false);
+    }
+  sorted_push (s, r->lo, lt, r->depth, false);
+}
+
+/* Sort until at least the first N items are in their places. */
+static void
+sorted_refine (DictSorted *s, unsigned n)
+{
+  while (s->n_sorted < n && s->n_ranges)
+    {
+      DictSortedRange r = s->ranges[--s->n_ranges];
+      if (r.reload)
+        {
+          unsigned i;
+          for (i = r.lo; i < r.hi; i++)
+            s->items[i].word = sorted_word ((const char *)s->items[i].key
+                                            + r.depth);
+        }
+      if (r.hi - r.lo <= SORTED_SMALL)
+        {
+          sorted_insertion_sort (s, &r);
+          s->n_sorted = r.hi;
+        }
+      else
+        sorted_partition (s, &r);
     }
-  else if (des->node->children[1])
+}
+
+/* (Re)build the index, unsorted. */
+static void
+sorted_index (DictSorted *s)
+{
+  Dict *d = s->d;
+  DictEntry *e;
+  unsigned n = 0;
+  if (s->items)
+    mem_free (d, s->items);
+  s->items = mem_alloc (d, (d->n_entries ? d->n_entries : 1)
+                        * sizeof *s->items);
+  for (e = dict_first (d); e; e = dict_next (d, e))
     {
-      des->node = des->node->children[1];
-      des->entry = des->node->entry;
-      return (DictEntry *)des;
+      DictSortedItem *item = &s->items[n++];
+      item->entry = dict_iter_entry (d, e);
+      item->key = item->entry->key;
     }
-  else if (des->up)
+  s->n_items = n;
+  s->n_sorted = 0;
+  s->n_ranges = 0;
+  sorted_push (s, 0, n, 0, s->strings);
+  s->n_changes = d->n_changes;
+}
+
+DictSorted *
+dict_sorted_iter (Dict *d)
+{
+  DictSorted *s;
+  /* Radix trees iterate in order already. */
+  assert (!d->radix);
+  s = mem_zalloc (d, sizeof *s);
+  s->d = d;
+  s->strings = (!d->keyfuncs->key_width
+                && d->keyfuncs->cmp_fn == (DictKeyCmpFn) strcmp);
+  sorted_index (s);
+  return s;
+}
+
+void
+dict_sorted_free (DictSorted *s)
+{
+  Dict *d = s->d;
+  mem_free (d, s->items);
+  if (s->ranges)
+    mem_free (d, s->ranges);
+  mem_free (d, s);
+}
+
+bool
+dict_sorted_valid (DictSorted *s)
+{
+  return s->n_changes == s->d->n_changes;
+}
+
+void
+dict_sorted_refresh (DictSorted *s)
+{
+  if (!dict_sorted_valid (s))
+    sorted_index (s);
+}
+
+unsigned int
+dict_sorted_n_entries (DictSorted *s)
+{
+  return s->n_items;
+}
+
+DictEntry *
+dict_sorted_entry (DictSorted *s, unsigned int i)
+{
+  assert (dict_sorted_valid (s));
+  if (i >= s->n_items)
+    return NULL;
+  sorted_refine (s, i + 1);
+  return s->items[i].entry;
+}
+
+unsigned int
+dict_sorted_seek (DictSorted *s, const void *key)
+{
+  unsigned lo = 0, hi = s->n_items;
+  assert (dict_sorted_valid (s));
+  sorted_refine (s, s->n_items);
+  while (lo < hi)
     {
-      DictEntryStack *old = des;
-      des = des->up;
-      free (old);
-      /* Prepare entry */
-      des->entry = des->node->entry;
-      return (DictEntry *)des;
+      unsigned mid = lo + (hi - lo) / 2;
+      if (key_cmp (s->d->keyfuncs, s->items[mid].key, key) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+unsigned int
+dict_sorted_prefix (DictSorted *s, const char *prefix, unsigned int *end)
+{
+  size_t len = strlen (prefix);
+  unsigned start, lo, hi = s->n_items;
+  assert (s->strings);
+  start = lo = dict_sorted_seek (s, prefix);
+  while (lo < hi)
+    {
+      unsigned mid = lo + (hi - lo) / 2;
+      if (strncmp (s->items[mid].key, prefix, len) == 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  *end = lo;
+  return start;
+}
+
+
+
+
+/* ------------------------------------------------------------
+ * Set operations.
+ *
+ * One dictionary is walked bucket by bucket in slot order, and each
+ * entry's key looked up in the other with the stored hash, if their
+ * key functions hash alike. As slots are given by the top bits of the
+ * hash, the other's buckets are then visited in slot order too. A
+ * part of the work covers a range of hashes, and so a range of slots
+ * in each dictionary whatever their sizes. Neither dictionary is
+ * changed: the lookups don't rebalance, promote or rehash.
+ */
+
+typedef struct DictSetWalk DictSetWalk;
+struct DictSetWalk
+{
+  Dict *other;
+  bool same_hash;               /* OTHER hashes keys as the walked one */
+  bool walking_b;
+  bool matched;                 /* Visit those found in OTHER, or not */
+  unsigned lo, hi;              /* Range of hashes, inclusive */
+  /* Called with A's hash of the key */
+  void (*visit) (DictSetWalk *w, DictEntry *a, DictEntry *b, unsigned hash);
+  DictPairFn fn;
+  void *cl;
+};
+
+/* Look K up without changing D. */
+static DictEntry *
+peek (Dict *d, const void *k, unsigned hash)
+{
+  DictNode *n;
+  if (d->ordered)
+    {
+      DictOrderedEntry *e = ordered_search (d, k, hash, NULL);
+      return e ? &e->entry : NULL;
+    }
+  if (d->buckets == DICT_BUCKETS_PAGES)
+    {
+      int depth;
+      return page_search (d, k, hash, &depth);
+    }
+  n = d->slots[hash_to_index (d, hash)];
+  if (d->buckets == DICT_BUCKETS_LIST)
+    {
+      for (; n; n = n->children[0])
+        if (n->hash == hash && key_cmp (d->keyfuncs, k, n->entry.key) == 0)
+          return &n->entry;
+      return NULL;
+    }
+  while (n)
+    {
+      int cmp;
+      if (n->hash == hash)
+        {
+          cmp = key_cmp (d->keyfuncs, k, n->entry.key);
+          if (cmp == 0)
+            return &n->entry;
+        }
+      else
+        cmp = (hash < n->hash) ? -1 : 1;
+      n = n->children[cmp > 0];
     }
+  return NULL;
+}
+
+static void
+set_walk_entry (DictSetWalk *w, DictEntry *e, unsigned hash)
+{
+  unsigned other_hash = hash;
+  DictEntry *found;
+  if (hash < w->lo || hash > w->hi)
+    return;
+  if (!w->same_hash)
+    other_hash = key_hash (w->other->keyfuncs, e->key);
+  found = peek (w->other, e->key, other_hash);
+  if ((found != NULL) != w->matched)
+    return;
+  if (w->walking_b)
+    w->visit (w, found, e, other_hash);
   else
+    w->visit (w, e, found, hash);
+}
+
+/* Recurses only to the right, as dict_free_nodes(). */
+static void
+set_walk_nodes (DictSetWalk *w, DictNode *n)
+{
+  for (; n; n = n->children[0])
     {
-      /* Stack empty. Next bucket. */
-      int i;
-      for (i = hash_to_index (d, des->node->hash) + 1;
-           i < (1u << d->l2_n_slots);
-           i++)
+      if (n->children[1])
+        set_walk_nodes (w, n->children[1]);
+      set_walk_entry (w, &n->entry, n->hash);
+    }
+}
+
+static void
+set_walk_pages (DictSetWalk *w, DictPage *p)
+{
+  int i;
+  for (i = 0; i <= p->n; i++)
+    {
+      if (p->children[i])
+        set_walk_pages (w, p->children[i]);
+      if (i < p->n)
+        set_walk_entry (w, &p->entries[i], p->hashes[i]);
+    }
+}
+
+static void
+set_walk (Dict *d, DictSetWalk *w)
+{
+  unsigned i;
+  if (d->ordered)
+    {
+      for (i = 0; i < d->ordered->n_used; i++)
         {
-          if (d->slots[i])
-            {
-              des->node = d->slots[i];
-              des->entry = des->node->entry;
-              return (DictEntry *)des;
-            }
+          DictOrderedEntry *e = ordered_entry (d, i);
+          if (!e->deleted)
+            set_walk_entry (w, &e->entry, e->hash);
         }
-      /* Didn't find any more */
-      free (des);
-      return NULL;
+      return;
     }
+  for (i = slot_index (w->lo, d->l2_n_slots);
+       i <= slot_index (w->hi, d->l2_n_slots); i++)
+    if (!d->slots[i])
+      continue;
+    else if (d->buckets == DICT_BUCKETS_PAGES)
+      set_walk_pages (w, PAGE_SLOTS (d)[i]);
+    else
+      set_walk_nodes (w, d->slots[i]);
 }
 
-void dict_end (Dict *d, DictEntry *de)
+/* Walk one of A and B, visiting the entries that are (if MATCHED) or
+   aren't in the other. */
+static void
+set_walk_side (DictSetWalk *w, Dict *a, Dict *b, bool walking_b,
+               bool matched)
 {
-  /* Cancel iteration over a dictionary. Just free up the
-     DictEntryStack. */
-  DictEntryStack *des, *old;
-  des = (DictEntryStack *)de;
-  while (des)
+  w->walking_b = walking_b;
+  w->matched = matched;
+  w->other = walking_b ? a : b;
+  set_walk (walking_b ? b : a, w);
+}
+
+static void
+set_walk_init (DictSetWalk *w, Dict *a, Dict *b, unsigned part,
+               unsigned n_parts)
+{
+  /* Radix trees keep no hashes. */
+  assert (!a->radix && !b->radix);
+  assert (part < n_parts);
+  w->same_hash = (a->keyfuncs->hash_fn == b->keyfuncs->hash_fn
+                  && a->keyfuncs->key_width == b->keyfuncs->key_width);
+  w->lo = ((uint64_t)part << 32) / n_parts;
+  w->hi = (((uint64_t)(part + 1) << 32) / n_parts) - 1;
+}
+
+static void
+set_map_visit (DictSetWalk *w, DictEntry *a, DictEntry *b, unsigned hash)
+{
+  w->fn (a, b, w->cl);
+}
+
+static void
+set_op_walk (DictSetWalk *w, Dict *a, Dict *b, DictSetOp op)
+{
+  switch (op)
     {
-      old = des;
-      des = des->up;
-      free (old);
+    case DICT_INTERSECT:
+      /* Walk the smaller one. */
+      set_walk_side (w, a, b, b->n_entries < a->n_entries, true);
+      break;
+    case DICT_UNION:
+      set_walk_side (w, a, b, false, true);
+      set_walk_side (w, a, b, false, false);
+      set_walk_side (w, a, b, true, false);
+      break;
+    case DICT_DIFFERENCE:
+      set_walk_side (w, a, b, false, false);
+      break;
     }
 }
 
 void
-dict_map (Dict * d, void (*fn) (DictEntry *, void *), void *cl)
+dict_set_op_map_part (Dict *a, Dict *b, DictSetOp op, unsigned int part,
+                      unsigned int n_parts, DictPairFn fn, void *cl)
 {
-  DictEntry *e;
-  for (e = dict_first (d); e; e = dict_next (d, e))
-    fn (e, cl);
+  DictSetWalk w;
+  set_walk_init (&w, a, b, part, n_parts);
+  w.visit = set_map_visit;
+  w.fn = fn;
+  w.cl = cl;
+  set_op_walk (&w, a, b, op);
 }
 
-/* Find the DictEntry for a given key. NULL if it does not exist. */
-DictEntry *
-dict_get_entry (Dict *d, const void *k)
+void
+dict_set_op_map (Dict *a, Dict *b, DictSetOp op, DictPairFn fn, void *cl)
 {
-  unsigned hash = d->keyfuncs->hash_fn (k);
-  int depth;
-  DictNode **np = search (d, k, hash, &depth);
-  DictEntry *res = NULL;
-  if (*np)
-    res = &((*np)->entry);
+  /* Like iterators, let FN look things up. */
+  a->n_iterators++;
+  b->n_iterators++;
+  dict_set_op_map_part (a, b, op, 0, 1, fn, cl);
+  a->n_iterators--;
+  b->n_iterators--;
+}
+
+/* Add A's entry, or else B's, to the result in CL. */
+static void
+set_result_visit (DictSetWalk *w, DictEntry *a, DictEntry *b, unsigned hash)
+{
+  Dict *d = w->cl;
+  DictEntry *e = a ? a : b;
+  DictKey key;
+  key.key = e->key;
+  key.len = d->keyfuncs->key_width;
+  key.hash = hash;
+  key.hash_fn = d->keyfuncs->hash_fn;
+  dict_insert_hashed (d, &key, e->value);
+}
+
+/* The result is like A, and has its values where both have the key.
+   It is not a cache, even if A is: evicting would hand values that A
+   and B still hold to the evict function. */
+static Dict *
+set_result (Dict *a, Dict *b, DictSetOp op)
+{
+  DictSetWalk w;
+  Dict *c;
+  set_walk_init (&w, a, b, 0, 1);
+  w.visit = set_result_visit;
+  c = op == DICT_UNION && !a->versions ? dict_clone (a) : new_like (a);
+  mem_free (c, c->cache);
+  c->cache = NULL;
+  w.cl = c;
+  if (op == DICT_UNION && !a->versions)
+    set_walk_side (&w, a, b, true, false);
   else
-    res = NULL;
-  CHECK_REHASH (d, depth);
-  return res;
+    set_op_walk (&w, a, b, op);
+  return c;
+}
+
+Dict *
+dict_intersect (Dict *a, Dict *b)
+{
+  return set_result (a, b, DICT_INTERSECT);
+}
+
+Dict *
+dict_union (Dict *a, Dict *b)
+{
+  return set_result (a, b, DICT_UNION);
+}
+
+Dict *
+dict_difference (Dict *a, Dict *b)
+{
+  return set_result (a, b, DICT_DIFFERENCE);
+}
+
+
+/* ------------------------------------------------------------
+ * Scanning.
+ *
+ * Entries are visited in order of hash: slot by slot, as slots are
+ * given by the top bits of the hash, and within each bucket by
+ * sorting what it holds. The cursor is the next hash to visit, so it
+ * doesn't depend on the size of the table or the shape of its
+ * buckets.
+ */
+
+typedef struct DictScanItem DictScanItem;
+struct DictScanItem
+{
+  DictEntry *entry;
+  unsigned hash;
+};
+
+/* The entries of one bucket with hashes from LO on */
+typedef struct DictScan DictScan;
+struct DictScan
+{
+  Dict *d;
+  unsigned lo;
+  unsigned n_items, size;
+  DictScanItem *items;
+  DictScanItem local[32];
+};
+
+static void
+scan_add (DictScan *s, DictEntry *e, unsigned hash)
+{
+  if (hash < s->lo)
+    return;
+  if (s->n_items == s->size)
+    {
+      DictScanItem *grown = mem_alloc (s->d, 2 * s->size * sizeof *grown);
+      memcpy (grown, s->items, s->size * sizeof *grown);
+      if (s->items != s->local)
+        mem_free (s->d, s->items);
+      s->items = grown;
+      s->size *= 2;
+    }
+  s->items[s->n_items].entry = e;
+  s->items[s->n_items++].hash = hash;
+}
+
+/* Left subtrees hold no greater hashes, so are skipped below LO. */
+static void
+scan_nodes (DictScan *s, DictNode *n)
+{
+  for (; n; n = n->children[0])
+    {
+      if (n->children[1])
+        scan_nodes (s, n->children[1]);
+      scan_add (s, &n->entry, n->hash);
+      if (n->hash < s->lo)
+        break;
+    }
+}
+
+static void
+scan_pages (DictScan *s, DictPage *p)
+{
+  int i;
+  for (i = 0; i <= p->n; i++)
+    {
+      if (p->children[i] && (i == p->n || p->hashes[i] >= s->lo))
+        scan_pages (s, p->children[i]);
+      if (i < p->n)
+        scan_add (s, &p->entries[i], p->hashes[i]);
+    }
+}
+
+/* Gather the entries of slot I, in order of hash. */
+static void
+scan_slot (DictScan *s, unsigned i)
+{
+  Dict *d = s->d;
+  unsigned j;
+  s->n_items = 0;
+  if (d->ordered)
+    {
+      /* The probe from slot I passes every entry whose home it is. */
+      unsigned *slots = ORDERED_SLOTS (d);
+      unsigned mask = (1u << d->l2_n_slots) - 1;
+      for (j = i; slots[j]; j = (j + 1) & mask)
+        {
+          DictOrderedEntry *e = ordered_entry (d, slots[j] - 1);
+          if (!e->deleted && hash_to_index (d, e->hash) == i)
+            scan_add (s, &e->entry, e->hash);
+        }
+    }
+  else if (!d->slots[i])
+    return;
+  else if (d->buckets == DICT_BUCKETS_PAGES)
+    scan_pages (s, PAGE_SLOTS (d)[i]);
+  else if (d->buckets == DICT_BUCKETS_LIST)
+    {
+      DictNode *n;
+      for (n = d->slots[i]; n; n = n->children[0])
+        scan_add (s, &n->entry, n->hash);
+    }
+  else
+    scan_nodes (s, d->slots[i]);
+  /* Buckets are small, and trees and pages nearly sorted already. */
+  for (j = 1; j < s->n_items; j++)
+    {
+      DictScanItem item = s->items[j];
+      unsigned k = j;
+      for (; k > 0 && s->items[k - 1].hash > item.hash; k--)
+        s->items[k] = s->items[k - 1];
+      s->items[k] = item;
+    }
+}
+
+unsigned int
+dict_scan (Dict *d, unsigned int cursor, unsigned int max_entries,
+           void (*fn) (DictEntry *de, void *cl), void *cl)
+{
+  DictScan s;
+  unsigned slot, n_visited = 0, n_empty = 0, i;
+  /* Radix trees keep no hashes. */
+  assert (!d->radix);
+  s.d = d;
+  s.items = s.local;
+  s.size = sizeof s.local / sizeof *s.local;
+  /* Hold the buckets still for FN. */
+  d->n_iterators++;
+  for (slot = hash_to_index (d, cursor);;)
+    {
+      s.lo = cursor;
+      scan_slot (&s, slot);
+      for (i = 0; i < s.n_items; i++)
+        {
+          /* Entries with the same hash go together. */
+          if (n_visited >= max_entries && i > 0
+              && s.items[i].hash != s.items[i - 1].hash)
+            {
+              cursor = s.items[i].hash;
+              goto done;
+            }
+          fn (s.items[i].entry, cl);
+          n_visited++;
+        }
+      if (!s.n_items)
+        n_empty++;
+      if (++slot >> d->l2_n_slots)
+        {
+          cursor = 0;
+          break;
+        }
+      cursor = slot << (sizeof (unsigned) * CHAR_BIT - d->l2_n_slots);
+      /* Empty slots count for something too. */
+      if (n_visited >= max_entries || n_empty / 8 >= max_entries)
+        break;
+    }
+ done:
+  d->n_iterators--;
+  if (s.items != s.local)
+    mem_free (d, s.items);
+  return cursor;
 }
 
 
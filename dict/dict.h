@@ -8,6 +8,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct Dict Dict;
 
 /* Key manipulation functions for use by dictionary type. */
@@ -23,6 +27,11 @@ struct DictKeyFuncs
   DictKeyHashFn hash_fn;
   DictKeyDupFn dup_fn;
   DictKeyFreeFn free_fn;
+  /* If non-zero, keys are blocks of KEY_WIDTH bytes, copied into the
+     dictionary's own nodes and compared by a built-in function
+     instead of CMP_FN. They are hashed by a built-in function too,
+     unless HASH_FN is given. The other functions may be NULL. */
+  size_t key_width;
 };
 
 /* Key functions to use strings. This is the default if NULL is
@@ -36,6 +45,20 @@ extern DictKeyFuncs ptrkeyfuncs;
    keys. */
 extern DictKeyFuncs staticstrkeyfuncs;
 
+/* Key functions to use fixed-size binary keys of 8, 16 or 32 bytes
+   (eg. 64-bit integers, UUIDs, SHA-256 digests). For other widths,
+   set key_width in a DictKeyFuncs of your own. */
+extern DictKeyFuncs fixed8keyfuncs;
+extern DictKeyFuncs fixed16keyfuncs;
+extern DictKeyFuncs fixed32keyfuncs;
+
+/* A 64-bit hash of string S, a different one for each SEED. Unlike
+   strkeyfuncs' hash, which is made for speed, it spreads similar
+   strings well enough for sketches (eg. HyperLogLog) counting on
+   distinct keys having distinct hashes. */
+extern unsigned long long dict_strhash_seeded (const char *s,
+                                               unsigned long long seed);
+
 
 /* ------------------------------------------------------------
  * Dictionary methods
@@ -45,6 +68,40 @@ extern DictKeyFuncs staticstrkeyfuncs;
    assume keys are strings. */
 extern Dict *dict_new (DictKeyFuncs *);
 
+/* Create new dictionary whose memory all comes from ALLOC_FN. If
+   DEALLOC_FN is NULL, blocks are never freed individually (eg. they
+   come from an arena that is released in one go) and dict_free() need
+   not visit every entry. Keys are still copied and freed by the key
+   functions. */
+typedef void *(*DictAllocFn) (void *alloc_ctx, size_t size);
+typedef void (*DictDeallocFn) (void *alloc_ctx, void *block);
+extern Dict *dict_new_with_allocator (DictKeyFuncs *, void *alloc_ctx,
+                                      DictAllocFn, DictDeallocFn);
+
+/* Create new dictionary with a choice of bucket structure. This
+   affects performance only, except that ordered buckets are iterated
+   over in the order that entries were added, and move their entries
+   when the array grows or is compacted: an entry from
+   dict_get_entry() or dict_find_or_add() only lasts until the next
+   insertion or deletion. */
+typedef enum DictBuckets
+{
+  DICT_BUCKETS_TREE,            /* Statistically balanced binary trees */
+  DICT_BUCKETS_PAGES,           /* B-trees of cache-line-sized pages */
+  DICT_BUCKETS_LIST,            /* Chained lists, last found first */
+  DICT_BUCKETS_ADAPTIVE,        /* Trees that move found keys upwards */
+  DICT_BUCKETS_ORDERED          /* Entries in an array, in order added */
+} DictBuckets;
+extern Dict *dict_new_with_buckets (DictKeyFuncs *, DictBuckets);
+
+/* Create new dictionary for tables of hundreds of megabytes or more,
+   whose slot array and nodes are allocated from 2 MB-aligned regions
+   that the kernel is advised to back with transparent huge pages, so
+   that lookups take fewer TLB misses. Without huge pages the regions
+   are ordinary memory. Each dictionary maps at least a few megabytes,
+   released by dict_free(). */
+extern Dict *dict_new_hugepages (DictKeyFuncs *, DictBuckets);
+
 /* Get element of the dictionary */
 extern void *dict_get (Dict *, const void *);
 
@@ -64,11 +121,42 @@ extern void dict_delete (Dict *, const void *);
 /* Free the entire dictionary. */
 extern void dict_free (Dict *);
 
+/* A copy of the dictionary, of the same kind and with the same
+   allocator, built without rehashing or searching. Keys are copied
+   as they would be on insertion, or shared if the key functions don't
+   copy them (eg. staticstrkeyfuncs). Not for versioned dictionaries. */
+extern Dict *dict_clone (Dict *);
+
+/* Copy the nodes of each bucket next to each other, in the order that
+   searches visit them, to restore locality lost to many changes.
+   Every entry moves, so DictEntry pointers previously returned become
+   invalid, as do keys copied by strkeyfuncs or into a string arena,
+   which move alongside.
+   Ordered buckets are compacted; paged buckets and radix trees are
+   left as they are. Not for versioned dictionaries, or while
+   iterating. */
+extern void dict_defragment (Dict *);
+
 /* Number of entries in the dictionary */
 extern unsigned int dict_n_entries (Dict *);
 
 /* Amount of memory allocated to dictionary */
-extern unsigned int dict_allocated_bytes (Dict *);
+extern size_t dict_allocated_bytes (Dict *);
+
+/* Statistics. The cache counters are only maintained by cache
+   dictionaries. */
+typedef struct DictStats DictStats;
+struct DictStats
+{
+  unsigned int n_entries;
+  unsigned int n_slots;
+  size_t allocated_bytes;
+  unsigned int dead_key_bytes;  /* String arena: awaiting compaction */
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+};
+extern void dict_get_stats (Dict *, DictStats *);
 
 /* Insert multiple entries. For use primarily as a constructor. */
 extern void dict_insert_entries (Dict *, /* const void *, void *, */ ...);
@@ -91,6 +179,15 @@ extern void dict_set_entries (Dict *, /* const void *, void *, */ ...);
  *     break;
  *   }
  * }
+ * Lookups may be made while iterating. Until the iteration finishes
+ * (or dict_end() is called) they leave the table and its buckets as
+ * they are, instead of rebalancing, promoting or rehashing.
+ *
+ * NOTE: an iteration left without reaching the end or calling
+ * dict_end() counts as active for good: the dictionary will never
+ * rehash or rebalance again, and lookups slow down as it grows.
+ * Always call dict_end() when breaking out of a loop (or returning
+ * from one) early.
  */
 typedef struct DictEntry DictEntry;
 struct DictEntry
@@ -103,9 +200,20 @@ extern DictEntry *dict_first (Dict * d);
 extern DictEntry *dict_next (Dict * d, DictEntry * de);
 extern void dict_end (Dict *d, DictEntry *de);
 
+/* The dictionary's own entry at an iterator's position (the iterator
+   holds a copy), so that its value may be modified in place. */
+extern DictEntry *dict_iter_entry (Dict *d, DictEntry *de);
+
 extern void dict_map (Dict * d, void (*fn) (DictEntry * de, void *cl),
 		      void *cl);
 
+/* Delete every entry for which PRED returns true, in a single pass
+   over the dictionary. Returns the number of entries deleted. PRED
+   may change entries' values but not the dictionary. */
+extern unsigned int dict_delete_if (Dict *d,
+                                    bool (*pred) (DictEntry *de, void *cl),
+                                    void *cl);
+
 /* Find the DictEntry for a given key. NULL if it does not exist.
  * This allows you to:
  *   - Determine if a key exists at the same time as looking up the value
@@ -114,6 +222,248 @@ extern void dict_map (Dict * d, void (*fn) (DictEntry * de, void *cl),
  */
 extern DictEntry *dict_get_entry (Dict *d, const void *key);
 
+/* Find the DictEntry for a given key, adding one with a NULL value
+ * (and setting *ADDED) if it does not exist, with a single search.
+ * The entry is only valid until the dictionary is next used.
+ */
+extern DictEntry *dict_find_or_add (Dict *d, const void *key, bool *added);
+
+
+/* ------------------------------------------------------------
+ * Sorted iteration.
+ * dict_sorted_iter() indexes a dictionary's entries for visiting in
+ * the order of its cmp_fn. The index is sorted lazily, as entries are
+ * asked for, so reading the first few of a large dictionary costs
+ * little more than a pass over it. Typical use case:
+ * s = dict_sorted_iter (d);
+ * for (i = 0; i < top_k && (de = dict_sorted_entry (s, i)); i++)
+ *   ...;
+ *
+ * The index doesn't hold the dictionary up: it may be kept while the
+ * dictionary is changed, and used again and again as long as it hasn't
+ * been. Adding or deleting entries, or anything else that moves them
+ * (including a lookup that rebalances a bucket or splits a page),
+ * makes it stale, as dict_sorted_valid() tells, until
+ * dict_sorted_refresh() rebuilds it.
+ * Values may be changed in place. Not for radix tree dictionaries,
+ * which iterate in order.
+ */
+typedef struct DictSorted DictSorted;
+
+extern DictSorted *dict_sorted_iter (Dict *d);
+extern void dict_sorted_free (DictSorted *);
+extern bool dict_sorted_valid (DictSorted *);
+extern void dict_sorted_refresh (DictSorted *);
+extern unsigned int dict_sorted_n_entries (DictSorted *);
+
+/* The I'th entry in order, or NULL if there are fewer entries. */
+extern DictEntry *dict_sorted_entry (DictSorted *, unsigned int i);
+
+/* The position of the first entry whose key is not before KEY. This
+   and dict_sorted_prefix() sort the whole index. */
+extern unsigned int dict_sorted_seek (DictSorted *, const void *key);
+
+/* For string keys: the positions of the first entry whose key starts
+   with PREFIX and (in *END) of the first one after those. */
+extern unsigned int dict_sorted_prefix (DictSorted *, const char *prefix,
+                                        unsigned int *end);
+
+
+/* ------------------------------------------------------------
+ * Set operations.
+ * The keys of A and B are matched without rehashing them when both
+ * dictionaries' key functions hash alike, and with the buckets walked
+ * in slot order. Neither dictionary is changed. Not for radix tree
+ * dictionaries.
+ *
+ * dict_intersect(), dict_union() and dict_difference() return a new
+ * dictionary of A's kind (but neither versioned nor a cache), with A's
+ * key functions, holding the keys in both, in either, or in A but not
+ * B. Values are A's, or B's for keys only in B; as with dict_clone(),
+ * they are shared, not copied, and never passed to an evict function.
+ */
+typedef enum
+{
+  DICT_INTERSECT,
+  DICT_UNION,
+  DICT_DIFFERENCE
+} DictSetOp;
+
+extern Dict *dict_intersect (Dict *a, Dict *b);
+extern Dict *dict_union (Dict *a, Dict *b);
+extern Dict *dict_difference (Dict *a, Dict *b);
+
+/* Called with the entries for a key in A and B, either of which is
+   NULL if the key is only in the other. */
+typedef void (*DictPairFn) (DictEntry *a, DictEntry *b, void *cl);
+
+/* Instead of building a result, call FN for each key of the result.
+   FN may look keys up in A and B, and change values, but not add or
+   delete entries. */
+extern void dict_set_op_map (Dict *a, Dict *b, DictSetOp op, DictPairFn fn,
+                             void *cl);
+
+/* Do part PART (from 0) of N_PARTS of dict_set_op_map(). Each part
+   covers a range of hashes, so together they call FN once for each
+   key; as parts only read A and B, they may run in separate threads
+   while nothing changes either dictionary. */
+extern void dict_set_op_map_part (Dict *a, Dict *b, DictSetOp op,
+                                  unsigned int part, unsigned int n_parts,
+                                  DictPairFn fn, void *cl);
+
+
+/* ------------------------------------------------------------
+ * Scanning.
+ * dict_scan() visits a dictionary a few entries at a time, between
+ * which it may be used and changed as usual:
+ *
+ *   cursor = 0;
+ *   do
+ *     cursor = dict_scan (d, cursor, 100, fn, cl);
+ *   while (cursor);
+ *
+ * Each call calls FN for about MAX_ENTRIES entries (more only where
+ * several share a hash), and returns the cursor to pass next time, or
+ * 0 once the scan is over. The cursor is a position in order of hash,
+ * so rehashing doesn't disturb it: every entry present from the start
+ * of the scan to the end is visited once, and no entry is visited
+ * twice. Those added or deleted meanwhile may or may not be. FN may
+ * look keys up and change values, but not add or delete entries. Not
+ * for radix tree dictionaries.
+ */
+extern unsigned int dict_scan (Dict *d, unsigned int cursor,
+                               unsigned int max_entries,
+                               void (*fn) (DictEntry *de, void *cl),
+                               void *cl);
+
+
+/* ------------------------------------------------------------
+ * Key handles.
+ * A handle carries a key together with its hash, so that looking the
+ * same key up in several dictionaries hashes it only once:
+ *
+ *   DictKey key = dict_key (&strkeyfuncs, s);
+ *   for (i = 0; i < n_tenants; i++)
+ *     v[i] = dict_get_hashed (tenant[i], &key);
+ *
+ * A handle may be used with any dictionary whose key functions have
+ * the same hash function as those it was made with (checked by
+ * assertion). It points to the key rather than copying it.
+ *
+ * A handle holds a hash, not a seed: it is not portable between
+ * dictionaries that seed the same hash function differently (say,
+ * from state the function reads), which the assertion can't see.
+ */
+typedef struct DictKey DictKey;
+struct DictKey
+{
+  const void *key;
+  size_t len;                   /* Length of string or fixed-size keys,
+                                   or 0 */
+  unsigned hash;
+  DictKeyHashFn hash_fn;        /* Hash function that made HASH */
+};
+
+extern DictKey dict_key (DictKeyFuncs *, const void *);
+
+/* Make a handle from a hash computed by the caller, which must equal
+   the key functions' hash of the key. */
+extern DictKey dict_key_with_hash (DictKeyFuncs *, const void *, unsigned);
+
+extern void *dict_get_hashed (Dict *, const DictKey *);
+extern bool dict_has_key_hashed (Dict *, const DictKey *);
+extern void dict_set_hashed (Dict *, const DictKey *, void *);
+extern void dict_insert_hashed (Dict *, const DictKey *, void *);
+extern void dict_delete_hashed (Dict *, const DictKey *);
+extern DictEntry *dict_get_entry_hashed (Dict *, const DictKey *);
+extern DictEntry *dict_find_or_add_hashed (Dict *, const DictKey *, bool *);
+
+
+/* ------------------------------------------------------------
+ * Versioned dictionaries.
+ * A single writer updates the dictionary with the usual methods
+ * (dict_set, dict_insert, dict_delete, ...) on a private working
+ * copy, and makes its changes visible with dict_publish(). Any number
+ * of reader threads may concurrently pin the most recently published
+ * version with dict_snapshot_acquire(), look things up in it, and
+ * unpin it with dict_snapshot_release(). Readers never block or
+ * retry; nodes replaced by the writer are reclaimed once no reader
+ * holds a snapshot that can see them.
+ *
+ * Writer:                         Reader:
+ *   dict_set (d, k, v);             s = dict_snapshot_acquire (d);
+ *   dict_delete (d, k2);            v = dict_snapshot_get (s, k);
+ *   dict_publish (d);               dict_snapshot_release (d, s);
+ *
+ * Values are not owned by the dictionary: a value replaced or deleted
+ * by the writer may still be seen by readers of older snapshots.
+ */
+typedef struct DictSnapshot DictSnapshot;
+
+/* Create new versioned dictionary. */
+extern Dict *dict_new_versioned (DictKeyFuncs *);
+
+/* Publish the writer's changes. Returns false if too many old
+   snapshots are still held by readers; the changes are kept and will
+   be published by a later call. */
+extern bool dict_publish (Dict *);
+
+/* Pin / unpin the most recently published version. */
+extern DictSnapshot *dict_snapshot_acquire (Dict *);
+extern void dict_snapshot_release (Dict *, DictSnapshot *);
+
+/* Lookups in a pinned version. These never modify anything. */
+extern void *dict_snapshot_get (DictSnapshot *, const void *);
+extern bool dict_snapshot_has_key (DictSnapshot *, const void *);
+extern unsigned int dict_snapshot_n_entries (DictSnapshot *);
+
+
+/* ------------------------------------------------------------
+ * Cache dictionaries.
+ * A cache dictionary holds at most MAX_ENTRIES entries and at most
+ * MAX_BYTES bytes (either may be 0 for no limit). Inserting beyond a
+ * limit evicts entries that have not been looked up recently, using
+ * the CLOCK algorithm, and passes each to the eviction callback (if
+ * any) so that the value may be freed.
+ *
+ * The byte count is dict_allocated_bytes() plus, if a size function
+ * has been set, the size it reports for each entry.
+ */
+typedef void (*DictEvictFn) (const void *key, void *value, void *cl);
+typedef size_t (*DictSizeFn) (const void *key, void *value);
+
+extern Dict *dict_new_cache (DictKeyFuncs *, unsigned int max_entries,
+                             size_t max_bytes, DictEvictFn, void *cl);
+extern void dict_cache_set_size_fn (Dict *, DictSizeFn);
+
+
+/* ------------------------------------------------------------
+ * String arena dictionaries.
+ * Keys are strings, copied (together with their length and hash) into
+ * large shared chunks instead of being individually allocated, and
+ * dict_free() releases the chunks in one go. Space left by deleted keys
+ * is only reclaimed by dict_compact_keys(), which moves every key and
+ * so invalidates key pointers previously obtained from the dictionary.
+ */
+extern Dict *dict_new_strarena (void);
+extern Dict *dict_new_strarena_with_buckets (DictBuckets); /* Not pages */
+extern void dict_compact_keys (Dict *);
+
+
+/* ------------------------------------------------------------
+ * Radix tree dictionaries.
+ * Keys are strings, kept in an adaptive radix tree in which keys with
+ * a common prefix share the memory for it, and iteration visits the
+ * keys in strcmp() order. Entries' keys are not kept: those returned
+ * by dict_get_entry() point to the key looked up, and those returned
+ * by iterators are only valid until the next step.
+ *
+ * dict_prefix_first() begins an iteration over only the keys starting
+ * with PREFIX, continued with dict_next() as usual.
+ */
+extern Dict *dict_new_radix (void);
+extern DictEntry *dict_prefix_first (Dict *d, const char *prefix);
+
 
 /* ------------------------------------------------------------
  * 'Decode' utility for use in eg. switches.
@@ -140,6 +490,9 @@ extern void dict_dump_dot (Dict *d, FILE *out,
                                           void *value));
 extern void dict_dumpf_dot (Dict *d, FILE *out, const char *fmt);
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif
 
@@ -0,0 +1,307 @@
+/* ------------------------------------------------------------
+ * C++ wrapper for the dictionary type.
+ *
+ *   toolbag::Dict<std::string, int> counts;
+ *   counts[word]++;
+ *   for (auto [word, n] : counts)
+ *     ...;
+ *
+ * The hash and equality functions are template parameters, so they
+ * are inlined rather than called through the key functions. Buckets
+ * are lists, which need only equality, not an ordering.
+ *
+ * Keys that are compared bytewise (integers, or structs of them
+ * without padding) are stored in the dictionary's own nodes; others
+ * are copied onto the heap. Values that fit in a pointer and are
+ * trivially copyable are stored in the entry itself; others are
+ * boxed, which allows move-only values.
+ *
+ * Pointers returned by find() and friends remain valid until the
+ * entry is erased. The dictionary must not be modified while it is
+ * being iterated over, although lookups are allowed.
+ */
+
+#ifndef __dict_hpp
+#define __dict_hpp
+
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "dict.h"
+
+namespace toolbag {
+
+template <typename K, typename V,
+          typename Hash = std::hash<K>, typename Eq = std::equal_to<K>>
+class Dict
+{
+  /* Keys stored inline are compared with memcmp(). */
+  static constexpr bool inline_keys =
+    std::is_trivially_copyable_v<K>
+    && std::has_unique_object_representations_v<K>
+    && std::is_same_v<Eq, std::equal_to<K>>
+    && alignof (K) <= alignof (void *);
+
+  static constexpr bool inline_values =
+    std::is_trivially_copyable_v<V>
+    && sizeof (V) <= sizeof (void *)
+    && alignof (V) <= alignof (void *);
+
+  static unsigned
+  hash (const K &k)
+  {
+    std::size_t h = Hash{} (k);
+    if constexpr (sizeof h > sizeof (unsigned))
+      h ^= h >> (sizeof (unsigned) * 8);
+    return (unsigned) h;
+  }
+
+  static unsigned
+  hash_fn (const void *k)
+  {
+    return hash (*static_cast<const K *> (k));
+  }
+
+  /* Only tells equal keys apart from unequal ones, which is all that
+     list buckets ask of it: this is not an ordering, and wouldn't do
+     for trees, pages or sorted iteration. */
+  static int
+  cmp_fn (const void *a, const void *b)
+  {
+    return Eq{} (*static_cast<const K *> (a),
+                 *static_cast<const K *> (b)) ? 0 : 1;
+  }
+
+  static void *
+  dup_fn (const void *k)
+  {
+    return new K (*static_cast<const K *> (k));
+  }
+
+  static void
+  free_fn (const void *k)
+  {
+    delete static_cast<const K *> (k);
+  }
+
+  /* Inline keys are compared by the dictionary, but hashed with Hash,
+     as key_handle() does. */
+  static inline DictKeyFuncs keyfuncs =
+    inline_keys
+    ? DictKeyFuncs{ nullptr, hash_fn, nullptr, nullptr, sizeof (K) }
+    : DictKeyFuncs{ cmp_fn, hash_fn, dup_fn, free_fn, 0 };
+
+  static const K &
+  entry_key (const DictEntry *e)
+  {
+    return *static_cast<const K *> (e->key);
+  }
+
+  static V &
+  entry_value (DictEntry *e)
+  {
+    if constexpr (inline_values)
+      return *std::launder (reinterpret_cast<V *> (&e->value));
+    else
+      return *static_cast<V *> (e->value);
+  }
+
+  template <typename... Args>
+  static void
+  construct_value (DictEntry *e, Args &&...args)
+  {
+    if constexpr (inline_values)
+      new (&e->value) V (std::forward<Args> (args)...);
+    else
+      e->value = new V (std::forward<Args> (args)...);
+  }
+
+  static void
+  destroy_value (DictEntry *e)
+  {
+    if constexpr (!inline_values)
+      delete static_cast<V *> (e->value);
+  }
+
+  DictKey
+  key_handle (const K &k) const
+  {
+    return dict_key_with_hash (&keyfuncs, &k, hash (k));
+  }
+
+  void
+  destroy_values ()
+  {
+    if constexpr (!inline_values)
+      for (DictEntry *de = dict_first (d); de; de = dict_next (d, de))
+        destroy_value (dict_iter_entry (d, de));
+  }
+
+  ::Dict *d;
+
+public:
+  class iterator
+  {
+    ::Dict *d;
+    DictEntry *de;
+
+    friend class Dict;
+    iterator (::Dict *d, DictEntry *de) : d (d), de (de) {}
+
+  public:
+    iterator (iterator &&o) noexcept : d (o.d), de (o.de) { o.de = nullptr; }
+    iterator (const iterator &) = delete;
+    iterator &operator= (const iterator &) = delete;
+
+    /* Stopping before the end cancels the iteration. */
+    ~iterator ()
+    {
+      if (de)
+        dict_end (d, de);
+    }
+
+    iterator &
+    operator= (iterator &&o) noexcept
+    {
+      if (this != &o)
+        {
+          if (de)
+            dict_end (d, de);
+          d = o.d;
+          de = o.de;
+          o.de = nullptr;
+        }
+      return *this;
+    }
+
+    const K &key () const { return entry_key (de); }
+    V &value () const { return entry_value (dict_iter_entry (d, de)); }
+
+    std::pair<const K &, V &>
+    operator* () const
+    {
+      return { key (), value () };
+    }
+
+    iterator &
+    operator++ ()
+    {
+      de = dict_next (d, de);
+      return *this;
+    }
+
+    bool operator== (const iterator &o) const { return de == o.de; }
+    bool operator!= (const iterator &o) const { return de != o.de; }
+  };
+
+  Dict () : d (dict_new_with_buckets (&keyfuncs, DICT_BUCKETS_LIST)) {}
+
+  Dict (Dict &&o) noexcept : d (o.d) { o.d = nullptr; }
+  Dict (const Dict &) = delete;
+  Dict &operator= (const Dict &) = delete;
+
+  Dict &
+  operator= (Dict &&o) noexcept
+  {
+    std::swap (d, o.d);
+    return *this;
+  }
+
+  ~Dict ()
+  {
+    if (d)
+      {
+        destroy_values ();
+        dict_free (d);
+      }
+  }
+
+  std::size_t size () const { return dict_n_entries (d); }
+  bool empty () const { return size () == 0; }
+
+  /* Value for key K, or nullptr. */
+  V *
+  find (const K &k)
+  {
+    DictKey key = key_handle (k);
+    DictEntry *e = dict_get_entry_hashed (d, &key);
+    return e ? &entry_value (e) : nullptr;
+  }
+
+  bool
+  contains (const K &k)
+  {
+    DictKey key = key_handle (k);
+    return dict_has_key_hashed (d, &key);
+  }
+
+  /* Construct a value for K from ARGS unless K is present already.
+     Returns the value and whether it was added. */
+  template <typename... Args>
+  std::pair<V *, bool>
+  try_emplace (const K &k, Args &&...args)
+  {
+    DictKey key = key_handle (k);
+    bool added;
+    DictEntry *e = dict_find_or_add_hashed (d, &key, &added);
+    if (added)
+      try
+        {
+          construct_value (e, std::forward<Args> (args)...);
+        }
+      catch (...)
+        {
+          dict_delete_hashed (d, &key);
+          throw;
+        }
+    return { &entry_value (e), added };
+  }
+
+  template <typename M>
+  std::pair<V *, bool>
+  insert_or_assign (const K &k, M &&v)
+  {
+    auto res = try_emplace (k, std::forward<M> (v));
+    if (!res.second)
+      *res.first = std::forward<M> (v);
+    return res;
+  }
+
+  V &
+  operator[] (const K &k)
+  {
+    return *try_emplace (k).first;
+  }
+
+  /* Returns whether K was present. */
+  bool
+  erase (const K &k)
+  {
+    DictKey key = key_handle (k);
+    DictEntry *e = dict_get_entry_hashed (d, &key);
+    if (!e)
+      return false;
+    destroy_value (e);
+    dict_delete_hashed (d, &key);
+    return true;
+  }
+
+  void
+  clear ()
+  {
+    destroy_values ();
+    dict_free (d);
+    d = dict_new_with_buckets (&keyfuncs, DICT_BUCKETS_LIST);
+  }
+
+  iterator begin () { return iterator (d, dict_first (d)); }
+  iterator end () { return iterator (d, nullptr); }
+};
+
+}
+
+#endif
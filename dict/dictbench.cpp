@@ -0,0 +1,111 @@
+/* Compare toolbag::Dict with std::unordered_map, on the same random
+ * keys as tablemark and on 64-bit integers.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "dict.hpp"
+
+const int max_keys = 250000;
+const int min_key_len = 5;
+const int max_key_len = 10;
+const int lookups = 4000000;
+
+static std::vector<std::string>
+init_keys (int max)
+{
+  std::vector<std::string> keys;
+  for (int i = 0; i < max; i++)
+    {
+      int len = min_key_len + rand () % (max_key_len - min_key_len);
+      std::string s;
+      for (int j = 0; j < len; j++)
+        s += 'a' + rand () % ('z' - 'a');
+      keys.push_back (s);
+    }
+  return keys;
+}
+
+static double
+seconds_since (std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration<double> (std::chrono::steady_clock::now ()
+                                        - t).count ();
+}
+
+/* Count NUM_KEYS keys into a new MAP, then look up random ones. Prints
+   millions of operations per second. */
+template <typename Map, typename Key>
+static void
+bench (const char *name, const std::vector<Key> &keys, int num_keys,
+       const std::vector<int> &order)
+{
+  auto t = std::chrono::steady_clock::now ();
+  long found = 0;
+  int rounds = 0;
+  do
+    {
+      Map m;
+      for (int i = 0; i < num_keys; i++)
+        m[keys[i]]++;
+      rounds++;
+    }
+  while (seconds_since (t) < 0.2);
+  double insert_rate = (double) rounds * num_keys / seconds_since (t);
+
+  Map m;
+  for (int i = 0; i < num_keys; i++)
+    m[keys[i]]++;
+  t = std::chrono::steady_clock::now ();
+  for (int i : order)
+    found += m.find (keys[i % num_keys]) != decltype (m.find (keys[0])) ();
+  double lookup_rate = order.size () / seconds_since (t);
+  if (found != (long) order.size ())
+    abort ();
+  printf ("  %-24s %8.1f %8.1f\n", name, insert_rate / 1e6,
+          lookup_rate / 1e6);
+}
+
+/* Lets bench() test find()'s result the same way for both types. */
+template <typename K, typename V>
+struct StdMap : std::unordered_map<K, V>
+{
+  V *
+  find (const K &k)
+  {
+    auto it = std::unordered_map<K, V>::find (k);
+    return it == this->end () ? nullptr : &it->second;
+  }
+};
+
+int
+main (int argc, char *argv[])
+{
+  std::vector<std::string> keys = init_keys (max_keys);
+  std::vector<uint64_t> ints;
+  for (int i = 0; i < max_keys; i++)
+    ints.push_back (((uint64_t) rand () << 32) ^ rand ());
+  std::vector<int> order;
+  for (int i = 0; i < lookups; i++)
+    order.push_back (rand ());
+
+  printf ("%-26s %8s %8s (M/s)\n", "keys", "insert", "lookup");
+  for (int n : { 1000, 16000, max_keys })
+    {
+      printf ("%d\n", n);
+      bench<toolbag::Dict<std::string, int>> ("Dict<string>", keys, n,
+                                              order);
+      bench<StdMap<std::string, int>> ("unordered_map<string>", keys, n,
+                                       order);
+      bench<toolbag::Dict<uint64_t, int>> ("Dict<uint64_t>", ints, n,
+                                           order);
+      bench<StdMap<uint64_t, int>> ("unordered_map<uint64_t>", ints, n,
+                                    order);
+    }
+  return 0;
+}
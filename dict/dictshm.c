@@ -0,0 +1,503 @@
+/* Shared memory dictionaries
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dict.h"
+#include "dictshm.h"
+
+#define SHM_MAGIC 0x326d687374636964ull /* "dictshm2" */
+#define SHM_MIN_L2_SLOTS 4
+
+/* Nodes and slot arrays are found by their offset from the start of
+   the region. Offset 0 is the header, so it means none. */
+typedef uint64_t ShmOff;
+
+typedef struct ShmHeader ShmHeader;
+struct ShmHeader
+{
+  _Atomic uint64_t magic;       /* Set once the header is ready */
+  uint64_t size;
+  pthread_mutex_t lock;         /* Held by the writer */
+  atomic_uint seq;              /* Odd while nodes are being rehashed */
+  _Atomic uint64_t table;       /* Slot array offset | log2 of its length */
+  atomic_uint n_entries;
+  _Atomic uint64_t used;        /* Bytes allocated, from the start */
+  /* Rehashing, so that the next writer can finish if this one dies */
+  uint64_t growing;             /* The new slot array, as for TABLE */
+  unsigned grow_slot;           /* Old slot whose nodes are being moved */
+  ShmOff moving;                /* Node off the old slot, maybe not in
+                                   the new one yet */
+};
+
+/* The key, its NUL and then the value follow the node. Nothing but
+   the link changes once a node has been linked in. */
+typedef struct ShmNode ShmNode;
+struct ShmNode
+{
+  _Atomic ShmOff next;
+  unsigned hash;
+  unsigned key_len;
+  uint64_t value_size;
+  char key[];
+};
+
+struct DictShm
+{
+  char *base;
+  size_t size;
+  bool writable;
+};
+
+#define HEADER(s) ((ShmHeader *)(s)->base)
+#define NODE(s, off) ((ShmNode *)((s)->base + (off)))
+/* Slot arrays are 64-byte aligned, leaving room for the log2 of their
+   length in the bottom bits of the table word. */
+#define SLOTS(s, table) ((_Atomic ShmOff *)((s)->base + ((table) & ~63ull)))
+#define L2_SLOTS(table) ((unsigned)((table) & 63))
+#define SLOT(hash, l2) ((hash) >> (32 - (l2)))
+#define VALUE_OFFSET(len) \
+  ((offsetof (ShmNode, key) + (len) + 1 + 7) & ~(size_t)7)
+#define VALUE(n) ((char *)(n) + VALUE_OFFSET ((n)->key_len))
+
+/* Slots are chosen by the top bits, so spread the string hash over
+   them. */
+static unsigned
+shm_hash (const char *key, size_t *len)
+{
+  *len = strlen (key);
+  return strkeyfuncs.hash_fn (key) * 0x9e3779b1u;
+}
+
+/* Offset of SIZE bytes of (zeroed) memory, or 0 if the region is
+   full. Writer only. */
+static ShmOff
+shm_alloc (DictShm *s, size_t size, size_t align)
+{
+  ShmHeader *h = HEADER (s);
+  uint64_t off = atomic_load_explicit (&h->used, memory_order_relaxed);
+  off = (off + align - 1) & ~(uint64_t)(align - 1);
+  if (off + size > h->size)
+    return 0;
+  atomic_store_explicit (&h->used, off + size, memory_order_relaxed);
+  return off;
+}
+
+/* Find KEY in the slot array TABLE, storing the link to its node (or
+   the null link ending its chain) in *LINKP. A rehash may send readers
+   anywhere, so they visit at most *LIMIT nodes, setting it to 0 if
+   they give up. */
+static ShmNode *
+shm_search (DictShm *s, uint64_t table, const char *key, size_t len,
+            unsigned hash, _Atomic ShmOff **linkp, unsigned *limit)
+{
+  _Atomic ShmOff *link = &SLOTS (s, table)[SLOT (hash, L2_SLOTS (table))];
+  ShmOff off;
+  while ((off = atomic_load_explicit (link, memory_order_acquire)))
+    {
+      ShmNode *n = NODE (s, off);
+      if (limit && !--*limit)
+        return NULL;
+      if (n->hash == hash && n->key_len == len
+          && memcmp (n->key, key, len) == 0)
+        {
+          if (linkp)
+            *linkp = link;
+          return n;
+        }
+      link = &n->next;
+    }
+  if (linkp)
+    *linkp = link;
+  return NULL;
+}
+
+/* The writer's steps while rehashing must reach memory in order, as
+   it may die between any two of them. */
+#define SHM_STEP() atomic_signal_fence (memory_order_seq_cst)
+
+/* Push the node at OFF onto its chain in SLOTS, of 2^L2 slots. */
+static void
+shm_relink (DictShm *s, _Atomic ShmOff *slots, unsigned l2, ShmOff off)
+{
+  ShmNode *n = NODE (s, off);
+  _Atomic ShmOff *slot = &slots[SLOT (n->hash, l2)];
+  atomic_store_explicit (&n->next,
+                         atomic_load_explicit (slot, memory_order_relaxed),
+                         memory_order_relaxed);
+  SHM_STEP ();
+  atomic_store_explicit (slot, off, memory_order_relaxed);
+}
+
+/* Stop rehashing after moving this many nodes (testing only) */
+static unsigned grow_stop;
+
+/* Move the nodes left in the old slot array to the new one, a node at
+   a time, then switch readers over to it. Every node is always in one
+   array or the other, or recorded as moving. */
+static void
+shm_rehash (DictShm *s)
+{
+  ShmHeader *h = HEADER (s);
+  uint64_t table = atomic_load_explicit (&h->table, memory_order_relaxed);
+  unsigned l2 = L2_SLOTS (table);
+  _Atomic ShmOff *old_slots = SLOTS (s, table);
+  _Atomic ShmOff *slots = SLOTS (s, h->growing);
+  for (; h->grow_slot < (1u << l2); SHM_STEP (), h->grow_slot++)
+    {
+      _Atomic ShmOff *old = &old_slots[h->grow_slot];
+      ShmOff off;
+      while ((off = atomic_load_explicit (old, memory_order_relaxed)))
+        {
+          h->moving = off;
+          SHM_STEP ();
+          atomic_store_explicit (old,
+                                 atomic_load_explicit (&NODE (s, off)->next,
+                                                       memory_order_relaxed),
+                                 memory_order_relaxed);
+          SHM_STEP ();
+          if (grow_stop && !--grow_stop)
+            return;
+          shm_relink (s, slots, l2 + 1, off);
+          SHM_STEP ();
+          h->moving = 0;
+        }
+    }
+  atomic_store_explicit (&h->table, h->growing, memory_order_release);
+  h->growing = 0;
+  atomic_store_explicit (&h->seq,
+                         atomic_load_explicit (&h->seq,
+                                               memory_order_relaxed) + 1,
+                         memory_order_release);
+}
+
+/* Double the slot array, if there's room. Readers that see the
+   sequence number change will retry. */
+static void
+shm_grow (DictShm *s)
+{
+  ShmHeader *h = HEADER (s);
+  uint64_t table = atomic_load_explicit (&h->table, memory_order_relaxed);
+  unsigned l2 = L2_SLOTS (table);
+  unsigned seq = atomic_load_explicit (&h->seq, memory_order_relaxed);
+  ShmOff off;
+  if (l2 == 32)
+    return;
+  off = shm_alloc (s, sizeof (ShmOff) << (l2 + 1), 64);
+  if (!off)
+    return;
+  atomic_store_explicit (&h->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  h->grow_slot = 0;
+  h->moving = 0;
+  SHM_STEP ();
+  h->growing = off | (l2 + 1);
+  SHM_STEP ();
+  shm_rehash (s);
+}
+
+/* Take over from a writer that died holding the lock: finish any
+   rehash it left half done, and count the entries again, in case it
+   died between linking or unlinking a node and counting it. */
+static void
+shm_recover (DictShm *s)
+{
+  ShmHeader *h = HEADER (s);
+  uint64_t table = atomic_load_explicit (&h->table, memory_order_relaxed);
+  unsigned l2 = L2_SLOTS (table), i, n = 0;
+  if (h->growing)
+    {
+      ShmOff off = h->moving;
+      if (off
+          && atomic_load_explicit (&SLOTS (s, table)[h->grow_slot],
+                                   memory_order_relaxed) != off)
+        {
+          /* Taken off the old slot: link it in the new one, unless it
+             got there. */
+          _Atomic ShmOff *slots = SLOTS (s, h->growing);
+          if (atomic_load_explicit (&slots[SLOT (NODE (s, off)->hash,
+                                                 l2 + 1)],
+                                    memory_order_relaxed) != off)
+            shm_relink (s, slots, l2 + 1, off);
+        }
+      h->moving = 0;
+      shm_rehash (s);
+      table = atomic_load_explicit (&h->table, memory_order_relaxed);
+      l2 = L2_SLOTS (table);
+    }
+  else if (atomic_load_explicit (&h->seq, memory_order_relaxed) & 1)
+    /* Died before choosing the new slot array */
+    atomic_fetch_add_explicit (&h->seq, 1, memory_order_release);
+  for (i = 0; i < (1u << l2); i++)
+    {
+      ShmOff off = atomic_load_explicit (&SLOTS (s, table)[i],
+                                         memory_order_relaxed);
+      for (; off; off = atomic_load_explicit (&NODE (s, off)->next,
+                                              memory_order_relaxed))
+        n++;
+    }
+  atomic_store_explicit (&h->n_entries, n, memory_order_relaxed);
+}
+
+/* Take the writer's lock, recovering if its last holder died. */
+static void
+shm_lock (DictShm *s)
+{
+  ShmHeader *h = HEADER (s);
+  int err = pthread_mutex_lock (&h->lock);
+  if (err == EOWNERDEAD)
+    {
+      shm_recover (s);
+      pthread_mutex_consistent (&h->lock);
+    }
+  else
+    assert (err == 0);
+}
+
+extern void dict_shm_lock_TEST (DictShm *s)
+{
+  shm_lock (s);
+}
+
+/* Take the lock and leave a rehash half done, stopping with the N'th
+   node off its old slot but not yet in the new one. */
+extern void dict_shm_grow_TEST (DictShm *s, unsigned n)
+{
+  shm_lock (s);
+  grow_stop = n;
+  shm_grow (s);
+  grow_stop = 0;
+}
+
+static DictShm *
+shm_map (int fd, size_t size, bool writable)
+{
+  DictShm *s;
+  void *base = mmap (NULL, size, PROT_READ | (writable ? PROT_WRITE : 0),
+                     MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0), fd, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+  s = malloc (sizeof *s);
+  s->base = base;
+  s->size = size;
+  s->writable = writable;
+  return s;
+}
+
+DictShm *
+dict_shm_create (const char *name, size_t size)
+{
+  DictShm *s;
+  ShmHeader *h;
+  pthread_mutexattr_t attr;
+  int fd = -1;
+  if (size < sizeof *h + 64 + (sizeof (ShmOff) << SHM_MIN_L2_SLOTS))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  if (name)
+    {
+      fd = shm_open (name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (fd < 0)
+        return NULL;
+      if (ftruncate (fd, size) < 0)
+        {
+          int err = errno;
+          close (fd);
+          shm_unlink (name);
+          errno = err;
+          return NULL;
+        }
+    }
+  s = shm_map (fd, size, true);
+  if (fd >= 0)
+    close (fd);
+  if (!s)
+    return NULL;
+  h = HEADER (s);
+  h->size = size;
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init (&h->lock, &attr);
+  pthread_mutexattr_destroy (&attr);
+  atomic_init (&h->seq, 0);
+  atomic_init (&h->n_entries, 0);
+  atomic_init (&h->used, sizeof *h);
+  h->growing = 0;
+  atomic_init (&h->table,
+               shm_alloc (s, sizeof (ShmOff) << SHM_MIN_L2_SLOTS, 64)
+               | SHM_MIN_L2_SLOTS);
+  atomic_store_explicit (&h->magic, SHM_MAGIC, memory_order_release);
+  return s;
+}
+
+DictShm *
+dict_shm_open (const char *name, bool writable)
+{
+  DictShm *s;
+  struct stat st;
+  int fd = shm_open (name, writable ? O_RDWR : O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) < 0)
+    {
+      int err = errno;
+      close (fd);
+      errno = err;
+      return NULL;
+    }
+  if (st.st_size < sizeof (ShmHeader))
+    {
+      close (fd);
+      errno = EINVAL;
+      return NULL;
+    }
+  s = shm_map (fd, st.st_size, writable);
+  close (fd);
+  if (!s)
+    return NULL;
+  if (atomic_load_explicit (&HEADER (s)->magic, memory_order_acquire)
+      != SHM_MAGIC)
+    {
+      dict_shm_close (s);
+      errno = EINVAL;
+      return NULL;
+    }
+  return s;
+}
+
+void
+dict_shm_close (DictShm *s)
+{
+  munmap (s->base, s->size);
+  free (s);
+}
+
+int
+dict_shm_unlink (const char *name)
+{
+  return shm_unlink (name);
+}
+
+bool
+dict_shm_set (DictShm *s, const char *key, const void *value, size_t size)
+{
+  ShmHeader *h = HEADER (s);
+  size_t len;
+  unsigned hash = shm_hash (key, &len);
+  _Atomic ShmOff *link;
+  ShmNode *old, *n;
+  ShmOff off;
+  assert (s->writable);
+  shm_lock (s);
+  old = shm_search (s, atomic_load_explicit (&h->table, memory_order_relaxed),
+                    key, len, hash, &link, NULL);
+  off = shm_alloc (s, VALUE_OFFSET (len) + size, 8);
+  if (!off)
+    {
+      pthread_mutex_unlock (&h->lock);
+      errno = ENOSPC;
+      return false;
+    }
+  n = NODE (s, off);
+  n->hash = hash;
+  n->key_len = len;
+  n->value_size = size;
+  memcpy (n->key, key, len + 1);
+  memcpy (VALUE (n), value, size);
+  atomic_store_explicit (&n->next,
+                         old ? atomic_load_explicit (&old->next,
+                                                     memory_order_relaxed)
+                         : 0, memory_order_relaxed);
+  /* Publish the node, replacing OLD if there was one */
+  atomic_store_explicit (link, off, memory_order_release);
+  if (!old
+      && (atomic_fetch_add_explicit (&h->n_entries, 1, memory_order_relaxed)
+          >= (1u << L2_SLOTS (atomic_load_explicit (&h->table,
+                                                    memory_order_relaxed)))))
+    shm_grow (s);
+  pthread_mutex_unlock (&h->lock);
+  return true;
+}
+
+bool
+dict_shm_delete (DictShm *s, const char *key)
+{
+  ShmHeader *h = HEADER (s);
+  size_t len;
+  unsigned hash = shm_hash (key, &len);
+  _Atomic ShmOff *link;
+  ShmNode *n;
+  assert (s->writable);
+  shm_lock (s);
+  n = shm_search (s, atomic_load_explicit (&h->table, memory_order_relaxed),
+                  key, len, hash, &link, NULL);
+  if (n)
+    {
+      atomic_store_explicit (link, atomic_load_explicit (&n->next,
+                                                         memory_order_relaxed),
+                             memory_order_release);
+      atomic_fetch_sub_explicit (&h->n_entries, 1, memory_order_relaxed);
+    }
+  pthread_mutex_unlock (&h->lock);
+  return n != NULL;
+}
+
+const void *
+dict_shm_get (DictShm *s, const char *key, size_t *size)
+{
+  ShmHeader *h = HEADER (s);
+  size_t len;
+  unsigned hash = shm_hash (key, &len);
+  for (;;)
+    {
+      unsigned seq = atomic_load_explicit (&h->seq, memory_order_acquire);
+      unsigned limit;
+      ShmNode *n;
+      if (seq & 1)
+        {
+          sched_yield ();
+          continue;
+        }
+      /* Chains are never longer than the number of entries, give or
+         take those added meanwhile. */
+      limit = 2 * atomic_load_explicit (&h->n_entries,
+                                        memory_order_relaxed) + 64;
+      n = shm_search (s, atomic_load_explicit (&h->table,
+                                               memory_order_acquire),
+                      key, len, hash, NULL, &limit);
+      atomic_thread_fence (memory_order_acquire);
+      if (limit
+          && atomic_load_explicit (&h->seq, memory_order_relaxed) == seq)
+        {
+          if (n && size)
+            *size = n->value_size;
+          return n ? VALUE (n) : NULL;
+        }
+    }
+}
+
+unsigned int
+dict_shm_n_entries (DictShm *s)
+{
+  return atomic_load_explicit (&HEADER (s)->n_entries, memory_order_relaxed);
+}
+
+size_t
+dict_shm_unused_bytes (DictShm *s)
+{
+  ShmHeader *h = HEADER (s);
+  return h->size - atomic_load_explicit (&h->used, memory_order_relaxed);
+}
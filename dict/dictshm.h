@@ -0,0 +1,65 @@
+/* ------------------------------------------------------------
+ * Shared memory dictionaries.
+ *
+ * A dictionary of string keys and byte string values that lives
+ * entirely in one shared memory region, linked by offsets rather than
+ * pointers, so that several processes can map it at different
+ * addresses. One process at a time writes (writers take a
+ * process-shared lock); any number read without locking. If a writer
+ * dies holding the lock the next one finishes its work, and readers
+ * wait for that if it died while growing the slot array.
+ *
+ * The region is append-only: space is never reused, so deleting or
+ * replacing an entry, and growing the slot array, leave the old space
+ * behind, and writers fail once it is full. In return, a value
+ * returned by dict_shm_get() stays valid, and unchanged, until the
+ * dictionary is closed, which lock-free readers rely on.
+ */
+
+#ifndef __dictshm_h
+#define __dictshm_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct DictShm DictShm;
+
+/* Create an empty dictionary of SIZE bytes in shared memory object
+   NAME (as for shm_open()), replacing any existing one. If NAME is
+   NULL the memory is anonymous, shared only with processes forked
+   afterwards. Returns NULL, setting errno, on failure. */
+extern DictShm *dict_shm_create (const char *name, size_t size);
+
+/* Attach to an existing dictionary, to write to it only if WRITABLE.
+   Returns NULL, setting errno, on failure. */
+extern DictShm *dict_shm_open (const char *name, bool writable);
+
+/* Detach from a dictionary. It persists until unlinked. */
+extern void dict_shm_close (DictShm *);
+extern int dict_shm_unlink (const char *name);
+
+/* Set KEY's value to a copy of the SIZE bytes at VALUE. Returns false,
+   setting errno to ENOSPC, if the region is full. */
+extern bool dict_shm_set (DictShm *, const char *key, const void *value,
+                          size_t size);
+
+/* Delete KEY. Returns whether it was present. */
+extern bool dict_shm_delete (DictShm *, const char *key);
+
+/* KEY's value, or NULL, storing its size in *SIZE if SIZE is not NULL. */
+extern const void *dict_shm_get (DictShm *, const char *key, size_t *size);
+
+extern unsigned int dict_shm_n_entries (DictShm *);
+
+/* Bytes of the region not yet allocated */
+extern size_t dict_shm_unused_bytes (DictShm *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
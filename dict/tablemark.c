@@ -6,17 +6,25 @@
 
 #include <unistd.h>
 #include <sys/resource.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
 #include "dict.h"
 
-const int max_keys = 250000;
+int max_keys = 250000;
 const int min_key_len = 5;
 const int max_key_len = 10;
 const int step = 128;
 
+/* With -z, lookups follow a Zipf distribution with this exponent,
+   giving about 1% of keys 90% of lookups. */
+const double zipf_s = 1.2;
+int zipf = 0;
+
 char **init_keys (int max)
 {
   int i;
@@ -37,6 +45,32 @@ char **init_keys (int max)
   return keys;
 }
 
+/* Read keys, one per line, from FILE_NAME, setting max_keys. */
+char **read_keys (const char *file_name)
+{
+  FILE *f = fopen (file_name, "r");
+  char line[4096];
+  char **keys = NULL;
+  int size = 0;
+  if (!f)
+    {
+      perror (file_name);
+      exit (EXIT_FAILURE);
+    }
+  max_keys = 0;
+  while (fgets (line, sizeof line, f))
+    {
+      line[strcspn (line, "\n")] = '\0';
+      if (max_keys == size)
+        {
+          size = size ? 2 * size : 1024;
+          keys = realloc (keys, size * sizeof *keys);
+        }
+      keys[max_keys++] = strdup (line);
+    }
+  fclose (f);
+  return keys;
+}
 
 double tv_diff (struct timeval *res, struct timeval *x, struct timeval *y) {
   struct timeval r;
@@ -50,39 +84,266 @@ double tv_diff (struct timeval *res, struct timeval *x, struct timeval *y) {
   return (double)res->tv_sec + (double)res->tv_usec / 1000000;
 }
 
-void test_round (int rounds, char **keys, int num_keys)
+/* Fill LOOKUPS with ROUNDS indices of keys to look up, the lower
+   ones being the more popular with -z. */
+void choose_lookups (int *lookups, int rounds, int num_keys)
+{
+  int i;
+  double *cdf, total = 0;
+  if (!zipf)
+    {
+      for (i = 0; i < rounds; i++)
+        lookups[i] = rand() % num_keys;
+      return;
+    }
+  cdf = malloc (num_keys * sizeof *cdf);
+  for (i = 0; i < num_keys; i++)
+    {
+      total += pow (i + 1, -zipf_s);
+      cdf[i] = total;
+    }
+  for (i = 0; i < rounds; i++)
+    {
+      double u = total * rand() / ((double)RAND_MAX + 1);
+      int lo = 0, hi = num_keys - 1;
+      while (lo < hi)
+        {
+          int mid = (lo + hi) / 2;
+          if (cdf[mid] <= u)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      lookups[i] = lo;
+    }
+  free (cdf);
+}
+
+/* Lookups per second in a dictionary of about NUM_KEYS / 2 entries,
+   with the given buckets or, if RADIX, a radix tree. Its size in bytes
+   per entry, including the keys, is stored in *BYTES. */
+double test_round (int rounds, char **keys, int num_keys,
+                   DictBuckets buckets, int radix, double *bytes)
 {
   int i, r;
-  Dict *d = dict_new (&strkeyfuncs);
+  Dict *d = (radix ? dict_new_radix ()
+             : dict_new_with_buckets (&strkeyfuncs, buckets));
+  DictEntry *de;
+  size_t key_bytes = 0;
   int count = 0;
   double t;
   struct rusage usage0, usage1;
-  DictEntry *de;
+  int *lookups = malloc (rounds * sizeof *lookups);
   /* Populate dictionary */
   
   for (i = 0; i < num_keys; i++)
     if (rand() & 1)
       dict_set (d, keys[i], keys[rand() % num_keys]);
+  choose_lookups (lookups, rounds, num_keys);
 
   getrusage (0, &usage0);
   
   for (r = 0; r < rounds; r++)
 
     {
-      char *s = dict_get (d, keys[rand() % num_keys]);
+      char *s = dict_get (d, keys[lookups[r]]);
       count += (s != NULL);
     }
 
   getrusage (0, &usage1);
 
+  /* Radix trees count their keys; the others have strdup()ed them. */
+  if (!radix)
+    for (de = dict_first (d); de; de = dict_next (d, de))
+      key_bytes += strlen (de->key) + 1;
+  *bytes = ((double)(dict_allocated_bytes (d) + key_bytes)
+            / dict_n_entries (d));
   dict_free (d);
+  free (lookups);
 
-  /* Print out line */
   t = tv_diff(NULL, &usage1.ru_utime, &usage0.ru_utime);
+  return (double )rounds / t;
+}
+
+/* Bump allocator for the teardown test: blocks are never freed
+   individually, only the whole arena at once. */
+typedef struct Arena Arena;
+struct Arena
+{
+  Arena *prev;
+  size_t used;
+  size_t size;
+  char block[];
+};
+
+void *arena_alloc (void *ctx, size_t size)
+{
+  Arena **ap = ctx;
+  Arena *a = *ap;
+  void *p;
+  size = (size + 15) & ~(size_t)15;
+  if (!a || a->used + size > a->size)
+    {
+      size_t block_size = size > (1 << 20) ? size : (1 << 20);
+      a = malloc (sizeof *a + block_size);
+      a->prev = *ap;
+      a->used = 0;
+      a->size = block_size;
+      *ap = a;
+    }
+  p = a->block + a->used;
+  a->used += size;
+  return p;
+}
+
+void arena_release (Arena *a)
+{
+  while (a)
+    {
+      Arena *prev = a->prev;
+      free (a);
+      a = prev;
+    }
+}
+
+double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Time freeing a dictionary of NUM_KEYS entries, node by node with
+   malloc, and in bulk with an arena. */
+void teardown_round (int rounds, char **keys, int num_keys)
+{
+  int i, r;
+  double t0, t_malloc = 0, t_arena = 0;
+  for (r = 0; r < rounds; r++)
+    {
+      Dict *d = dict_new (&staticstrkeyfuncs);
+      Arena *a = NULL;
+      for (i = 0; i < num_keys; i++)
+        dict_set (d, keys[i], keys[i]);
+      t0 = now ();
+      dict_free (d);
+      t_malloc += now () - t0;
 
-  printf ("%d %f\n", num_keys, (double )rounds / t);
+      d = dict_new_with_allocator (&staticstrkeyfuncs, &a,
+                                   arena_alloc, NULL);
+      for (i = 0; i < num_keys; i++)
+        dict_set (d, keys[i], keys[i]);
+      t0 = now ();
+      dict_free (d);
+      arena_release (a);
+      t_arena += now () - t0;
+    }
+  printf ("%d %f %f\n", num_keys,
+          t_malloc * 1e9 / rounds / num_keys,
+          t_arena * 1e9 / rounds / num_keys);
+  fflush (stdout);
+}
+
+/* Entries whose value is below *CL */
+bool expired (DictEntry *de, void *cl)
+{
+  return (long)de->value < *(long *)cl;
+}
+
+/* Time deleting the given percentage of a dictionary of NUM_KEYS
+   entries, collecting their keys and deleting each, and with
+   dict_delete_if(). */
+void expire_round (int rounds, char **keys, int num_keys, long percent)
+{
+  int i, r;
+  double t0, t_each = 0, t_if = 0;
+  const char **doomed = malloc (num_keys * sizeof *doomed);
+  for (r = 0; r < rounds; r++)
+    {
+      Dict *d = dict_new (&strkeyfuncs);
+      DictEntry *de;
+      int n = 0;
+      for (i = 0; i < num_keys; i++)
+        dict_set (d, keys[i], (void *)(long)(rand () % 100));
+      t0 = now ();
+      for (de = dict_first (d); de; de = dict_next (d, de))
+        if (expired (de, &percent))
+          doomed[n++] = strdup (de->key);
+      for (i = 0; i < n; i++)
+        {
+          dict_delete (d, doomed[i]);
+          free ((char *)doomed[i]);
+        }
+      t_each += now () - t0;
+      dict_free (d);
+
+      d = dict_new (&strkeyfuncs);
+      for (i = 0; i < num_keys; i++)
+        dict_set (d, keys[i], (void *)(long)(rand () % 100));
+      t0 = now ();
+      dict_delete_if (d, expired, &percent);
+      t_if += now () - t0;
+      dict_free (d);
+    }
+  free (doomed);
+  printf ("%d %ld %f %f\n", num_keys, percent,
+          t_each * 1e9 / rounds / num_keys,
+          t_if * 1e9 / rounds / num_keys);
+  fflush (stdout);
+}
+
+/* Kilobytes of this process's memory backed by transparent huge
+   pages, or -1 if the kernel doesn't say. */
+long anon_huge_kb (void)
+{
+  FILE *f = fopen ("/proc/self/smaps_rollup", "r");
+  char line[256];
+  long kb = -1;
+  if (!f)
+    return -1;
+  while (fgets (line, sizeof line, f))
+    if (sscanf (line, "AnonHugePages: %ld kB", &kb) == 1)
+      break;
+  fclose (f);
+  return kb;
+}
+
+/* Time ROUNDS random lookups among NUM_KEYS 64-bit keys, in a tree
+   dictionary allocated with malloc and in one allocated from huge
+   pages. Tables this big miss the TLB on most lookups. */
+void huge_round (int rounds, int num_keys)
+{
+  int i, r, h;
+  double t[2];
+  long huge_kb = -1;
+  int count = 0;
+  uint64_t *keys = malloc (num_keys * sizeof *keys);
+  int *lookups = malloc (rounds * sizeof *lookups);
+  for (i = 0; i < num_keys; i++)
+    keys[i] = ((uint64_t)rand () << 32) ^ rand ();
+  for (r = 0; r < rounds; r++)
+    lookups[r] = rand () % num_keys;
+  for (h = 0; h < 2; h++)
+    {
+      Dict *d = (h ? dict_new_hugepages (&fixed8keyfuncs, DICT_BUCKETS_TREE)
+                 : dict_new (&fixed8keyfuncs));
+      double t0;
+      for (i = 0; i < num_keys; i++)
+        dict_set (d, &keys[i], NULL);
+      t0 = now ();
+      for (r = 0; r < rounds; r++)
+        count += dict_has_key (d, &keys[lookups[r]]);
+      t[h] = now () - t0;
+      if (h)
+        huge_kb = anon_huge_kb ();
+      dict_free (d);
+    }
+  assert (count == 2 * rounds);
+  free (keys);
+  free (lookups);
+  printf ("%d %f %f %ld\n", num_keys, t[0] * 1e9 / rounds,
+          t[1] * 1e9 / rounds, huge_kb);
   fflush (stdout);
-  
 }
 
 int main (int argc, char *argv[])
@@ -90,17 +351,101 @@ int main (int argc, char *argv[])
   int i, num_keys;
   char **keys;
   int rounds = 1000000;
-  if (argc == 2) {
-    rounds = atoi (argv[1]);
+  int teardown = 0;
+  int expire = 0;
+  int huge = 0;
+  int opt;
+  char *key_file = NULL;
+  while ((opt = getopt (argc, argv, "df:Htz")) != -1)
+    switch (opt)
+      {
+      case 'f':
+        key_file = optarg;
+        break;
+      case 'z':
+        zipf = 1;
+        break;
+      case 'd':
+        /* Print "keys percent ns/entry(dict_delete) ns/entry(dict_delete_if)"
+           for deleting a percentage of the entries */
+        expire = 1;
+        rounds = 5;
+        break;
+      case 'H':
+        /* Print "keys ns/lookup(malloc) ns/lookup(huge pages) huge-kB"
+           for 64-bit keys, up to tables of about a gigabyte */
+        huge = 1;
+        rounds = 4000000;
+        break;
+      case 't':
+        /* Print "keys ns/entry(malloc) ns/entry(arena)" for dict_free */
+        teardown = 1;
+        rounds = 20;
+        break;
+      default:
+        fprintf (stderr,
+                 "Syntax: %s [-d] [-f keyfile] [-H] [-t] [-z] [rounds]\n",
+                 argv[0]);
+        return EXIT_FAILURE;
+      }
+  if (optind < argc) {
+    rounds = atoi (argv[optind]);
     fprintf (stderr, "using %d rounds\n", rounds);
   }
-  keys = init_keys (max_keys);
+  if (huge)
+    {
+      for (num_keys = 1 << 16; num_keys <= 1 << 24; num_keys *= 4)
+        huge_round (rounds, num_keys);
+      return 0;
+    }
+  keys = key_file ? read_keys (key_file) : init_keys (max_keys);
+  if (teardown)
+    {
+      for (num_keys = step; num_keys < max_keys; num_keys *= 2)
+        teardown_round (rounds, keys, num_keys);
+      return 0;
+    }
+  if (expire)
+    {
+      static const long percents[] = { 10, 50, 90 };
+      for (num_keys = step; num_keys < max_keys; num_keys *= 4)
+        for (i = 0; i < sizeof percents / sizeof *percents; i++)
+          expire_round (rounds, keys, num_keys, percents[i]);
+      return 0;
+    }
   if (0)
     {
       /* Print keys */
       for (i = 0; i < max_keys; i++)
         fprintf (stdout, "%s\n", keys[i]);
     }
-  for (num_keys = step; num_keys < max_keys; num_keys += step)
-    test_round(rounds, keys, num_keys);
+  /* Print "keys" and then "rate bytes/entry" for each of tree, pages,
+     list, adaptive and ordered buckets and a radix tree, each strategy
+     seeing the same entries and lookups. Keys from a file are often
+     many, so their sweep doubles the number of keys each time, up to
+     all of them. */
+  for (num_keys = step; num_keys <= max_keys;
+       num_keys = (!key_file ? num_keys + step
+                   : num_keys < max_keys && 2 * num_keys > max_keys
+                   ? max_keys : 2 * num_keys))
+    {
+      static const DictBuckets buckets[] = {
+        DICT_BUCKETS_TREE, DICT_BUCKETS_PAGES, DICT_BUCKETS_LIST,
+        DICT_BUCKETS_ADAPTIVE, DICT_BUCKETS_ORDERED
+      };
+      unsigned seed = rand ();
+      printf ("%d", num_keys);
+      for (i = 0; i <= sizeof buckets / sizeof *buckets; i++)
+        {
+          int radix = (i == sizeof buckets / sizeof *buckets);
+          double rate, bytes;
+          srand (seed);
+          rate = test_round (rounds, keys, num_keys,
+                             radix ? DICT_BUCKETS_TREE : buckets[i], radix,
+                             &bytes);
+          printf (" %f %.1f", rate, bytes);
+        }
+      printf ("\n");
+      fflush (stdout);
+    }
 }
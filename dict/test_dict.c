@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include "dict.h"
 #include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 struct test_item {
   char *key;
@@ -76,6 +79,288 @@ void print_str_str (FILE * out, const void *k, void *value)
 bool fail = false;
 int verbose = 0;
 int updated = 0;
+DictSnapshot *snapshot = NULL;
+bool versioned = false;
+
+/* CL, if not NULL, is the key just set, which mustn't be evicted */
+void evict_value (const void *k, void *value, void *cl)
+{
+  if (verbose)
+    printf ("Evicted '%s'\n", (char *)k);
+  if (cl && !strcmp (k, cl))
+    {
+      printf ("Check fail: '%s' evicted as it was set\n", (char *)k);
+      fail = true;
+    }
+  free (value);
+}
+
+size_t entry_size (const void *k, void *value)
+{
+  return strlen (k) + strlen (value) + 2;
+}
+
+/* Set N entries of a cache of its own limited to MAX_BYTES, checking
+   that each entry survives the evictions made to fit it in. */
+void test_cache_bytes (size_t max_bytes, int n)
+{
+  char key[32], value[64];
+  Dict *c = dict_new_cache (NULL, 0, max_bytes, evict_value, key);
+  DictEntry *de;
+  int i;
+  dict_cache_set_size_fn (c, entry_size);
+  for (i = 0; i < n; i++)
+    {
+      sprintf (key, "key-%d", i);
+      sprintf (value, "%.*s", 1 + i % 60, test_items[i % 50].value);
+      dict_set (c, key, strdup (value));
+      if (!dict_has_key (c, key))
+        {
+          printf ("Check fail: '%s' not kept after being set\n", key);
+          fail = true;
+        }
+    }
+  printf ("Cache of %zu bytes holds %u of %d entries\n", max_bytes,
+          dict_n_entries (c), n);
+  for (de = dict_first (c); de; de = dict_next (c, de))
+    free (de->value);
+  dict_free (c);
+}
+
+/* Evicting from CL, a set operation's operand, would free its values */
+void evict_operand (const void *k, void *value, void *cl)
+{
+  printf ("Check fail: '%s' evicted from %s\n", (char *)k, (char *)cl);
+  fail = true;
+}
+
+/* Combine a full cache of N entries with a plain dictionary of as many,
+   half of them the cache's keys, checking that the results are whole
+   and that nothing is evicted from either. */
+void test_cache_set_ops (int n)
+{
+  Dict *a = dict_new_cache (NULL, n, 0, evict_operand, "a cache operand");
+  Dict *b = dict_new (NULL);
+  Dict *r;
+  DictEntry *de;
+  char key[32];
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      sprintf (key, "key-%d", i);
+      dict_set (a, key, strdup (key));
+      sprintf (key, "key-%d", n / 2 + i);
+      dict_set (b, key, strdup (key));
+    }
+  r = dict_union (a, b);
+  if (dict_n_entries (r) != n + n / 2)
+    {
+      printf ("Check fail: union of %u entries, should be %d\n",
+              dict_n_entries (r), n + n / 2);
+      fail = true;
+    }
+  dict_free (r);
+  r = dict_intersect (a, b);
+  if (dict_n_entries (r) != n - n / 2)
+    {
+      printf ("Check fail: intersection of %u entries, should be %d\n",
+              dict_n_entries (r), n - n / 2);
+      fail = true;
+    }
+  dict_free (r);
+  r = dict_difference (a, b);
+  if (dict_n_entries (r) != n / 2)
+    {
+      printf ("Check fail: difference of %u entries, should be %d\n",
+              dict_n_entries (r), n / 2);
+      fail = true;
+    }
+  dict_free (r);
+  if (dict_n_entries (a) != n)
+    {
+      printf ("Check fail: cache of %u entries after set operations,"
+              " should be %d\n", dict_n_entries (a), n);
+      fail = true;
+    }
+  printf ("Combined a cache of %d entries\n", n);
+  for (de = dict_first (a); de; de = dict_next (a, de))
+    free (de->value);
+  for (de = dict_first (b); de; de = dict_next (b, de))
+    free (de->value);
+  dict_free (a);
+  dict_free (b);
+}
+
+/* Count in CL each entry scanned */
+void print_entry (DictEntry *de, void *cl)
+{
+  printf ("'%s' -> '%s'\n", (char *) de->key, (char *) de->value);
+  (*(unsigned int *) cl)++;
+}
+
+/* Entries whose value is the string CL */
+bool value_is (DictEntry *de, void *cl)
+{
+  if (strcmp (de->value, cl))
+    return false;
+  if (!versioned)
+    free (de->value);
+  return true;
+}
+
+/* Keys copied and not yet freed by countkeyfuncs */
+int keys_live = 0;
+
+void *count_dup (const void *k)
+{
+  keys_live++;
+  return strdup (k);
+}
+
+void count_free (const void *k)
+{
+  keys_live--;
+  free ((void *) k);
+}
+
+/* Entries kept by test_publishes() */
+#define PUBLISHES_LIVE 1000
+
+/* Set and delete keys in a versioned dictionary of its own, publishing
+   after each change, then free it and check nothing was left. Blocks
+   that malloc keeps cached for reuse still count as in use, so only a
+   shortfall of the order of the entries left is taken to be a leak. */
+void test_publishes (int n)
+{
+  DictKeyFuncs funcs = strkeyfuncs;
+  Dict *v;
+  char key[32];
+  int i;
+#ifdef __GLIBC__
+  long in_use = mallinfo2 ().uordblks;
+#endif
+  funcs.dup_fn = count_dup;
+  funcs.free_fn = count_free;
+  v = dict_new_versioned (&funcs);
+  for (i = 0; i < n; i++)
+    {
+      sprintf (key, "key-%d", i);
+      dict_set (v, key, NULL);
+      if (i >= PUBLISHES_LIVE)
+        {
+          sprintf (key, "key-%d", i - PUBLISHES_LIVE);
+          dict_delete (v, key);
+        }
+      dict_publish (v);
+    }
+  dict_free (v);
+#ifdef __GLIBC__
+  in_use = (long) mallinfo2 ().uordblks - in_use;
+#endif
+  if (keys_live)
+    {
+      printf ("Check fail: %d keys not freed after %d publishes\n",
+              keys_live, n);
+      fail = true;
+    }
+#ifdef __GLIBC__
+  if (in_use > PUBLISHES_LIVE * (long) sizeof (void *))
+    {
+      printf ("Check fail: %ld bytes not freed after %d publishes\n",
+              in_use, n);
+      fail = true;
+    }
+#endif
+  printf ("Published %d times\n", n);
+}
+
+/* Keep a sorted index of a dictionary of its own while adding N
+   entries, checking that the table still grows and the index is
+   rebuilt in order. */
+void test_sorted_kept (int n)
+{
+  Dict *d = dict_new (NULL);
+  DictSorted *s = dict_sorted_iter (d);
+  DictStats stats;
+  char key[32];
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      sprintf (key, "key-%d", i);
+      dict_set (d, key, NULL);
+    }
+  dict_get_stats (d, &stats);
+  if (stats.n_slots * 4 < stats.n_entries)
+    {
+      printf ("Check fail: %u entries in %u slots with an index kept\n",
+              stats.n_entries, stats.n_slots);
+      fail = true;
+    }
+  dict_defragment (d);
+  if (dict_sorted_valid (s))
+    {
+      printf ("Check fail: index still valid after changes\n");
+      fail = true;
+    }
+  dict_sorted_refresh (s);
+  if (dict_sorted_n_entries (s) != n)
+    {
+      printf ("Check fail: index of %u entries, should be %d\n",
+              dict_sorted_n_entries (s), n);
+      fail = true;
+    }
+  for (i = 1; i < n; i++)
+    if (strcmp (dict_sorted_entry (s, i - 1)->key,
+                dict_sorted_entry (s, i)->key) >= 0)
+      {
+        printf ("Check fail: '%s' sorted before '%s'\n",
+                (char *) dict_sorted_entry (s, i - 1)->key,
+                (char *) dict_sorted_entry (s, i)->key);
+        fail = true;
+      }
+  printf ("Kept an index while adding %d entries\n", n);
+  dict_sorted_free (s);
+  dict_free (d);
+}
+
+/* Keep a sorted index of a paged dictionary of its own of N entries
+   while looking each one up again, which may split pages on the way,
+   checking that an index still valid is right. */
+void test_sorted_pages (int n)
+{
+  Dict *d = dict_new_with_buckets (NULL, DICT_BUCKETS_PAGES);
+  DictSorted *s;
+  char key[32];
+  bool added;
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      sprintf (key, "k%06d", i);
+      dict_set (d, key, NULL);
+    }
+  s = dict_sorted_iter (d);
+  dict_sorted_entry (s, 0);
+  for (i = 0; i < n; i++)
+    {
+      sprintf (key, "k%06d", i);
+      dict_find_or_add (d, key, &added);
+    }
+  if (dict_sorted_valid (s))
+    for (i = 0; i < n; i++)
+      {
+        sprintf (key, "k%06d", i);
+        if (strcmp (dict_sorted_entry (s, i)->key, key))
+          {
+            printf ("Check fail: '%s' sorted at %d, should be '%s'\n",
+                    (char *) dict_sorted_entry (s, i)->key, i, key);
+            fail = true;
+            break;
+          }
+      }
+  printf ("Kept an index of %d paged entries while looking them up\n", n);
+  dict_sorted_free (s);
+  dict_free (d);
+}
 
 Dict *test_commands(Dict *d, FILE *in)
 {
@@ -101,7 +386,8 @@ Dict *test_commands(Dict *d, FILE *in)
             break;
           if (fscanf (in, "%s", buffer2) != 1)
             break;
-          if (dict_has_key (d, buffer))
+          /* Snapshot readers may still see an old value. */
+          if (!versioned && dict_has_key (d, buffer))
             free (dict_get (d, buffer));
           dict_set (d, buffer, strdup (buffer2));
         }
@@ -151,11 +437,19 @@ Dict *test_commands(Dict *d, FILE *in)
       else if (!strcmp (buffer, "check"))
         {
           char *res;
+          DictKey key;
           if (fscanf (in, "%s", buffer) != 1)
             break;
           if (fscanf (in, "%s", buffer2) != 1)
             break;
           res = dict_get (d, buffer);
+          key = dict_key (NULL, buffer);
+          if (dict_get_hashed (d, &key) != res)
+            {
+              printf ("Check fail: '%s' differs when looked up by handle\n",
+                      buffer);
+              fail = true;
+            }
           if (!res || strcmp (buffer2, res))
             {
               if (res)
@@ -185,10 +479,17 @@ Dict *test_commands(Dict *d, FILE *in)
           updated = 1;
           if (fscanf (in, "%s", buffer) != 1)
             break;
-          if (dict_has_key (d, buffer))
+          if (!versioned && dict_has_key (d, buffer))
             free (dict_get (d, buffer));
           dict_delete (d, buffer);
         }
+      else if (!strcmp (buffer, "delete_if"))
+        {
+          updated = 1;
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          printf ("Deleted %u entries\n", dict_delete_if (d, value_is, buffer));
+        }
       else if (!strcmp (buffer, "exit") || !strcmp (buffer, "quit"))
         {
           printf ("Exiting\n");
@@ -202,8 +503,189 @@ Dict *test_commands(Dict *d, FILE *in)
             free (de->value);
           dict_free (d);
           d = dict_new (NULL);
+          versioned = false;
           printf ("Cleared dictionary\n");
         }
+      else if (!strcmp (buffer, "versioned"))
+        {
+          DictEntry *de;
+          updated = 1;
+          for (de = dict_first (d); de; de = dict_next (d, de))
+            free (de->value);
+          dict_free (d);
+          d = dict_new_versioned (NULL);
+          versioned = true;
+          printf ("Cleared dictionary, now versioned\n");
+        }
+      else if (!strcmp (buffer, "cache"))
+        {
+          DictEntry *de;
+          updated = 1;
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          for (de = dict_first (d); de; de = dict_next (d, de))
+            free (de->value);
+          dict_free (d);
+          d = dict_new_cache (NULL, atoi (buffer), 0, evict_value, NULL);
+          versioned = false;
+          printf ("Cleared dictionary, now a cache of %d entries\n",
+                  atoi (buffer));
+        }
+      else if (!strcmp (buffer, "cache_bytes"))
+        {
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          if (fscanf (in, "%s", buffer2) != 1)
+            break;
+          test_cache_bytes (atol (buffer), atoi (buffer2));
+        }
+      else if (!strcmp (buffer, "cache_set_ops"))
+        {
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          test_cache_set_ops (atoi (buffer));
+        }
+      else if (!strcmp (buffer, "strarena"))
+        {
+          DictEntry *de;
+          updated = 1;
+          for (de = dict_first (d); de; de = dict_next (d, de))
+            free (de->value);
+          dict_free (d);
+          d = dict_new_strarena ();
+          versioned = false;
+          printf ("Cleared dictionary, now keeping keys in an arena\n");
+        }
+      else if (!strcmp (buffer, "pages"))
+        {
+          DictEntry *de;
+          updated = 1;
+          for (de = dict_first (d); de; de = dict_next (d, de))
+            free (de->value);
+          dict_free (d);
+          d = dict_new_with_buckets (NULL, DICT_BUCKETS_PAGES);
+          versioned = false;
+          printf ("Cleared dictionary, now with paged buckets\n");
+        }
+      else if (!strcmp (buffer, "lists"))
+        {
+          DictEntry *de;
+          updated = 1;
+          for (de = dict_first (d); de; de = dict_next (d, de))
+            free (de->value);
+          dict_free (d);
+          d = dict_new_with_buckets (NULL, DICT_BUCKETS_LIST);
+          versioned = false;
+          printf ("Cleared dictionary, now with list buckets\n");
+        }
+      else if (!strcmp (buffer, "adaptive"))
+        {
+          DictEntry *de;
+          updated = 1;
+          for (de = dict_first (d); de; de = dict_next (d, de))
+            free (de->value);
+          dict_free (d);
+          d = dict_new_with_buckets (NULL, DICT_BUCKETS_ADAPTIVE);
+          versioned = false;
+          printf ("Cleared dictionary, now with adaptive buckets\n");
+        }
+      else if (!strcmp (buffer, "ordered"))
+        {
+          DictEntry *de;
+          updated = 1;
+          for (de = dict_first (d); de; de = dict_next (d, de))
+            free (de->value);
+          dict_free (d);
+          d = dict_new_with_buckets (NULL, DICT_BUCKETS_ORDERED);
+          versioned = false;
+          printf ("Cleared dictionary, now with ordered buckets\n");
+        }
+      else if (!strcmp (buffer, "radix"))
+        {
+          DictEntry *de;
+          updated = 1;
+          for (de = dict_first (d); de; de = dict_next (d, de))
+            free (de->value);
+          dict_free (d);
+          d = dict_new_radix ();
+          versioned = false;
+          printf ("Cleared dictionary, now a radix tree\n");
+        }
+      else if (!strcmp (buffer, "prefix"))
+        {
+          DictEntry *de;
+          int count = 0;
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          for (de = dict_prefix_first (d, buffer); de; de = dict_next (d, de))
+            {
+              printf ("'%s' -> '%s'\n", (char *) de->key, (char *) de->value);
+              count++;
+            }
+          printf ("count=%d\n", count);
+        }
+      else if (!strcmp (buffer, "compact"))
+        {
+          updated = 1;
+          dict_compact_keys (d);
+        }
+      else if (!strcmp (buffer, "stats"))
+        {
+          DictStats stats;
+          dict_get_stats (d, &stats);
+          printf ("entries=%u slots=%u bytes=%zu dead_key_bytes=%u "
+                  "hits=%lu misses=%lu evictions=%lu\n",
+                  stats.n_entries, stats.n_slots, stats.allocated_bytes,
+                  stats.dead_key_bytes, stats.hits, stats.misses,
+                  stats.evictions);
+        }
+      else if (!strcmp (buffer, "publish"))
+        {
+          if (!dict_publish (d))
+            printf ("Publish deferred\n");
+        }
+      else if (!strcmp (buffer, "publishes"))
+        {
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          test_publishes (atoi (buffer));
+        }
+      else if (!strcmp (buffer, "snapshot"))
+        {
+          if (snapshot)
+            dict_snapshot_release (d, snapshot);
+          snapshot = dict_snapshot_acquire (d);
+          printf ("Snapshot of %u entries\n",
+                  dict_snapshot_n_entries (snapshot));
+        }
+      else if (!strcmp (buffer, "release"))
+        {
+          if (snapshot)
+            dict_snapshot_release (d, snapshot);
+          snapshot = NULL;
+        }
+      else if (!strcmp (buffer, "scheck") || !strcmp (buffer, "schecknull"))
+        {
+          char *res;
+          bool null = !strcmp (buffer, "schecknull");
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          if (!null && fscanf (in, "%s", buffer2) != 1)
+            break;
+          if (!snapshot)
+            {
+              printf ("No snapshot\n");
+              fail = true;
+              continue;
+            }
+          res = dict_snapshot_get (snapshot, buffer);
+          if (null ? res != NULL : (!res || strcmp (buffer2, res)))
+            {
+              printf ("Snapshot check fail: '%s' => '%s', should be '%s'\n",
+                      buffer, res ? res : "NULL", null ? "NULL" : buffer2);
+              fail = true;
+            }
+        }
       else if (!strcmp (buffer, "list"))
         {
           DictEntry *de;
@@ -215,6 +697,72 @@ Dict *test_commands(Dict *d, FILE *in)
             }
           printf ("count=%d\n", count);
         }
+      else if (!strcmp (buffer, "clone"))
+        {
+          Dict *copy;
+          if (versioned)
+            {
+              printf ("Can't clone a versioned dictionary\n");
+              continue;
+            }
+          updated = 1;
+          copy = dict_clone (d);
+          dict_free (d);
+          d = copy;
+          printf ("Replaced dictionary with a clone of %u entries\n",
+                  dict_n_entries (d));
+        }
+      else if (!strcmp (buffer, "defragment"))
+        {
+          if (versioned)
+            {
+              printf ("Can't defragment a versioned dictionary\n");
+              continue;
+            }
+          updated = 1;
+          dict_defragment (d);
+        }
+      else if (!strcmp (buffer, "sorted"))
+        {
+          DictSorted *sorted;
+          DictEntry *de;
+          unsigned int i, n;
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          n = atoi (buffer);
+          sorted = dict_sorted_iter (d);
+          for (i = 0; (!n || i < n) && (de = dict_sorted_entry (sorted, i));
+               i++)
+            printf ("'%s' -> '%s'\n", (char *) de->key, (char *) de->value);
+          printf ("count=%u\n", i);
+          dict_sorted_free (sorted);
+        }
+      else if (!strcmp (buffer, "sorted_kept"))
+        {
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          test_sorted_kept (atoi (buffer));
+        }
+      else if (!strcmp (buffer, "sorted_pages"))
+        {
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          test_sorted_pages (atoi (buffer));
+        }
+      else if (!strcmp (buffer, "scan"))
+        {
+          unsigned int cursor = 0, n, count = 0;
+          if (fscanf (in, "%s", buffer) != 1)
+            break;
+          n = atoi (buffer);
+          do
+            {
+              cursor = dict_scan (d, cursor, n, print_entry, &count);
+              printf ("cursor=%u\n", cursor);
+            }
+          while (cursor);
+          printf ("count=%u\n", count);
+        }
       else if (!strcmp (buffer, "rehash"))
         {
           updated = 1;
@@ -377,9 +925,16 @@ Dict *test_commands(Dict *d, FILE *in)
                   "    check <key> <value>\t// check that dictionary has key-value pair\n"
                   "    checknull <key> <value>\t// check that key has no value\n"
                   "    delete <key>\t// delete entry associated with a key\n"
+                  "    delete_if <value>\t// delete every entry with a value\n"
                   "    exit\n"
                   "    free\t// free and reallocate dictionary\n"
                   "    list\t// list contents of dictionary\n"
+                  "    clone\t// replace dictionary with a clone of itself\n"
+                  "    defragment\t// lay out each bucket's nodes together\n"
+                  "    sorted <n>\t// list the first n entries in key order (0 for all)\n"
+                  "    sorted_kept <n>\t// check an index kept while adding n entries\n"
+                  "    sorted_pages <n>\t// check an index kept while looking up n paged entries\n"
+                  "    scan <n>\t// list entries with a cursor, n at a time\n"
                   "    rehash <n>\t// rehash dictionary with n buckets (must be power of 2)\n"
                   "    decode (one|two|three|*)\t// test decoding\n"
                   "    verbose\n"
@@ -392,7 +947,26 @@ Dict *test_commands(Dict *d, FILE *in)
                   "    lock_rehash <true|false> \tdisable or enable rehashing\n"
                   "    lock_rebalance <true|false> \tdisable or enable tree rebalancing\n"
                   "    lock <rehash|rebalance>\t disable rehashing or rebalancing\n"
-                  "    unlock <rehash|rebalance>\t enable rehashing or rebalancing\n");
+                  "    unlock <rehash|rebalance>\t enable rehashing or rebalancing\n"
+                  "    cache <n>\t// replace dictionary with an empty cache of n entries\n"
+                  "    cache_bytes <bytes> <n>\t// check setting n entries in a cache of the given size\n"
+                  "    cache_set_ops <n>\t// check set operations on a cache of n entries\n"
+                  "    strarena\t// replace dictionary with an empty string arena one\n"
+                  "    pages\t// replace dictionary with an empty paged buckets one\n"
+                  "    lists\t// replace dictionary with an empty list buckets one\n"
+                  "    adaptive\t// replace dictionary with an empty adaptive buckets one\n"
+                  "    ordered\t// replace dictionary with an empty ordered buckets one\n"
+                  "    radix\t// replace dictionary with an empty radix tree one\n"
+                  "    prefix <p>\t// list entries whose keys start with p (radix only)\n"
+                  "    compact\t// compact string arena keys\n"
+                  "    stats\t// show dictionary statistics\n"
+                  "    versioned\t// replace dictionary with an empty versioned one\n"
+                  "    publish\t// publish changes to a versioned dictionary\n"
+                  "    publishes <n>\t// check a versioned dictionary published n times frees everything\n"
+                  "    snapshot\t// acquire the latest published snapshot\n"
+                  "    release\t// release the snapshot\n"
+                  "    scheck <key> <value>\t// check key-value pair in the snapshot\n"
+                  "    schecknull <key>\t// check key has no value in the snapshot\n");
         }
       else
         {
@@ -0,0 +1,246 @@
+/* Test shared memory dictionaries: while a writer inserts, replaces
+ * and deletes entries, forked readers attach to the dictionary by
+ * name and check every lookup.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "dictshm.h"
+
+extern void dict_shm_lock_TEST (DictShm *s);
+extern void dict_shm_grow_TEST (DictShm *s, unsigned n);
+
+#define N_READERS 4
+#define N_KEYS 200000
+
+struct value
+{
+  int i;
+  int version;
+};
+
+static int failures;
+
+static void
+fail (const char *what, int i)
+{
+  fprintf (stderr, "FAIL (pid %d): %s %d\n", (int) getpid (), what, i);
+  failures++;
+}
+
+static const struct value *
+get (DictShm *s, int i)
+{
+  char key[32];
+  size_t size;
+  const struct value *v;
+  sprintf (key, "key%d", i);
+  v = dict_shm_get (s, key, &size);
+  if (v && (size != sizeof *v || v->i != i || v->version < 0
+            || v->version > 1))
+    fail ("wrong value for key", i);
+  return v;
+}
+
+/* Keys below "count" have been added, even ones are never deleted and
+   once "done" is set the odd ones are all gone. */
+static int
+reader (const char *name)
+{
+  DictShm *s = dict_shm_open (name, false);
+  int i, rounds = 0;
+  if (!s)
+    {
+      perror (name);
+      return 1;
+    }
+  for (;;)
+    {
+      int done = dict_shm_get (s, "done", NULL) != NULL;
+      const int *count = dict_shm_get (s, "count", NULL);
+      int n = count ? *count : 0;
+      for (i = 0; i < 1000 && n; i++)
+        {
+          int k = rand () % n;
+          if (!get (s, k) && !(k & 1))
+            fail ("missing key", k);
+        }
+      rounds++;
+      if (done)
+        break;
+    }
+  for (i = 0; i < N_KEYS; i++)
+    if ((get (s, i) != NULL) != !(i & 1))
+      fail ("final state wrong for key", i);
+  if (dict_shm_n_entries (s) != N_KEYS / 2 + 2)
+    fail ("wrong number of entries", dict_shm_n_entries (s));
+  printf ("reader %d: %d rounds\n", (int) getpid (), rounds);
+  dict_shm_close (s);
+  return failures != 0;
+}
+
+static void
+writer (DictShm *s)
+{
+  char key[32];
+  int i, version;
+  for (version = 0; version < 2; version++)
+    for (i = 0; i < N_KEYS; i++)
+      {
+        struct value v = { i, version };
+        sprintf (key, "key%d", i);
+        if (!dict_shm_set (s, key, &v, sizeof v))
+          fail ("region full at key", i);
+        if (version == 0 && (i + 1) % 1000 == 0)
+          {
+            int count = i + 1;
+            dict_shm_set (s, "count", &count, sizeof count);
+          }
+      }
+  for (i = 1; i < N_KEYS; i += 2)
+    {
+      sprintf (key, "key%d", i);
+      if (!dict_shm_delete (s, key))
+        fail ("couldn't delete key", i);
+    }
+  dict_shm_set (s, "done", "", 1);
+}
+
+/* A small region fills up, keeping what it has. */
+static void
+test_full (void)
+{
+  DictShm *s = dict_shm_create (NULL, 8192);
+  char key[32];
+  int i, n;
+  for (n = 0;; n++)
+    {
+      sprintf (key, "%d", n);
+      if (!dict_shm_set (s, key, &n, sizeof n))
+        break;
+    }
+  if (errno != ENOSPC)
+    fail ("full region didn't set ENOSPC, errno", errno);
+  if (n == 0 || dict_shm_n_entries (s) != n)
+    fail ("wrong number of entries in full region", n);
+  for (i = 0; i < n; i++)
+    {
+      const int *v;
+      sprintf (key, "%d", i);
+      v = dict_shm_get (s, key, NULL);
+      if (!v || *v != i)
+        fail ("lost key in full region", i);
+    }
+  dict_shm_close (s);
+}
+
+/* Run TEST_HOOK in a child that then exits holding the writer's lock. */
+static void
+die_writing (DictShm *s, void (*test_hook) (DictShm *))
+{
+  int status;
+  if (fork () == 0)
+    {
+      test_hook (s);
+      _exit (0);
+    }
+  wait (&status);
+}
+
+static void
+die_locked (DictShm *s)
+{
+  dict_shm_lock_TEST (s);
+}
+
+/* 50 nodes into doubling 64 slots */
+static void
+die_growing (DictShm *s)
+{
+  dict_shm_grow_TEST (s, 50);
+}
+
+/* Writers that die holding the lock don't stop the next one, nor lose
+   any entries. */
+static void
+test_dead_writer (void)
+{
+  DictShm *s = dict_shm_create (NULL, 1 << 20);
+  char key[32];
+  int i, n = 60;
+  alarm (10);
+  for (i = 0; i < n; i++)
+    {
+      sprintf (key, "%d", i);
+      dict_shm_set (s, key, &i, sizeof i);
+    }
+  die_writing (s, die_locked);
+  sprintf (key, "%d", n);
+  if (!dict_shm_set (s, key, &n, sizeof n))
+    fail ("couldn't set after writer died, key", n);
+  n++;
+  die_writing (s, die_growing);
+  sprintf (key, "%d", n);
+  if (!dict_shm_set (s, key, &n, sizeof n))
+    fail ("couldn't set after writer died growing, key", n);
+  n++;
+  if (dict_shm_n_entries (s) != n)
+    fail ("wrong number of entries after writer died", dict_shm_n_entries (s));
+  for (i = 0; i < n; i++)
+    {
+      const int *v;
+      sprintf (key, "%d", i);
+      v = dict_shm_get (s, key, NULL);
+      if (!v || *v != i)
+        fail ("lost key after writer died", i);
+    }
+  alarm (0);
+  dict_shm_close (s);
+}
+
+int
+main (int argc, char *argv[])
+{
+  char name[64];
+  DictShm *s;
+  int i, status;
+  sprintf (name, "/test_dictshm.%d", (int) getpid ());
+  s = dict_shm_create (name, 64 << 20);
+  if (!s)
+    {
+      perror (name);
+      return EXIT_FAILURE;
+    }
+  for (i = 0; i < N_READERS; i++)
+    if (fork () == 0)
+      {
+        /* Attach afresh, as an unrelated process would */
+        dict_shm_close (s);
+        srand (i);
+        exit (reader (name));
+      }
+  writer (s);
+  for (i = 0; i < N_READERS; i++)
+    {
+      wait (&status);
+      if (!WIFEXITED (status) || WEXITSTATUS (status))
+        failures++;
+    }
+  printf ("%u entries, %zu bytes unused\n", dict_shm_n_entries (s),
+          dict_shm_unused_bytes (s));
+  dict_shm_close (s);
+  dict_shm_unlink (name);
+  test_full ();
+  test_dead_writer ();
+  if (failures)
+    {
+      printf ("FAILED\n");
+      return EXIT_FAILURE;
+    }
+  printf ("PASSED\n");
+  return 0;
+}
@@ -4,24 +4,777 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <strings.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "dict.h"
 
+/* Input is read in blocks of at least this size, and output buffered
+   likewise. */
+#define BLOCK_SIZE (1 << 20)
+
+/* Shards are numbered in a byte. */
+#define MAX_JOBS 256
+
+/* Over the memory limit, lines are spilled to this many partitions
+   by 4 bits of their hash, and so partitions of partitions up to 8
+   deep. */
+#define N_PARTS 16
+#define MAX_DEPTH 8
+
+/* Below this, the string arena's first chunk would be over the limit. */
+#define MIN_MEMORY_LIMIT (1 << 20)
+
 static int show_counts = 0;
 static int show_dot = 0;
 static int show_dump = 0;
+static size_t memory_limit = 0;
 
+/* Values are the counts themselves. */
 void dot_count (FILE *out, const void *key, void *value)
 {
-  fprintf (out, "%s: %d", (const char *)key, *(int *)value);
+  fprintf (out, "%s: %d", (const char *)key, (int)(intptr_t)value);
 }
 
-int main (int argc, char *argv[])
+typedef struct Spill Spill;
+static Spill *spill_new (int depth);
+static void spill_line (Spill *s, const DictKey *key, uint64_t seq);
+
+/* Lines not already counted once over the memory limit */
+static Spill *spill;
+static uint64_t n_lines;
+
+/* Count the line from LINE to its newline at END, which is overwritten
+   to end the key, echoing the line if it is new. The key is only
+   copied if it is new. */
+static void
+add_line (Dict *lines, char *line, char *end)
+{
+  DictKey key;
+  DictEntry *de;
+  bool added;
+  *end = '\0';
+  key = dict_key (&staticstrkeyfuncs, line);
+  if (spill)
+    {
+      de = dict_get_entry_hashed (lines, &key);
+      if (!de)
+        spill_line (spill, &key, n_lines);
+      added = false;
+    }
+  else
+    de = dict_find_or_add_hashed (lines, &key, &added);
+  *end = '\n';
+  n_lines++;
+  if (!de)
+    return;
+  if (added)
+    {
+      fwrite (line, 1, end - line + 1, stdout);
+      if (memory_limit && dict_allocated_bytes (lines) > memory_limit)
+        spill = spill_new (0);
+    }
+  de->value = (void *)((intptr_t)de->value + 1);
+}
+
+static void
+add_lines (char *start, char *end, void *cl)
+{
+  char *line, *nl;
+  for (line = start; line < end; line = nl + 1)
+    {
+      nl = memchr (line, '\n', end - line);
+      add_line (cl, line, nl);
+    }
+}
+
+/* Call FN for each block of whole lines read from FD, from START up
+   to END, just after the last newline. The block is big enough for
+   the longest line, and writable. A last line without a newline is
+   given one. */
+static void
+read_blocks (int fd, size_t size,
+             void (*fn) (char *start, char *end, void *cl), void *cl)
+{
+  size_t used = 0;
+  char *buffer = malloc (size + 1);
+  for (;;)
+    {
+      char *from = buffer + used, *last;
+      ssize_t n = read (fd, from, size - used);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          perror ("guniq: read");
+          exit (EXIT_FAILURE);
+        }
+      if (n == 0)
+        break;
+      used += n;
+      /* Search only the new data for the end of the last line. */
+      for (last = buffer + used; last > from && last[-1] != '\n'; last--)
+        ;
+      if (last > from)
+        {
+          fn (buffer, last, cl);
+          used -= last - buffer;
+          memmove (buffer, last, used);
+        }
+      else if (used == size)
+        {
+          size *= 2;
+          buffer = realloc (buffer, size + 1);
+        }
+    }
+  if (used)
+    {
+      buffer[used] = '\n';
+      fn (buffer, buffer + used + 1, cl);
+    }
+  free (buffer);
+}
+
+/* Over the memory limit, lines already counted go on being counted,
+   and the others are written with their line numbers to partition
+   files by hash. Each of those lines was first seen after every line
+   counted in memory, so the partitions are deduplicated one at a time
+   (spilling again if need be) and the results merged by line number
+   to follow on from the lines counted in memory. */
+struct Spill
+{
+  int depth;
+  FILE *parts[N_PARTS];
+};
+
+/* A line spilled (COUNT 0), or distinct with its count */
+typedef struct Record Record;
+struct Record
+{
+  uint64_t seq;
+  uint64_t count;
+  uint32_t len;
+  char *line;
+  size_t size;
+};
+
+static FILE *
+temp_file (void)
+{
+  FILE *f = tmpfile ();
+  if (!f)
+    {
+      perror ("guniq: tmpfile");
+      exit (EXIT_FAILURE);
+    }
+  return f;
+}
+
+static void
+write_record (FILE *f, uint64_t seq, uint64_t count, const char *line,
+              uint32_t len)
+{
+  if (fwrite (&seq, sizeof seq, 1, f) != 1
+      || (count && fwrite (&count, sizeof count, 1, f) != 1)
+      || fwrite (&len, sizeof len, 1, f) != 1
+      || fwrite (line, 1, len, f) != len)
+    {
+      perror ("guniq: write");
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Read the next record of F, with a count if COUNTED. */
+static bool
+read_record (FILE *f, Record *r, bool counted)
+{
+  if (fread (&r->seq, sizeof r->seq, 1, f) != 1)
+    return false;
+  if ((counted && fread (&r->count, sizeof r->count, 1, f) != 1)
+      || fread (&r->len, sizeof r->len, 1, f) != 1)
+    goto truncated;
+  if (r->len + 1 > r->size)
+    {
+      r->size = r->len + 1;
+      r->line = realloc (r->line, r->size);
+    }
+  if (fread (r->line, 1, r->len, f) != r->len)
+    goto truncated;
+  r->line[r->len] = '\0';
+  return true;
+ truncated:
+  fprintf (stderr, "guniq: temporary file truncated\n");
+  exit (EXIT_FAILURE);
+}
+
+static Spill *
+spill_new (int depth)
+{
+  Spill *s = malloc (sizeof *s);
+  int i;
+  s->depth = depth;
+  for (i = 0; i < N_PARTS; i++)
+    s->parts[i] = temp_file ();
+  return s;
+}
+
+static void
+spill_line (Spill *s, const DictKey *key, uint64_t seq)
 {
-  Dict *lines = dict_new (NULL);
+  unsigned part = (key->hash >> (4 * s->depth)) % N_PARTS;
+  write_record (s->parts[part], seq, 0, key->key, key->len);
+}
+
+static FILE *spill_finish (Spill *s);
+
+/* The distinct lines of the partition IN, with their counts, in order
+   of first appearance. */
+static FILE *
+dedupe_part (FILE *in, int depth)
+{
+  Dict *lines = dict_new_strarena_with_buckets (DICT_BUCKETS_ORDERED);
+  Spill *s = NULL;
+  Record r = { 0 };
   DictEntry *de;
+  FILE *out = temp_file ();
+  /* Each distinct line's first line number and count, by value */
+  uint64_t *seqs = NULL, *counts = NULL;
+  size_t n = 0, size = 0;
+  while (read_record (in, &r, false))
+    {
+      DictKey key = dict_key (&staticstrkeyfuncs, r.line);
+      bool added;
+      if (s)
+        {
+          de = dict_get_entry_hashed (lines, &key);
+          if (!de)
+            {
+              spill_line (s, &key, r.seq);
+              continue;
+            }
+        }
+      else if ((de = dict_find_or_add_hashed (lines, &key, &added)), added)
+        {
+          if (n == size)
+            {
+              size = size ? 2 * size : 4096;
+              seqs = realloc (seqs, size * sizeof *seqs);
+              counts = realloc (counts, size * sizeof *counts);
+            }
+          de->value = (void *)(intptr_t)n;
+          seqs[n] = r.seq;
+          counts[n++] = 0;
+          if (depth < MAX_DEPTH
+              && (dict_allocated_bytes (lines) + size * 2 * sizeof *seqs
+                  > memory_limit))
+            s = spill_new (depth);
+        }
+      counts[(intptr_t)de->value]++;
+    }
+  for (de = dict_first (lines); de; de = dict_next (lines, de))
+    write_record (out, seqs[(intptr_t)de->value], counts[(intptr_t)de->value],
+                  de->key, strlen (de->key));
+  dict_free (lines);
+  free (seqs);
+  free (counts);
+  if (s)
+    {
+      FILE *rest = spill_finish (s);
+      while (read_record (rest, &r, true))
+        write_record (out, r.seq, r.count, r.line, r.len);
+      fclose (rest);
+    }
+  free (r.line);
+  rewind (out);
+  return out;
+}
+
+/* Merge the deduplicated partitions, in order of first appearance. */
+static FILE *
+spill_finish (Spill *s)
+{
+  FILE *out = temp_file (), *parts[N_PARTS];
+  Record r[N_PARTS];
+  int heap[N_PARTS], n = 0, i;
+  memset (r, 0, sizeof r);
+  for (i = 0; i < N_PARTS; i++)
+    {
+      rewind (s->parts[i]);
+      parts[i] = dedupe_part (s->parts[i], s->depth + 1);
+      fclose (s->parts[i]);
+    }
+  free (s);
+  /* A heap of the partitions by their next line number */
+  for (i = 0; i < N_PARTS; i++)
+    if (read_record (parts[i], &r[i], true))
+      {
+        int j = n++;
+        for (; j > 0 && r[heap[(j - 1) / 2]].seq > r[i].seq; j = (j - 1) / 2)
+          heap[j] = heap[(j - 1) / 2];
+        heap[j] = i;
+      }
+  while (n)
+    {
+      int top = heap[0], j = 0, moved;
+      write_record (out, r[top].seq, r[top].count, r[top].line, r[top].len);
+      if (!read_record (parts[top], &r[top], true))
+        top = heap[--n];
+      /* Sift TOP down from the root */
+      for (;;)
+        {
+          int child = 2 * j + 1;
+          if (child >= n)
+            break;
+          if (child + 1 < n && r[heap[child + 1]].seq < r[heap[child]].seq)
+            child++;
+          if (r[heap[child]].seq >= r[top].seq)
+            break;
+          moved = heap[child];
+          heap[j] = moved;
+          j = child;
+        }
+      if (n)
+        heap[j] = top;
+    }
+  for (i = 0; i < N_PARTS; i++)
+    {
+      fclose (parts[i]);
+      free (r[i].line);
+    }
+  rewind (out);
+  return out;
+}
+
+/* With -j, the lines are divided among shards by hash, each with its
+   own dictionary and worker thread. The workers hash a block's lines
+   in parallel, then each counts its shard's lines in input order, so
+   that the first occurrence of each line is the one found new. The
+   lines found new are echoed in order, and (for -c) their shards
+   noted, as the order of each shard's dictionary is that of the input
+   and so the shards can be merged back into it. */
+typedef struct Jobs Jobs;
+struct Jobs
+{
+  unsigned n_jobs;
+  Dict **shards;
+  pthread_barrier_t barrier;
+  bool done;
+  /* The lines of the current block */
+  size_t n_lines, size;
+  DictKey *keys;
+  unsigned char *shard_of;
+  bool *added;
+  /* The shard of each distinct line, in order */
+  size_t n_firsts, firsts_size;
+  unsigned char *firsts;
+};
+
+typedef struct Job Job;
+struct Job
+{
+  Jobs *jobs;
+  unsigned i;
+};
+
+static void
+job_run (Jobs *jobs, unsigned i)
+{
+  size_t j, lo = jobs->n_lines * i / jobs->n_jobs;
+  size_t hi = jobs->n_lines * (i + 1) / jobs->n_jobs;
+  Dict *shard = jobs->shards[i];
+  for (j = lo; j < hi; j++)
+    {
+      jobs->keys[j] = dict_key (&staticstrkeyfuncs, jobs->keys[j].key);
+      jobs->shard_of[j] = jobs->keys[j].hash % jobs->n_jobs;
+    }
+  pthread_barrier_wait (&jobs->barrier);
+  for (j = 0; j < jobs->n_lines; j++)
+    if (jobs->shard_of[j] == i)
+      {
+        DictEntry *de = dict_find_or_add_hashed (shard, &jobs->keys[j],
+                                                 &jobs->added[j]);
+        de->value = (void *)((intptr_t)de->value + 1);
+      }
+}
+
+static void *
+job_thread (void *cl)
+{
+  Job *job = cl;
+  Jobs *jobs = job->jobs;
+  for (;;)
+    {
+      pthread_barrier_wait (&jobs->barrier);
+      if (jobs->done)
+        return NULL;
+      job_run (jobs, job->i);
+      pthread_barrier_wait (&jobs->barrier);
+    }
+}
+
+/* Count a block of lines, as job 0. */
+static void
+add_lines_jobs (char *start, char *end, void *cl)
+{
+  Jobs *jobs = cl;
+  char *line, *nl;
+  size_t j;
+  jobs->n_lines = 0;
+  for (line = start; line < end; line = nl + 1)
+    {
+      nl = memchr (line, '\n', end - line);
+      *nl = '\0';
+      if (jobs->n_lines == jobs->size)
+        {
+          jobs->size = jobs->size ? 2 * jobs->size : 4096;
+          jobs->keys = realloc (jobs->keys, jobs->size * sizeof *jobs->keys);
+          jobs->shard_of = realloc (jobs->shard_of, jobs->size);
+          jobs->added = realloc (jobs->added,
+                                 jobs->size * sizeof *jobs->added);
+        }
+      jobs->keys[jobs->n_lines++].key = line;
+    }
+  pthread_barrier_wait (&jobs->barrier);
+  job_run (jobs, 0);
+  pthread_barrier_wait (&jobs->barrier);
+  for (j = 0; j < jobs->n_lines; j++)
+    {
+      char *key = (char *)jobs->keys[j].key;
+      key[jobs->keys[j].len] = '\n';
+      if (!jobs->added[j])
+        continue;
+      fwrite (key, 1, jobs->keys[j].len + 1, stdout);
+      if (!show_counts)
+        continue;
+      if (jobs->n_firsts == jobs->firsts_size)
+        {
+          jobs->firsts_size = (jobs->firsts_size
+                               ? 2 * jobs->firsts_size : 4096);
+          jobs->firsts = realloc (jobs->firsts, jobs->firsts_size);
+        }
+      jobs->firsts[jobs->n_firsts++] = jobs->shard_of[j];
+    }
+}
+
+static void
+guniq_jobs (unsigned n_jobs)
+{
+  Jobs jobs;
+  Job *job = malloc (n_jobs * sizeof *job);
+  pthread_t *threads = malloc (n_jobs * sizeof *threads);
+  DictEntry **next;
+  size_t j;
+  unsigned i;
+  memset (&jobs, 0, sizeof jobs);
+  jobs.n_jobs = n_jobs;
+  jobs.shards = malloc (n_jobs * sizeof *jobs.shards);
+  pthread_barrier_init (&jobs.barrier, NULL, n_jobs);
+  for (i = 0; i < n_jobs; i++)
+    {
+      jobs.shards[i] = dict_new_strarena_with_buckets (DICT_BUCKETS_ORDERED);
+      job[i].jobs = &jobs;
+      job[i].i = i;
+      if (i > 0)
+        pthread_create (&threads[i], NULL, job_thread, &job[i]);
+    }
+  read_blocks (STDIN_FILENO, (size_t)BLOCK_SIZE * n_jobs, add_lines_jobs,
+               &jobs);
+  jobs.done = true;
+  pthread_barrier_wait (&jobs.barrier);
+  for (i = 1; i < n_jobs; i++)
+    pthread_join (threads[i], NULL);
+  if (show_counts)
+    {
+      next = malloc (n_jobs * sizeof *next);
+      for (i = 0; i < n_jobs; i++)
+        next[i] = dict_first (jobs.shards[i]);
+      for (j = 0; j < jobs.n_firsts; j++)
+        {
+          DictEntry *de = next[jobs.firsts[j]];
+          fprintf (stdout, "%10d %s\n",
+                   (int)(intptr_t)de->value, (const char *)de->key);
+          next[jobs.firsts[j]] = dict_next (jobs.shards[jobs.firsts[j]], de);
+        }
+      free (next);
+    }
+  for (i = 0; i < n_jobs; i++)
+    {
+      if (show_dot)
+        dict_dump_dot (jobs.shards[i], stdout, dot_count);
+      if (show_dump)
+        dict_dump (jobs.shards[i], stdout, dot_count);
+      dict_free (jobs.shards[i]);
+    }
+  pthread_barrier_destroy (&jobs.barrier);
+  free (jobs.shards);
+  free (jobs.keys);
+  free (jobs.shard_of);
+  free (jobs.added);
+  free (jobs.firsts);
+  free (threads);
+  free (job);
+}
+
+/* --approx-distinct estimates the number of distinct lines with a
+   HyperLogLog of 2^P one-byte registers: the top P bits of a line's
+   64-bit hash pick a register, which keeps the most leading zeros
+   (plus one) seen in the rest of the hash. */
+typedef struct Hll Hll;
+struct Hll
+{
+  int p;
+  unsigned char *registers;
+};
+
+static void
+hll_add_lines (char *start, char *end, void *cl)
+{
+  Hll *hll = cl;
+  char *line, *nl;
+  for (line = start; line < end; line = nl + 1)
+    {
+      unsigned long long hash, rest;
+      unsigned char rank;
+      nl = memchr (line, '\n', end - line);
+      *nl = '\0';
+      hash = dict_strhash_seeded (line, 0);
+      rest = hash << hll->p;
+      rank = rest ? __builtin_clzll (rest) + 1 : 64 - hll->p + 1;
+      if (rank > hll->registers[hash >> (64 - hll->p)])
+        hll->registers[hash >> (64 - hll->p)] = rank;
+    }
+}
+
+/* The estimate, counting empty registers while there are enough of
+   them, after Flajolet et al. With 64-bit hashes, large cardinalities
+   need no correction. */
+static double
+hll_estimate (Hll *hll)
+{
+  unsigned j, m = 1u << hll->p, zeros = 0;
+  double sum = 0, alpha, e;
+  for (j = 0; j < m; j++)
+    {
+      sum += ldexp (1, -hll->registers[j]);
+      zeros += !hll->registers[j];
+    }
+  alpha = (m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709
+           : 0.7213 / (1 + 1.079 / m));
+  e = alpha * m * m / sum;
+  if (e <= 2.5 * m && zeros)
+    e = m * log ((double)m / zeros);
+  return e;
+}
+
+static void
+approx_distinct (int p)
+{
+  Hll hll;
+  hll.p = p;
+  hll.registers = calloc (1, 1u << p);
+  read_blocks (STDIN_FILENO, BLOCK_SIZE, hll_add_lines, &hll);
+  fprintf (stdout, "%.0f\n", hll_estimate (&hll));
+  free (hll.registers);
+}
+
+/* --approx-counts K counts every line in a Count-Min sketch of
+   CM_DEPTH rows of 2^CM_L2_WIDTH counters, row I's counter being
+   chosen by the two halves H1 + I * H2 of the line's 64-bit hash. A
+   line's estimate is the least of its counters, which are only raised
+   to one more than that (conservative update). The CM_KEEP * K lines
+   with the highest estimates so far are kept by name in a min-heap,
+   found through a dictionary of their positions in it, and counted
+   exactly from when they enter it: the sketch only decides which
+   lines are kept, and the counts printed are never over the true
+   ones. Keeping more lines than are printed means that those near the
+   top are seldom pushed out early on, when all the estimates are low,
+   to be counted again from scratch. */
+#define CM_DEPTH 4
+#define CM_L2_WIDTH 18
+#define CM_KEEP 4
+
+typedef struct Heavy Heavy;
+struct Heavy
+{
+  uint32_t estimate;            /* The heap's order */
+  uint32_t count;               /* Exact, since the line was kept */
+  const char *line;             /* The dictionary's copy */
+};
+
+typedef struct Cm Cm;
+struct Cm
+{
+  uint32_t *counters;
+  unsigned k, n_heavy;
+  Heavy *heavy;
+  Dict *positions;
+};
+
+static uint32_t
+cm_add (Cm *cm, unsigned long long hash)
+{
+  uint32_t *c[CM_DEPTH], min = UINT32_MAX;
+  uint32_t h1 = hash >> 32, h2 = hash | 1;
   int i;
+  for (i = 0; i < CM_DEPTH; i++)
+    {
+      c[i] = &cm->counters[(i << CM_L2_WIDTH)
+                           + ((h1 + i * h2) >> (32 - CM_L2_WIDTH))];
+      if (*c[i] < min)
+        min = *c[i];
+    }
+  if (min == UINT32_MAX)
+    return min;
+  for (i = 0; i < CM_DEPTH; i++)
+    if (*c[i] == min)
+      (*c[i])++;
+  return min + 1;
+}
+
+static void
+heavy_set (Cm *cm, unsigned i, Heavy h)
+{
+  cm->heavy[i] = h;
+  dict_get_entry (cm->positions, h.line)->value = (void *)(intptr_t)i;
+}
+
+/* Restore the heap from I down, its estimate having risen. */
+static void
+heavy_sift (Cm *cm, unsigned i)
+{
+  Heavy h = cm->heavy[i];
+  for (;;)
+    {
+      unsigned child = 2 * i + 1;
+      if (child >= cm->n_heavy)
+        break;
+      if (child + 1 < cm->n_heavy
+          && cm->heavy[child + 1].estimate < cm->heavy[child].estimate)
+        child++;
+      if (cm->heavy[child].estimate >= h.estimate)
+        break;
+      heavy_set (cm, i, cm->heavy[child]);
+      i = child;
+    }
+  heavy_set (cm, i, h);
+}
+
+static void
+cm_add_lines (char *start, char *end, void *cl)
+{
+  Cm *cm = cl;
+  char *line, *nl;
+  for (line = start; line < end; line = nl + 1)
+    {
+      DictKey key;
+      DictEntry *de;
+      uint32_t estimate;
+      nl = memchr (line, '\n', end - line);
+      *nl = '\0';
+      estimate = cm_add (cm, dict_strhash_seeded (line, 0));
+      /* Each line's estimate rises with every occurrence, so those
+         kept have had estimates above the least of them. This one
+         isn't, and needn't be. */
+      if (cm->n_heavy == cm->k && estimate <= cm->heavy[0].estimate)
+        continue;
+      key = dict_key (&strkeyfuncs, line);
+      if ((de = dict_get_entry_hashed (cm->positions, &key)))
+        {
+          unsigned i = (intptr_t)de->value;
+          cm->heavy[i].estimate = estimate;
+          cm->heavy[i].count++;
+          heavy_sift (cm, i);
+        }
+      else if (cm->n_heavy < cm->k)
+        {
+          unsigned i = cm->n_heavy++;
+          Heavy h;
+          dict_set_hashed (cm->positions, &key, NULL);
+          h.estimate = estimate;
+          h.count = 1;
+          h.line = dict_get_entry_hashed (cm->positions, &key)->key;
+          /* Rise from the bottom */
+          for (; i > 0 && cm->heavy[(i - 1) / 2].estimate > estimate;
+               i = (i - 1) / 2)
+            heavy_set (cm, i, cm->heavy[(i - 1) / 2]);
+          heavy_set (cm, i, h);
+        }
+      else if (estimate > cm->heavy[0].estimate)
+        {
+          Heavy h;
+          dict_delete (cm->positions, cm->heavy[0].line);
+          dict_set_hashed (cm->positions, &key, NULL);
+          h.estimate = estimate;
+          h.count = 1;
+          h.line = dict_get_entry_hashed (cm->positions, &key)->key;
+          cm->heavy[0] = h;
+          heavy_sift (cm, 0);
+        }
+    }
+}
+
+static int
+heavy_cmp (const void *a, const void *b)
+{
+  const Heavy *x = a, *y = b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1
+    : strcmp (x->line, y->line);
+}
+
+static void
+approx_counts (unsigned k)
+{
+  Cm cm;
+  unsigned i;
+  cm.counters = calloc (CM_DEPTH << CM_L2_WIDTH, sizeof *cm.counters);
+  cm.k = CM_KEEP * k;
+  cm.n_heavy = 0;
+  cm.heavy = malloc (cm.k * sizeof *cm.heavy);
+  cm.positions = dict_new (&strkeyfuncs);
+  read_blocks (STDIN_FILENO, BLOCK_SIZE, cm_add_lines, &cm);
+  qsort (cm.heavy, cm.n_heavy, sizeof *cm.heavy, heavy_cmp);
+  for (i = 0; i < cm.n_heavy && i < k; i++)
+    fprintf (stdout, "%10u %s\n", cm.heavy[i].count, cm.heavy[i].line);
+  dict_free (cm.positions);
+  free (cm.heavy);
+  free (cm.counters);
+}
+
+/* A number of bytes, perhaps in k, M or G, or 0 if it isn't one. */
+static size_t
+parse_size (const char *arg)
+{
+  char *end;
+  unsigned long long n = strtoull (arg, &end, 10);
+  switch (*end)
+    {
+    case 'G':
+      n <<= 10;
+      /* Fall through */
+    case 'M':
+      n <<= 10;
+      /* Fall through */
+    case 'k':
+    case 'K':
+      n <<= 10;
+      end++;
+    }
+  return *end || n > SIZE_MAX ? 0 : n;
+}
+
+int main (int argc, char *argv[])
+{
+  /* Ordered, so that counts come out in order of first appearance */
+  Dict *lines;
+  DictEntry *de;
+  FILE *rest = NULL;
+  Record r = { 0 };
+  int i, n_jobs = 1, precision = 0, n_heavy = 0;
 
   for (i = 1; i < argc; i++)
     {
@@ -31,44 +784,72 @@ int main (int argc, char *argv[])
         show_dot = 1;
       else if (!strcmp(argv[i], "-m"))
         show_dump = 1;
+      else if (!strcmp(argv[i], "-j") && i + 1 < argc
+               && (n_jobs = atoi (argv[i + 1])) >= 1 && n_jobs <= MAX_JOBS)
+        i++;
+      else if (!strcmp(argv[i], "--memory-limit") && i + 1 < argc
+               && (memory_limit = parse_size (argv[i + 1])))
+        i++;
+      else if (!strcmp(argv[i], "--approx-distinct") && i + 1 < argc
+               && (precision = atoi (argv[i + 1])) >= 4 && precision <= 16)
+        i++;
+      else if (!strcmp(argv[i], "--approx-counts") && i + 1 < argc
+               && (n_heavy = atoi (argv[i + 1])) >= 1)
+        i++;
       else
         {
-          fprintf (stderr, "Syntax: %s [-c] [-d]\n", argv[0]);
+          fprintf (stderr, "Syntax: %s [-c] [-d] [-m] [-j jobs]"
+                   " [--memory-limit bytes[kMG]]\n"
+                   "       %s --approx-distinct precision(4-16)\n"
+                   "       %s --approx-counts lines\n",
+                   argv[0], argv[0], argv[0]);
           return EXIT_FAILURE;
         }
     }
-
-  /* Iterate over input lines. */
-  while (!feof(stdin))
+  if (memory_limit && memory_limit < MIN_MEMORY_LIMIT)
+    memory_limit = MIN_MEMORY_LIMIT;
+  if (n_jobs > 1 && memory_limit)
     {
-      char buffer[BUFSIZ];
-      
-      if (fgets(buffer, BUFSIZ, stdin))
-	{
-	  char *end;
-	  int *data;
-	  /* chomp the input */
-	  end = buffer;
-	  while (*end && *end != '\n') end++;
-	  *end = '\0';
+      fprintf (stderr, "%s: -j and --memory-limit don't mix\n", argv[0]);
+      return EXIT_FAILURE;
+    }
 
-          data = dict_get (lines, buffer);
-          if (!data)
-            {
-              fprintf (stdout, "%s\n", buffer);
-              data = malloc (sizeof (int));
-              *data = 0;
-              dict_insert (lines, buffer, data);
-            }
-          (*data)++;
-	}
+  setvbuf (stdout, NULL, _IOFBF, BLOCK_SIZE);
+  if (precision)
+    {
+      approx_distinct (precision);
+      return EXIT_SUCCESS;
+    }
+  if (n_heavy)
+    {
+      approx_counts (n_heavy);
+      return EXIT_SUCCESS;
+    }
+  if (n_jobs > 1)
+    {
+      guniq_jobs (n_jobs);
+      return EXIT_SUCCESS;
+    }
+  lines = dict_new_strarena_with_buckets (DICT_BUCKETS_ORDERED);
+  read_blocks (STDIN_FILENO, BLOCK_SIZE, add_lines, lines);
+  if (spill)
+    {
+      rest = spill_finish (spill);
+      while (read_record (rest, &r, true))
+        fprintf (stdout, "%s\n", r.line);
     }
   if (show_counts)
     {
       /* Iterate over hash and emit counts and strings. */
       for (de = dict_first (lines); de; de = dict_next (lines, de))
         fprintf (stdout, "%10d %s\n",
-                 *(int *)de->value, (const char *)de->key);
+                 (int)(intptr_t)de->value, (const char *)de->key);
+      if (rest)
+        {
+          rewind (rest);
+          while (read_record (rest, &r, true))
+            fprintf (stdout, "%10d %s\n", (int)r.count, r.line);
+        }
     }
   if (show_dot)
     {
@@ -79,10 +860,10 @@ int main (int argc, char *argv[])
       dict_dump (lines, stdout, dot_count);
     }
 
-  /* Free. */
-  for (de = dict_first (lines); de; de = dict_next (lines, de))
-    free (de->value);
   dict_free (lines);
+  if (rest)
+    fclose (rest);
+  free (r.line);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Test guniq: every way of running it must print what awk does.
+#
+# Usage: test_guniq.sh [path to guniq]
+
+GUNIQ=${1:-./guniq}
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+failures=0
+
+# Lines in order of first appearance, then with -c their counts
+expect ()
+{
+  awk -v counts="$1" '
+    !($0 in n) { line[lines++] = $0; print }
+    { n[$0]++ }
+    END { if (counts) for (i = 0; i < lines; i++)
+            printf "%10d %s\n", n[line[i]], line[i] }'
+}
+
+check ()
+{
+  input=$1
+  shift
+  if ! "$GUNIQ" "$@" < "$DIR/$input" > "$DIR/out" \
+     || ! cmp -s "$DIR/out" "$DIR/$input.expect$counts"
+  then
+    echo "FAIL: guniq $* < $input"
+    failures=$((failures + 1))
+  fi
+}
+
+# Many distinct lines, some often repeated: enough to spill at 1M
+awk 'BEGIN { srand (1)
+             for (i = 0; i < 400000; i++)
+               printf "line %d of many\n", int (rand () * rand () * 200000) }' \
+  > "$DIR/many"
+
+# Lines longer than guniq's 1M blocks, repeated, with no final newline
+awk 'BEGIN { a = "a"; while (length (a) < 3000000) a = a a
+             for (i = 0; i < 3; i++) print a i; print "short"; print a 0
+             printf "%s", a 1 }' > "$DIR/long"
+
+for input in many long
+do
+  expect "" < "$DIR/$input" > "$DIR/$input.expect"
+  expect 1 < "$DIR/$input" > "$DIR/$input.expect-c"
+  for counts in "" -c
+  do
+    check $input $counts
+    check $input $counts --memory-limit 1M
+    check $input $counts -j 1
+    check $input $counts -j 4
+  done
+done
+
+if [ $failures -ne 0 ]
+then
+  echo FAILED
+  exit 1
+fi
+echo PASSED